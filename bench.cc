@@ -0,0 +1,313 @@
+/*
+ * KAAL
+ *
+ * Copyright 2013 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamäki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * lgpl-2.1.txt file.
+ */
+#include "bench.h"
+#include "gfx.h"
+#include "system.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+
+namespace {
+
+/* The sscanf() based parser load_mesh() used to have, kept for comparison.
+ * Reads the file through a 256 byte line buffer and collects the faces to
+ * a list. */
+void legacy_load_mtl(Mesh *mesh, const char *fname)
+{
+	PackFile f;
+	f.open(fname);
+
+	Material *material = NULL;
+	char line[256];
+	size_t avail = 0;
+	while (1) {
+		line[avail] = 0;
+		char *end = strchr(line, '\n');
+		if (end == NULL) {
+			avail += f.read(&line[avail], sizeof line - avail - 1);
+			line[avail] = 0;
+			end = strchr(line, '\n');
+		}
+		if (end != NULL) *end = 0;
+		char *p = line;
+
+		if (match(p, "newmtl")) {
+			std::string name = token(p);
+			auto iter = mesh->materials.find(name);
+			if (iter == mesh->materials.end()) {
+				material = new Material;
+				material->frame = 0;
+				material->num_frames = 0;
+				material->num_cols = 0;
+				material->brightness = 0;
+				material->color = Color(1, 1, 1);
+				material->light_color = Color(1, 1, 1);
+				material->texture = NULL;
+				mesh->materials[name] = material;
+			} else {
+				material = iter->second;
+			}
+
+		} else if (match(p, "Kd")) {
+			assert(material != NULL);
+			Color color(1, 1, 1);
+			if (sscanf(p, "%f%f%f", &color.r, &color.g, &color.b) != 3) {
+				throw std::runtime_error("Invalid color");
+			}
+			if (material->texture == NULL) {
+				material->color = color;
+				material->light_color = color;
+			}
+
+		} else if (match(p, "map_Kd")) {
+			assert(material != NULL);
+			std::string fname = token(p);
+			material->texture = get_texture(fname.c_str());
+			material->color = Color(1, 1, 1);
+			material->light_color = material->texture->color();
+		}
+
+		if (end == NULL) break;
+		++end;
+		avail -= end - line;
+		memmove(line, end, avail);
+	}
+}
+
+void legacy_load_mesh(Mesh *mesh, std::list<Face> *faces, const char *fname)
+{
+	PackFile f;
+	f.open(fname);
+
+	Material *material = NULL;
+	std::vector<vec3> vert;
+	std::vector<vec3> norm;
+	std::vector<vec2> tc;
+
+	char line[256];
+	size_t avail = 0;
+	while (1) {
+		line[avail] = 0;
+		char *end = strchr(line, '\n');
+		if (end == NULL) {
+			avail += f.read(&line[avail], sizeof line - avail - 1);
+			line[avail] = 0;
+			end = strchr(line, '\n');
+		}
+		if (end != NULL) *end = 0;
+		char *p = line;
+
+		if (match(p, "v")) {
+			vec3 v;
+			if (sscanf(p, "%f%f%f", &v.x, &v.y, &v.z) != 3) {
+				throw std::runtime_error("invalid vertex");
+			}
+			vert.push_back(v);
+
+		} else if (match(p, "vn")) {
+			vec3 v;
+			if (sscanf(p, "%f%f%f", &v.x, &v.y, &v.z) != 3) {
+				throw std::runtime_error("invalid vertex");
+			}
+			norm.push_back(v);
+
+		} else if (match(p, "vt")) {
+			vec2 v;
+			if (sscanf(p, "%f%f", &v.x, &v.y) != 2) {
+				throw std::runtime_error("invalid vertex");
+			}
+			v.y = 1 - v.y;
+			tc.push_back(v);
+
+		} else if (match(p, "mtllib")) {
+			std::string fname = token(p);
+			/* Animation frames usually share the same library */
+			size_t payload = pack_payload(fname.c_str());
+			if (mesh->mtllibs.insert(payload).second) {
+				legacy_load_mtl(mesh, fname.c_str());
+			}
+			material = NULL;
+
+		} else if (match(p, "usemtl")) {
+			auto iter = mesh->materials.find(token(p));
+			if (iter == mesh->materials.end()) {
+				throw std::runtime_error("Undefined material");
+			}
+			material = iter->second;
+
+		} else if (match(p, "f")) {
+			assert(material != NULL);
+			Face f;
+			f.mat = material;
+			for (int i = 0; i < 3; ++i) {
+				size_t idx = strtoul(p, &p, 10);
+				if (idx <= 0 || idx > vert.size()) {
+					throw std::runtime_error(std::string("Invalid vertex: ") +
+								 line);
+				}
+				f.vert[i].vert = vert[idx - 1];
+				if (*p == '/') {
+					++p;
+					if (*p != '/') {
+						idx = strtoul(p, &p, 10);
+						assert(idx > 0 &&
+							idx <= tc.size());
+						f.vert[i].tc = tc[idx - 1];
+					} else {
+						f.vert[i].tc = vec2(0, 0);
+					}
+				}
+				if (*p == '/') {
+					++p;
+					idx = strtoul(p, &p, 10);
+					assert(idx > 0 && idx <= norm.size());
+					f.vert[i].norm = norm[idx - 1];
+				} else {
+					f.vert[i].norm = vec3(0, 0, 0);
+				}
+			}
+			while (isspace(*p)) ++p;
+			if (*p != 0) {
+				throw std::runtime_error("Triangles expected");
+			}
+			faces->push_back(f);
+		}
+
+		if (end == NULL) break;
+		++end;
+		avail -= end - line;
+		memmove(line, end, avail);
+	}
+}
+
+void free_materials(Mesh *mesh)
+{
+	for (auto iter : mesh->materials) {
+		delete iter.second;
+	}
+	mesh->materials.clear();
+}
+
+bool same_pos(const vec3 &a, const vec3 &b)
+{
+	return length(a - b) <= 1e-5 * std::max(1.0, length(a));
+}
+
+void compare(const std::list<Face> &old_faces, const Mesh &mesh,
+	     const char *fname)
+{
+	if (old_faces.size() != mesh.faces.size()) {
+		throw std::runtime_error(std::string("Face count differs: ") +
+					 fname);
+	}
+	auto iter = mesh.faces.begin();
+	for (const Face &a : old_faces) {
+		const Face &b = *iter++;
+		if (a.mat->color.r != b.mat->color.r ||
+		    a.mat->texture != b.mat->texture) {
+			throw std::runtime_error(
+				std::string("Material differs: ") + fname);
+		}
+		for (int i = 0; i < 3; ++i) {
+			const Vertex &u = a.vert[i];
+			const Vertex &v = b.vert[i];
+			if (!same_pos(u.vert, v.vert) || !same_pos(u.norm, v.norm) ||
+			    !same_pos(vec3(u.tc.x, u.tc.y, 0),
+				   vec3(v.tc.x, v.tc.y, 0))) {
+				throw std::runtime_error(
+					std::string("Vertex differs: ") +
+					fname);
+			}
+		}
+	}
+}
+
+void verify(const char *fname)
+{
+	Mesh old_mesh;
+	std::list<Face> old_faces;
+	Mesh mesh;
+	try {
+		legacy_load_mesh(&old_mesh, &old_faces, fname);
+		load_mesh(&mesh, fname);
+		compare(old_faces, mesh, fname);
+	} catch (...) {
+		free_materials(&old_mesh);
+		free_materials(&mesh);
+		throw;
+	}
+	free_materials(&old_mesh);
+	free_materials(&mesh);
+}
+
+void parse_old(const char *fname)
+{
+	Mesh mesh;
+	std::list<Face> faces;
+	legacy_load_mesh(&mesh, &faces, fname);
+	free_materials(&mesh);
+}
+
+void parse_new(const char *fname)
+{
+	Mesh mesh;
+	load_mesh(&mesh, fname);
+	free_materials(&mesh);
+}
+
+/* Milliseconds per parse, repeated until the timer is accurate enough */
+double measure(void (*parse)(const char *), const char *fname)
+{
+	Uint32 start = SDL_GetTicks();
+	int count = 0;
+	do {
+		parse(fname);
+		count++;
+	} while (SDL_GetTicks() - start < 200);
+	return (SDL_GetTicks() - start) / (double) count;
+}
+
+struct Result {
+	std::string fname;
+	double old_time;
+	double new_time;
+};
+
+}
+
+void bench_meshes()
+{
+	std::vector<std::string> fnames = list_pack(".obj");
+	std::vector<Result> results;
+	for (const std::string &fname : fnames) {
+		Result result;
+		result.fname = fname;
+		try {
+			verify(fname.c_str());
+			result.old_time = measure(parse_old, fname.c_str());
+			result.new_time = measure(parse_new, fname.c_str());
+		} catch (const std::exception &e) {
+			printf("%s: %s\n", fname.c_str(), e.what());
+			continue;
+		}
+		results.push_back(result);
+	}
+
+	double old_total = 0, new_total = 0;
+	printf("%-32s %10s %10s\n", "mesh", "old (ms)", "new (ms)");
+	for (const Result &r : results) {
+		printf("%-32s %10.2f %10.2f %5.1fx\n", r.fname.c_str(),
+		       r.old_time, r.new_time, r.old_time / r.new_time);
+		old_total += r.old_time;
+		new_total += r.new_time;
+	}
+	printf("%-32s %10.2f %10.2f %5.1fx\n", "total", old_total,
+	       new_total, old_total / new_total);
+}
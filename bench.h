@@ -0,0 +1,17 @@
+/*
+ * KAAL
+ *
+ * Copyright 2013 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamäki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * lgpl-2.1.txt file.
+ */
+#ifndef __bench_h__
+#define __bench_h__
+
+/* Compares load_mesh() with the old sscanf() based parser on every OBJ in
+ * the pack. Textures must be loaded. */
+void bench_meshes();
+
+#endif
@@ -0,0 +1,338 @@
+#!/usr/bin/python
+"""
+  KAAL
+
+  Copyright 2013 Janne Kulmala <janne.t.kulmala@iki.fi>,
+  Antti Rajamaki <amikaze@gmail.com>
+
+  Program code and resources are licensed with GNU LGPL 2.1. See
+  lgpl-2.1.txt file.
+
+  Compiles OBJ meshes to the binary format which the game loads without
+  parsing. Given several files, they are the frames of an animation.
+
+  Usage: compile-mesh.py OUTPUT FRAMES...
+
+  Mesh layout (all integers and floats are little endian):
+
+    header    "KMSH", u32 version, u32 number of frames,
+              u32 number of material libraries, u32 number of groups,
+              f32 midpos[3], f32 radius
+    mtllibs   char name[48] (NUL padded) for each library
+    groups    char material[64] (NUL padded), f32 midpos[3],
+              u32 vertex count, u32 index count for each group
+    indices   the indices of each group
+    frames    u32 shadow vertex count, u32 collision face count, followed
+              by the vertices of each group, the shadow volume quads and
+              the collision faces
+
+  A vertex is f32 vert[3], norm[3], tc[2]. A collision face is
+  f32 vert[3][3], edges[3][3], norm[3]. The data is not scaled, the game
+  does that.
+
+  Vertices of a group which are identical in every frame are merged, and
+  all frames share the indices. The triangles are ordered for the vertex
+  cache. The indices are u16 if the group has at most 65536 vertices,
+  otherwise u32. u16 indices are padded to a multiple of four bytes.
+"""
+import math
+import os
+import sys
+import struct
+
+MESH_VERSION = 3
+NAME_LEN = 48
+MATERIAL_LEN = 64
+# Should match RENDER_DIST and VERTEX_CACHE_SIZE in the game
+RENDER_DIST = 1500
+VERTEX_CACHE_SIZE = 32
+# The game makes these transparent (alpha 0) after loading, see
+# World::load(). The MTL files do not give the alpha.
+INVISIBLE_MATERIALS = ['invisiblewall']
+
+def sub(a, b):
+	return (a[0] - b[0], a[1] - b[1], a[2] - b[2])
+
+def dot(a, b):
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]
+
+def cross(a, b):
+	return (a[1] * b[2] - a[2] * b[1],
+		a[2] * b[0] - a[0] * b[2],
+		a[0] * b[1] - a[1] * b[0])
+
+def normalize(v):
+	l = math.sqrt(dot(v, v))
+	if l < 1e-6:
+		return (0.0, 0.0, 0.0)
+	return (v[0] / l, v[1] / l, v[2] / l)
+
+def load_obj(fname):
+	"""Returns the material libraries and a list of faces, which are
+	(material, [(vert, norm, tc)] * 3)"""
+	mtllibs = []
+	faces = []
+	vert = []
+	norm = []
+	tc = []
+	material = None
+	for line in open(fname, 'rb'):
+		fields = line.decode('latin-1').split()
+		if not fields: continue
+		if fields[0] == 'v':
+			vert.append(tuple(float(x) for x in fields[1:4]))
+		elif fields[0] == 'vn':
+			norm.append(tuple(float(x) for x in fields[1:4]))
+		elif fields[0] == 'vt':
+			tc.append((float(fields[1]), 1 - float(fields[2])))
+		elif fields[0] == 'mtllib':
+			mtllibs.append(fields[1])
+		elif fields[0] == 'usemtl':
+			material = fields[1]
+		elif fields[0] == 'f':
+			if len(fields) != 4:
+				sys.exit('%s: Triangles expected' % fname)
+			if material is None:
+				sys.exit('%s: Undefined material' % fname)
+			verts = []
+			for field in fields[1:]:
+				idx = (field.split('/') + ['', ''])[:3]
+				v = vert[int(idx[0]) - 1]
+				n = (0.0, 0.0, 0.0)
+				t = (0.0, 0.0)
+				if idx[1]: t = tc[int(idx[1]) - 1]
+				if idx[2]: n = norm[int(idx[2]) - 1]
+				verts.append((v, n, t))
+			faces.append((material, verts))
+	return mtllibs, faces
+
+def face_normal(verts):
+	return normalize(cross(sub(verts[1][0], verts[0][0]),
+			       sub(verts[2][0], verts[0][0])))
+
+def coll_face(verts, n):
+	"""Vertices, edge vectors and the normal of a collision face"""
+	out = []
+	for i in range(3):
+		out += verts[i][0]
+	for i in range(3):
+		d = sub(verts[(i + 1) % 3][0], verts[i][0])
+		out += normalize(cross(n, d))
+	out += n
+	return out
+
+def bounds(points):
+	box_min = [min(p[i] for p in points) for i in range(3)]
+	box_max = [max(p[i] for p in points) for i in range(3)]
+	return [(box_min[i] + box_max[i]) * 0.5 for i in range(3)]
+
+def compile_frame(faces, drawn, groups):
+	"""Returns the vertices of each group, the shadow volume, the
+	collision faces and the positions covered by the frame"""
+	vertices = dict((mat, []) for mat in groups)
+	shadow = []
+	coll = []
+	points = []
+	for j, (mat, verts) in enumerate(faces):
+		n = face_normal(verts)
+		if dot(n, n) >= 1e-8:
+			coll.append(coll_face(verts, n))
+		if not drawn[j]:
+			continue
+
+		for v in verts:
+			points.append(v[0])
+			vertices[mat].append(v[0] + v[1] + v[2])
+
+		# Shadow volume which extrudes from each edge
+		for i in range(3):
+			v1 = verts[i][0] + n
+			v2 = verts[(i + 1) % 3][0] + n
+			shadow.append(v2 + (0.0, 0.0))
+			shadow.append(v1 + (0.0, 0.0))
+			shadow.append(v1 + (RENDER_DIST, 0.0))
+			shadow.append(v2 + (RENDER_DIST, 0.0))
+	return vertices, shadow, coll, points
+
+def vertex_score(cache_pos, remaining):
+	if remaining == 0:
+		return -1
+	score = 0
+	if cache_pos >= 3:
+		score = math.pow(1 - (cache_pos - 3) /
+				 float(VERTEX_CACHE_SIZE - 3), 1.5)
+	elif cache_pos >= 0:
+		# The last triangle was just drawn
+		score = 0.75
+	# Finish off vertices with only a few triangles left
+	return score + 2 / math.sqrt(remaining)
+
+def optimize_triangles(indices, num_verts):
+	"""Reorders the triangles for the vertex cache, exactly like
+	optimize_triangles() in the game"""
+	num_tris = len(indices) // 3
+
+	# Triangles which use each vertex and have not been drawn yet
+	remaining = [0] * num_verts
+	for i in indices:
+		remaining[i] += 1
+	first = [0] * (num_verts + 1)
+	for i in range(num_verts):
+		first[i + 1] = first[i] + remaining[i]
+	tris = [0] * len(indices)
+	fill = first[:-1]
+	for i, v in enumerate(indices):
+		tris[fill[v]] = i // 3
+		fill[v] += 1
+
+	cache_pos = [-1] * num_verts
+	score = [vertex_score(-1, r) for r in remaining]
+	drawn = [False] * num_tris
+	out = []
+	cache = []
+	next_tri = 0
+	while len(out) < len(indices):
+		# The best triangle which uses a vertex in the cache
+		best = None
+		best_score = -1
+		for v in cache:
+			for t in tris[first[v]:first[v] + remaining[v]]:
+				s = score[indices[t * 3]] + \
+				    score[indices[t * 3 + 1]] + \
+				    score[indices[t * 3 + 2]]
+				if s > best_score:
+					best_score = s
+					best = t
+		if best is None:
+			while drawn[next_tri]:
+				next_tri += 1
+			best = next_tri
+
+		drawn[best] = True
+		for v in indices[best * 3:best * 3 + 3]:
+			out.append(v)
+			j = tris.index(best, first[v])
+			remaining[v] -= 1
+			tris[j] = tris[first[v] + remaining[v]]
+			if v in cache:
+				cache.remove(v)
+			cache.insert(0, v)
+
+		for i, v in enumerate(cache):
+			cache_pos[v] = i if i < VERTEX_CACHE_SIZE else -1
+			score[v] = vertex_score(cache_pos[v], remaining[v])
+		del cache[VERTEX_CACHE_SIZE:]
+	return out
+
+def index_vertices(keyframes):
+	"""Merges the vertices of triangle lists which are identical in every
+	keyframe. Returns the packed vertices of each keyframe in the order
+	they are first used and the packed indices"""
+	welded = {}
+	corners = []
+	indices = []
+	for i in range(len(keyframes[0])):
+		# Compared as stored, like the game does
+		key = b''.join(pack_floats(keyframe[i]) for keyframe in keyframes)
+		if key not in welded:
+			welded[key] = len(corners)
+			corners.append(i)
+		indices.append(welded[key])
+
+	remap = {}
+	order = []
+	ordered = []
+	for i in optimize_triangles(indices, len(corners)):
+		if i not in remap:
+			remap[i] = len(order)
+			order.append(corners[i])
+		ordered.append(remap[i])
+
+	out = [[pack_floats(keyframe[i]) for i in order]
+	       for keyframe in keyframes]
+	if len(order) <= 0x10000:
+		packed = struct.pack('<%dH' % len(ordered), *ordered)
+		if len(ordered) & 1:
+			packed += b'\0\0'
+	else:
+		packed = struct.pack('<%dI' % len(ordered), *ordered)
+	return out, packed
+
+def pack_floats(values):
+	return struct.pack('<%df' % len(values), *values)
+
+def pack_vertices(vertices):
+	return pack_floats([x for v in vertices for x in v])
+
+def pack_name(name, length, fname):
+	if len(name) >= length:
+		sys.exit('%s: Name too long: %s' % (fname, name))
+	return struct.pack('%ds' % length, name.encode('ascii'))
+
+if len(sys.argv) < 3:
+	sys.exit('Usage: compile-mesh.py OUTPUT FRAMES...')
+output = sys.argv[1]
+frames = sorted(sys.argv[2:], key=lambda fname: os.path.basename(fname))
+
+meshes = [load_obj(fname) for fname in frames]
+mtllibs, faces = meshes[0]
+for fname, mesh in zip(frames, meshes):
+	if [mat for mat, verts in mesh[1]] != [mat for mat, verts in faces]:
+		sys.exit('%s: Faces differ from the first frame' % fname)
+
+groups = []
+for mat, verts in faces:
+	if mat not in groups:
+		groups.append(mat)
+
+# All keyframes draw the same faces, the ones which are not empty in the
+# first frame
+drawn = []
+for mat, verts in faces:
+	n = face_normal(verts)
+	if dot(n, n) < 1e-8:
+		print('an empty face')
+	drawn.append(dot(n, n) >= 1e-8)
+
+compiled = [compile_frame(frame_faces, drawn, groups)
+	    for libs, frame_faces in meshes]
+indexed = [index_vertices([frame[0][mat] for frame in compiled])
+	   for mat in groups]
+
+# The bounding box of the first frame and the radius covering the drawn,
+# visible faces of all frames
+midpos = bounds(compiled[0][3])
+radius = 0
+for libs, frame_faces in meshes:
+	for j, (mat, verts) in enumerate(frame_faces):
+		if not drawn[j] or mat in INVISIBLE_MATERIALS:
+			continue
+		for v in verts:
+			delta = sub(v[0], midpos)
+			radius = max(radius, dot(delta, delta))
+radius = math.sqrt(radius)
+
+out = [struct.pack('<4sIIII', b'KMSH', MESH_VERSION, len(meshes),
+		   len(mtllibs), len(groups)), pack_floats(midpos + [radius])]
+for name in mtllibs:
+	out.append(pack_name(name, NAME_LEN, frames[0]))
+for mat, (vertices, indices) in zip(groups, indexed):
+	points = [v[0:3] for v in compiled[0][0][mat]]
+	group_midpos = bounds(points) if points else [0.0, 0.0, 0.0]
+	out.append(pack_name(mat, MATERIAL_LEN, frames[0]))
+	out.append(pack_floats(group_midpos))
+	out.append(struct.pack('<II', len(vertices[0]),
+			       len(compiled[0][0][mat])))
+for vertices, indices in indexed:
+	out.append(indices)
+
+for k, (vertices, shadow, coll, points) in enumerate(compiled):
+	out.append(struct.pack('<II', len(shadow), len(coll)))
+	for keyframes, indices in indexed:
+		out += keyframes[k]
+	out.append(pack_vertices(shadow))
+	out.append(pack_vertices(coll))
+
+fout = open(output, 'wb')
+fout.write(b''.join(out))
+fout.close()
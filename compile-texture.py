@@ -0,0 +1,356 @@
+#!/usr/bin/python
+"""
+  KAAL
+
+  Copyright 2013 Janne Kulmala <janne.t.kulmala@iki.fi>,
+  Antti Rajamaki <amikaze@gmail.com>
+
+  Program code and resources are licensed with GNU LGPL 2.1. See
+  lgpl-2.1.txt file.
+
+  Compiles PNG images to the texture format which the game uploads without
+  decoding. With --atlas, packs several small images to one texture so that
+  the game can draw them without switching textures. With --index, lists
+  the sizes and the colors of compiled textures, so that the game knows them
+  before it loads the textures.
+
+  Usage: compile-texture.py OUTPUT IMAGE
+         compile-texture.py --atlas OUTPUT INDEX IMAGES...
+         compile-texture.py --index OUTPUT TEXTURES...
+
+  Texture layout (all integers and floats are little endian):
+
+    header    "KTEX", u32 version, u32 width, u32 height, u32 GL format,
+              u32 number of levels, f32 average color[3]
+    levels    u32 size followed by the pixels of each mipmap level, from
+              the full size down to 1x1, padded to a multiple of 4 bytes
+
+  The format is GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB or GL_RGBA, the
+  image is expanded like libpng does in the game. The rows are not padded.
+  Each level is the previous one scaled to half with a box filter. The
+  average color is black for grayscale images.
+
+  An atlas is always GL_RGBA. Each image is surrounded by a gutter of
+  ATLAS_GUTTER pixels which repeats its edges, and the images are aligned
+  to it, so the ATLAS_LEVELS levels do not mix the images. The index is
+  text, the first line is the size of the atlas and then a line for each
+  image:
+
+    width height
+    name x y width height r g b
+
+  where x and y are the top left corner in the atlas and r g b is the
+  average color. The texture index is also text, a line for each texture:
+
+    name width height r g b
+"""
+import os
+import struct
+import sys
+import zlib
+
+TEXTURE_VERSION = 1
+
+GL_LUMINANCE = 0x1909
+GL_LUMINANCE_ALPHA = 0x190a
+GL_RGB = 0x1907
+GL_RGBA = 0x1908
+FORMATS = {1: GL_LUMINANCE, 2: GL_LUMINANCE_ALPHA, 3: GL_RGB, 4: GL_RGBA}
+
+# PNG color types
+GRAY = 0
+RGB = 2
+PALETTE = 3
+GRAY_ALPHA = 4
+RGB_ALPHA = 6
+CHANNELS = {GRAY: 1, RGB: 3, PALETTE: 1, GRAY_ALPHA: 2, RGB_ALPHA: 4}
+
+# Should match ATLAS_GUTTER in the game
+ATLAS_GUTTER = 16
+ATLAS_LEVELS = 5
+ATLAS_MAX_SIZE = 2048
+
+def read_chunks(fname):
+	data = open(fname, 'rb').read()
+	if data[:8] != b'\x89PNG\r\n\x1a\n':
+		sys.exit('%s: Invalid PNG' % fname)
+	pos = 8
+	chunks = []
+	while pos < len(data):
+		length, kind = struct.unpack('>I4s', data[pos:pos + 8])
+		chunks.append((kind, data[pos + 8:pos + 8 + length]))
+		pos += length + 12
+	return chunks
+
+def paeth(a, b, c):
+	p = a + b - c
+	pa = abs(p - a)
+	pb = abs(p - b)
+	pc = abs(p - c)
+	if pa <= pb and pa <= pc:
+		return a
+	if pb <= pc:
+		return b
+	return c
+
+def unfilter(data, width, height, bpp, stride):
+	"""Returns the rows of the image without the filters"""
+	rows = []
+	prev = bytearray(stride)
+	pos = 0
+	for y in range(height):
+		kind = data[pos]
+		row = data[pos + 1:pos + 1 + stride]
+		pos += stride + 1
+		if kind == 1:
+			for i in range(bpp, stride):
+				row[i] = (row[i] + row[i - bpp]) & 0xff
+		elif kind == 2:
+			row = bytearray((a + b) & 0xff for a, b in zip(row, prev))
+		elif kind == 3:
+			for i in range(stride):
+				left = row[i - bpp] if i >= bpp else 0
+				row[i] = (row[i] + ((left + prev[i]) >> 1)) & 0xff
+		elif kind == 4:
+			for i in range(stride):
+				if i >= bpp:
+					left = row[i - bpp]
+					corner = prev[i - bpp]
+				else:
+					left = corner = 0
+				row[i] = (row[i] + paeth(left, prev[i], corner)) & 0xff
+		elif kind != 0:
+			sys.exit('Unknown PNG filter %d' % kind)
+		rows.append(row)
+		prev = row
+	return rows
+
+def unpack_bits(row, width, depth):
+	"""Samples of less than 8 bits to one byte each"""
+	if depth == 8:
+		return row
+	per_byte = 8 // depth
+	mask = (1 << depth) - 1
+	out = bytearray(width)
+	for x in range(width):
+		shift = 8 - depth * (x % per_byte + 1)
+		out[x] = (row[x // per_byte] >> shift) & mask
+	return out
+
+def load_png(fname):
+	"""Returns the width, height, number of channels and the pixels"""
+	chunks = read_chunks(fname)
+	header = chunks[0][1]
+	width, height, depth, color, compression, filters, interlace = \
+		struct.unpack('>IIBBBBB', header)
+	if depth > 8 or interlace:
+		sys.exit('%s: Unsupported PNG' % fname)
+	idat = b''.join(data for kind, data in chunks if kind == b'IDAT')
+	palette = b''.join(data for kind, data in chunks if kind == b'PLTE')
+	trns = b''.join(data for kind, data in chunks if kind == b'tRNS')
+
+	channels = CHANNELS[color]
+	bpp = max(1, channels * depth // 8)
+	stride = (width * channels * depth + 7) // 8
+	rows = unfilter(bytearray(zlib.decompress(idat)), width, height,
+			bpp, stride)
+	rows = [unpack_bits(row, width * channels, depth) for row in rows]
+
+	# Expand palettes, small grayscale values and the transparent color
+	if color == PALETTE:
+		palette = bytearray(palette)
+		alpha = bytearray(trns) + bytearray(b'\xff' * 256)
+		if trns:
+			table = [bytes(palette[i * 3:i * 3 + 3] + alpha[i:i + 1])
+				 for i in range(len(palette) // 3)]
+			channels = 4
+		else:
+			table = [bytes(palette[i * 3:i * 3 + 3])
+				 for i in range(len(palette) // 3)]
+			channels = 3
+		rows = [bytearray(b''.join(table[i] for i in row))
+			for row in rows]
+	elif color == GRAY and depth < 8:
+		scale = 255 // ((1 << depth) - 1)
+		rows = [bytearray(i * scale for i in row) for row in rows]
+	if trns and color in (GRAY, RGB):
+		key = bytearray(trns)[1::2]
+		if depth < 8:
+			key = bytearray([key[0] * (255 // ((1 << depth) - 1))])
+		out = []
+		for row in rows:
+			expanded = bytearray()
+			for x in range(width):
+				pixel = row[x * channels:(x + 1) * channels]
+				expanded += pixel
+				expanded.append(0 if pixel == key else 255)
+			out.append(expanded)
+		rows = out
+		channels += 1
+
+	return width, height, channels, bytearray().join(rows)
+
+def average(a, b):
+	return bytearray((x + y + 1) >> 1 for x, y in zip(a, b))
+
+def half(pixels, width, height, channels):
+	"""Box filters the image to half size"""
+	stride = width * channels
+	rows = [pixels[y * stride:(y + 1) * stride] for y in range(height)]
+	if height > 1:
+		rows = [average(rows[y], rows[y + 1])
+			for y in range(0, height, 2)]
+	if width > 1:
+		out = []
+		for row in rows:
+			halved = bytearray(len(row) // 2)
+			for c in range(channels):
+				samples = row[c::channels]
+				halved[c::channels] = average(samples[0::2],
+							      samples[1::2])
+			out.append(halved)
+		rows = out
+	return bytearray().join(rows)
+
+def average_color(pixels, width, height, channels):
+	"""Like the game has done for RGB and RGBA textures"""
+	if channels < 3:
+		return [0.0, 0.0, 0.0]
+	return [sum(pixels[c::channels]) / 255.0 / (width * height)
+		for c in range(3)]
+
+def mipmaps(pixels, width, height, channels, max_levels=None):
+	levels = [pixels]
+	while (width > 1 or height > 1) and len(levels) != max_levels:
+		pixels = half(pixels, width, height, channels)
+		width = max(width // 2, 1)
+		height = max(height // 2, 1)
+		levels.append(pixels)
+	return levels
+
+def write_texture(fname, width, height, channels, levels, color):
+	out = [struct.pack('<4sIIIII3f', b'KTEX', TEXTURE_VERSION, width,
+			   height, FORMATS[channels], len(levels), *color)]
+	for level in levels:
+		out.append(struct.pack('<I', len(level)))
+		out.append(bytes(level))
+		out.append(b'\0' * (-len(level) % 4))
+	fout = open(fname, 'wb')
+	fout.write(b''.join(out))
+	fout.close()
+
+def to_rgba(pixels, channels):
+	if channels == 4:
+		return pixels
+	out = bytearray(len(pixels) // channels * 4)
+	if channels >= 3:
+		for c in range(3):
+			out[c::4] = pixels[c::channels]
+	else:
+		for c in range(3):
+			out[c::4] = pixels[0::channels]
+	if channels == 2:
+		out[3::4] = pixels[1::2]
+	else:
+		out[3::4] = b'\xff' * (len(pixels) // channels)
+	return out
+
+def place(sizes, width, height):
+	"""Places the cells on shelves, from the tallest down. Returns the top
+	left corners, or None if they do not fit"""
+	order = sorted(range(len(sizes)),
+		       key=lambda i: (-sizes[i][1], -sizes[i][0]))
+	corners = [None] * len(sizes)
+	x = y = shelf = 0
+	for i in order:
+		w, h = sizes[i]
+		if x + w > width:
+			x = 0
+			y += shelf
+			shelf = 0
+		if x + w > width or y + h > height:
+			return None
+		corners[i] = (x, y)
+		x += w
+		shelf = max(shelf, h)
+	return corners
+
+def compile_atlas(output, index, fnames):
+	images = []
+	for fname in fnames:
+		width, height, channels, pixels = load_png(fname)
+		if width % ATLAS_GUTTER or height % ATLAS_GUTTER:
+			sys.exit('%s: Size not a multiple of %d' %
+				 (fname, ATLAS_GUTTER))
+		color = average_color(pixels, width, height, channels)
+		images.append((width, height, to_rgba(pixels, channels), color))
+
+	# The smallest power of two which fits, wider than tall
+	sizes = [(w + ATLAS_GUTTER * 2, h + ATLAS_GUTTER * 2)
+		 for w, h, pixels, color in images]
+	width = height = ATLAS_GUTTER * 2
+	while True:
+		corners = place(sizes, width, height)
+		if corners is not None:
+			break
+		if width > height:
+			height *= 2
+		else:
+			width *= 2
+		if width > ATLAS_MAX_SIZE:
+			sys.exit('%s: The images do not fit' % output)
+
+	stride = width * 4
+	atlas = bytearray(stride * height)
+	lines = ['%d %d\n' % (width, height)]
+	for fname, (x, y), (w, h, pixels, color) in \
+			zip(fnames, corners, images):
+		rows = []
+		for row in range(h):
+			line = pixels[row * w * 4:(row + 1) * w * 4]
+			rows.append(line[:4] * ATLAS_GUTTER + line +
+				    line[-4:] * ATLAS_GUTTER)
+		rows = [rows[0]] * ATLAS_GUTTER + rows + \
+		       [rows[-1]] * ATLAS_GUTTER
+		for row, line in enumerate(rows):
+			pos = (y + row) * stride + x * 4
+			atlas[pos:pos + len(line)] = line
+		lines.append('%s %d %d %d %d %.6f %.6f %.6f\n' %
+			     ((os.path.basename(fname), x + ATLAS_GUTTER,
+			       y + ATLAS_GUTTER, w, h) + tuple(color)))
+
+	levels = mipmaps(atlas, width, height, 4, ATLAS_LEVELS)
+	write_texture(output, width, height, 4, levels, [0.0, 0.0, 0.0])
+	fout = open(index, 'w')
+	fout.write(''.join(lines))
+	fout.close()
+
+def compile_index(output, fnames):
+	lines = []
+	for fname in fnames:
+		header = open(fname, 'rb').read(36)
+		magic, version, width, height, format, levels, r, g, b = \
+			struct.unpack('<4sIIIII3f', header)
+		if magic != b'KTEX' or version != TEXTURE_VERSION:
+			sys.exit('%s: Unsupported texture' % fname)
+		lines.append('%s %d %d %.6f %.6f %.6f\n' %
+			     (os.path.basename(fname), width, height, r, g, b))
+	fout = open(output, 'w')
+	fout.write(''.join(lines))
+	fout.close()
+
+if len(sys.argv) >= 4 and sys.argv[1] == '--atlas':
+	compile_atlas(sys.argv[2], sys.argv[3], sys.argv[4:])
+	sys.exit()
+if len(sys.argv) >= 3 and sys.argv[1] == '--index':
+	compile_index(sys.argv[2], sys.argv[3:])
+	sys.exit()
+if len(sys.argv) != 3:
+	sys.exit('Usage: compile-texture.py OUTPUT IMAGE\n'
+		 '       compile-texture.py --atlas OUTPUT INDEX IMAGES...\n'
+		 '       compile-texture.py --index OUTPUT TEXTURES...')
+output = sys.argv[1]
+width, height, channels, pixels = load_png(sys.argv[2])
+color = average_color(pixels, width, height, channels)
+write_texture(output, width, height, channels,
+	      mipmaps(pixels, width, height, channels), color)
@@ -7,22 +7,166 @@
 
   Program code and resources are licensed with GNU LGPL 2.1. See
   lgpl-2.1.txt file.
+
+  Pack file layout (all integers are little endian):
+
+    header    "KAALPACK", u32 version, u32 number of entries
+    entries   sorted by name so that they can be binary searched:
+              char name[48] (NUL padded), u32 offset, u32 size,
+              u32 packed size, u32 flags
+    data      each entry starts at an offset aligned to 4 KiB
+
+  Entries with the deflate flag are stored zlib compressed, the size
+  is the size after decompression. Entries with identical contents share
+  a single payload, so several names may have the same offset.
+
+  Usage: create-pack.py [--order TRACE] FILES...
+
+  By default the data is laid out alphabetically. Given a trace recorded
+  with "kaal -trace TRACE", the entries are laid out in the order the game
+  first touches them, so that loading reads the pack sequentially.
 """
+import hashlib
 import os
 import sys
+import struct
+import zlib
 
-fout = open('kaal.dat', 'w')
-fout.write('POKE 59458,62\n')
-listing = sys.argv[1:]
-listing.sort()
-for fname in listing:
-	fout.write('%s %d\n' % (os.path.basename(fname), os.path.getsize(fname)))
-fout.write('JMP FFFF:0000\n')
+PACK_VERSION = 2
+ALIGN = 4096
+NAME_LEN = 48
+ENTRY = '<%dsIIII' % NAME_LEN
+
+FLAG_DEFLATE = 1
+
+# Compress entries larger than this if it saves enough
+COMPRESS_MIN = 4096
+COMPRESS_RATIO = 0.9
+# Already compressed formats, and compiled meshes which are uploaded
+# straight from the mapped pack
+NO_COMPRESS = ('.png', '.ogg', '.ogv', '.kmesh')
+
+def read_trace(fname):
+	"""Returns entry names in the order they were first accessed"""
+	order = []
+	seen = set()
+	for line in open(fname):
+		fields = line.split()
+		if len(fields) < 3: continue
+		name = fields[2]
+		if name not in seen:
+			seen.add(name)
+			order.append(name)
+	return order
+
+def layout(entries, order):
+	"""Returns start and end offsets of the entries in the given order.
+	Payload shared by several entries is placed where it is first needed."""
+	offset = len(header) + len(entries) * struct.calcsize(ENTRY)
+	placed = {}
+	pos = {}
+	for name in order:
+		digest = entries[name][1]
+		if digest not in placed:
+			offset = (offset + ALIGN - 1) & ~(ALIGN - 1)
+			placed[digest] = (offset, offset + len(payloads[digest]))
+			offset += len(payloads[digest])
+		pos[name] = placed[digest]
+	return pos
+
+def distance(pos, touched):
+	"""How many seeks and how many bytes of seeking it takes to read the
+	entries in the order they are touched"""
+	seeks = 0
+	skipped = 0
+	prev_end = None
+	seen = set()
+	for name in touched:
+		start, end = pos[name]
+		if start in seen:
+			# already read for another name
+			continue
+		seen.add(start)
+		if prev_end is not None:
+			gap = start - ((prev_end + ALIGN - 1) & ~(ALIGN - 1))
+			if gap != 0:
+				seeks += 1
+				skipped += abs(gap)
+		prev_end = end
+	return seeks, skipped
+
+args = sys.argv[1:]
+trace = None
+if len(args) >= 2 and args[0] == '--order':
+	trace = args[1]
+	args = args[2:]
+
+listing = args
+listing.sort(key=lambda fname: os.path.basename(fname))
+header = struct.pack('<8sII', b'KAALPACK', PACK_VERSION, len(listing))
+
+entries = {}
+payloads = {}
+total = 0
+packed_total = 0
+shared = 0
 for fname in listing:
-	f = open(fname)
-	while True:
-		buf = f.read(4096)
-		if not buf: break
-		fout.write(buf)
+	name = os.path.basename(fname)
+	if len(name) >= NAME_LEN:
+		sys.exit('%s: Name too long for the pack' % fname)
+
+	f = open(fname, 'rb')
+	data = f.read()
 	f.close()
+
+	flags = 0
+	packed = data
+	if len(data) >= COMPRESS_MIN and \
+	   not fname.lower().endswith(NO_COMPRESS):
+		buf = zlib.compress(data, 9)
+		if len(buf) < len(data) * COMPRESS_RATIO:
+			packed = buf
+			flags |= FLAG_DEFLATE
+
+	# The flags are part of the key, the payload must decode the same way
+	digest = (hashlib.sha1(packed).digest(), flags)
+	if digest in payloads:
+		shared += len(packed)
+	else:
+		payloads[digest] = packed
+		packed_total += len(packed)
+	entries[name] = (len(data), digest, flags)
+	total += len(data)
+
+names = [os.path.basename(fname) for fname in listing]
+order = names
+if trace is not None:
+	touched = [name for name in read_trace(trace) if name in entries]
+	untouched = [name for name in names if name not in set(touched)]
+	order = touched + untouched
+
+	before = distance(layout(entries, names), touched)
+	after = distance(layout(entries, order), touched)
+	print('%d of %d entries touched by the trace' %
+	      (len(touched), len(names)))
+	print('alphabetical layout: %d seeks, %d KiB skipped' %
+	      (before[0], before[1] / 1024))
+	print('trace order layout: %d seeks, %d KiB skipped (ideal 0, 0)' %
+	      (after[0], after[1] / 1024))
+
+pos = layout(entries, order)
+fout = open('kaal.dat', 'wb')
+fout.write(header)
+for name in names:
+	size, digest, flags = entries[name]
+	fout.write(struct.pack(ENTRY, name.encode('ascii'), pos[name][0], size,
+			       len(payloads[digest]), flags))
+for name in order:
+	fout.seek(pos[name][0])
+	fout.write(payloads[entries[name][1]])
 fout.close()
+
+print('%d entries, %d bytes, %d bytes after compression' %
+      (len(listing), total, packed_total))
+print('%d unique payloads, %d bytes saved by sharing identical entries' %
+      (len(payloads), shared))
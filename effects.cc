@@ -11,11 +11,27 @@
 #include "gfx.h"
 #include "system.h"
 
+#define str(s) __str(s)
+#define __str(s) #s
+
 namespace {
 
 FBO bloom1, bloom2, bloom_out;
 FBO large_bloom1, large_bloom2, large_bloom_out;
 
+/* The textures of the G-buffer, see gbuffer_fs */
+enum {
+	GBUFFER_ALBEDO,
+	GBUFFER_NORMAL,
+	GBUFFER_DEPTH,
+	GBUFFER_EMISSIVE,
+	GBUFFER_TEXTURES
+};
+FBO gbuffer;
+GLint gbuffer_viewport[4];
+GLint gbuffer_target; /* the framebuffer to light */
+Program emissive_program, light_program;
+
 const char simple_vs[] =
 "varying vec2 tc;\
 void main(void)\
@@ -58,6 +74,65 @@ void main(void)\
 	gl_FragColor.a = 1.0;\
 }";
 
+/* The position of a pixel of the G-buffer, from its window coordinates and
+ * the w of its clip coordinates */
+#define GBUFFER_POS \
+"uniform sampler2DRect gbuffer[4];\
+uniform vec4 viewport;\
+uniform mat3 unproject;\
+uniform vec3 unproject_offset;\
+vec3 gbuffer_pos(vec2 tc, float w)\
+{\
+	vec2 ndc = tc / viewport.zw * 2.0 - 1.0;\
+	return unproject * (vec3(ndc * w, w) - unproject_offset);\
+}"
+
+const char emissive_vs[] =
+"void main(void)\
+{\
+	gl_Position = gl_Vertex;\
+}";
+
+const char emissive_fs[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+GBUFFER_POS
+"uniform vec4 depth_row;\
+void main(void)\
+{\
+	vec2 tc = gl_FragCoord.xy - viewport.xy;\
+	float w = texture2DRect(gbuffer[2], tc).x;\
+	if (w == 0.0) {\
+		discard;\
+	}\
+	vec3 pos = gbuffer_pos(tc, w);\
+	gl_FragColor = texture2DRect(gbuffer[3], tc);\
+	gl_FragDepth = (dot(depth_row.xyz, pos) + depth_row.w) / w * 0.5 + 0.5;\
+}";
+
+/* Like perpixel_fs, for a single light */
+const char light_fs[] =
+"#extension GL_ARB_texture_rectangle : enable\n"
+GBUFFER_POS
+"uniform vec3 light_pos;\
+uniform vec4 light_diffuse;\
+uniform float light_brightness;\
+void main(void)\
+{\
+	vec2 tc = gl_FragCoord.xy - viewport.xy;\
+	float w = texture2DRect(gbuffer[2], tc).x;\
+	if (w == 0.0) {\
+		discard;\
+	}\
+	vec3 pos = gbuffer_pos(tc, w);\
+	vec3 normal = texture2DRect(gbuffer[1], tc).xyz;\
+	vec3 d = light_pos - pos;\
+	float dist = length(d);\
+	float NdotL = max(dot(normal, d / dist), 0.2);\
+	float att = 1.0 - dist / (" str(LIGHT_MAX_DIST) ".0 * light_brightness);\
+	gl_FragColor = texture2DRect(gbuffer[0], tc) * light_diffuse *\
+		(NdotL * clamp(att, 0.0, 1.0));\
+}";
+
 void run_filter(int width, int height)
 {
 	glBegin(GL_QUADS);
@@ -72,6 +147,44 @@ void run_filter(int width, int height)
 	glEnd();
 }
 
+/* The world is in the projection matrix. Its rows for x, y and w of the clip
+ * coordinates are inverted to find the positions. */
+void set_gbuffer_uniforms(const Program &program)
+{
+	float m[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, m);
+	const double a[3][3] = {
+		{m[0], m[4], m[8]},
+		{m[1], m[5], m[9]},
+		{m[3], m[7], m[11]},
+	};
+	double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+		     a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+		     a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+	float unproject[9];
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			/* Column major, the cofactor of a[j][i] */
+			int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+			int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+			unproject[j * 3 + i] = (a[r0][c0] * a[r1][c1] -
+						a[r0][c1] * a[r1][c0]) / det;
+		}
+	}
+	const GLint units[] = {0, 1, 2, 3};
+	glUniform1iv(program.uniform(UNIFORM_GBUFFER), GBUFFER_TEXTURES,
+		     units);
+	glUniform4f(program.uniform(UNIFORM_VIEWPORT), gbuffer_viewport[0],
+		    gbuffer_viewport[1], gbuffer_viewport[2],
+		    gbuffer_viewport[3]);
+	glUniformMatrix3fv(program.uniform(UNIFORM_UNPROJECT), 1, GL_FALSE,
+			   unproject);
+	glUniform3f(program.uniform(UNIFORM_UNPROJECT_OFFSET), m[12], m[13],
+		    m[15]);
+	glUniform4f(program.uniform(UNIFORM_DEPTH_ROW), m[2], m[6], m[10],
+		    m[14]);
+}
+
 }
 
 void begin_bloom()
@@ -163,3 +276,124 @@ void draw_bloom()
 	glColor4f(1, 1, 1, 0.4);
 	run_filter(scr_width/8, scr_height/8);
 }
+
+void begin_gbuffer()
+{
+	static const GLenum formats[GBUFFER_TEXTURES] = {
+		GL_RGBA8, GL_RGBA16F_ARB, GL_R32F, GL_RGBA8
+	};
+	static int gbuffer_w = 0, gbuffer_h = 0;
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &gbuffer_target);
+	glGetIntegerv(GL_VIEWPORT, gbuffer_viewport);
+	int width = gbuffer_viewport[2];
+	int height = gbuffer_viewport[3];
+	if (gbuffer_w != width || gbuffer_h != height) {
+		gbuffer.init(width, height, formats, GBUFFER_TEXTURES, true);
+		gbuffer_w = width;
+		gbuffer_h = height;
+	}
+
+	gbuffer.begin_drawing();
+	glViewport(0, 0, width, height);
+	/* Nothing is drawn where the depth stays zero */
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void begin_lighting()
+{
+	if (!emissive_program.loaded()) {
+		emissive_program.load(emissive_vs, emissive_fs);
+		light_program.load(simple_vs, light_fs);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer_target);
+	glViewport(gbuffer_viewport[0], gbuffer_viewport[1],
+		   gbuffer_viewport[2], gbuffer_viewport[3]);
+	for (int i = GBUFFER_TEXTURES - 1; i >= 0; --i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		gbuffer.bind_texture(i);
+	}
+
+	/* Covers the whole viewport in the clip coordinates. The depths are
+	 * written for the glass and the effects which come after. */
+	emissive_program.use();
+	set_gbuffer_uniforms(emissive_program);
+	glDepthFunc(GL_ALWAYS);
+	glBegin(GL_QUADS);
+	glVertex2f(-1, -1);
+	glVertex2f(1, -1);
+	glVertex2f(1, 1);
+	glVertex2f(-1, 1);
+	glEnd();
+
+	/* The back faces of the light volumes are behind the pixels they
+	 * light, also when the camera is inside */
+	light_program.use();
+	set_gbuffer_uniforms(light_program);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glDepthFunc(GL_GEQUAL);
+	glDepthMask(GL_FALSE);
+	glCullFace(GL_FRONT);
+	glPushMatrix();
+	glLoadIdentity();
+}
+
+void draw_light_volume(const vec3 &pos, const Color &c, double brightness)
+{
+	glUniform3fv(light_program.uniform(UNIFORM_LIGHT_POS), 1, &pos.x);
+	glUniform4fv(light_program.uniform(UNIFORM_LIGHT_DIFFUSE), 1, &c.r);
+	glUniform1f(light_program.uniform(UNIFORM_LIGHT_BRIGHTNESS),
+		    brightness);
+
+	/* A box around the reach, counterclockwise from the outside */
+	double reach = LIGHT_MAX_DIST * brightness;
+	vec3 a = pos - vec3(reach, reach, reach);
+	vec3 b = pos + vec3(reach, reach, reach);
+	glBegin(GL_QUADS);
+	glVertex3f(a.x, a.y, a.z);
+	glVertex3f(a.x, a.y, b.z);
+	glVertex3f(a.x, b.y, b.z);
+	glVertex3f(a.x, b.y, a.z);
+
+	glVertex3f(b.x, a.y, a.z);
+	glVertex3f(b.x, b.y, a.z);
+	glVertex3f(b.x, b.y, b.z);
+	glVertex3f(b.x, a.y, b.z);
+
+	glVertex3f(a.x, a.y, a.z);
+	glVertex3f(b.x, a.y, a.z);
+	glVertex3f(b.x, a.y, b.z);
+	glVertex3f(a.x, a.y, b.z);
+
+	glVertex3f(a.x, b.y, a.z);
+	glVertex3f(a.x, b.y, b.z);
+	glVertex3f(b.x, b.y, b.z);
+	glVertex3f(b.x, b.y, a.z);
+
+	glVertex3f(a.x, a.y, a.z);
+	glVertex3f(a.x, b.y, a.z);
+	glVertex3f(b.x, b.y, a.z);
+	glVertex3f(b.x, a.y, a.z);
+
+	glVertex3f(a.x, a.y, b.z);
+	glVertex3f(b.x, a.y, b.z);
+	glVertex3f(b.x, b.y, b.z);
+	glVertex3f(a.x, b.y, b.z);
+	glEnd();
+}
+
+void end_lighting()
+{
+	glPopMatrix();
+	glCullFace(GL_BACK);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+	glDisable(GL_BLEND);
+	glUseProgram(0);
+	for (int i = GBUFFER_TEXTURES - 1; i >= 0; --i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+	}
+}
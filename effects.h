@@ -10,8 +10,19 @@
 #ifndef __effects_h__
 #define __effects_h__
 
+#include "gfx.h"
+
 void begin_bloom();
 void end_bloom();
 void draw_bloom();
+/* Deferred shading: the opaque models rendered with RENDER_DEFERRED go to the
+ * G-buffer. begin_lighting() puts their colors without the lights and their
+ * depths to the framebuffer which was bound before, and each
+ * draw_light_volume() adds a light to the pixels within its reach. The caller
+ * enables GL_CULL_FACE and GL_DEPTH_CLAMP for the light volumes. */
+void begin_gbuffer();
+void begin_lighting();
+void draw_light_volume(const vec3 &pos, const Color &c, double brightness);
+void end_lighting();
 
 #endif
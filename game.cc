@@ -882,23 +882,23 @@ void draw_bar(double value)
 	bar->bind();
 
 	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
+	bar->tex_coord(0, 0);
 	glVertex3f(0, 0, 0);
-	glTexCoord2f(value, 0);
+	bar->tex_coord(value, 0);
 	glVertex3f(value * WIDTH, 0, 0);
-	glTexCoord2f(value, 1);
+	bar->tex_coord(value, 1);
 	glVertex3f(value * WIDTH, HEIGHT, 0);
-	glTexCoord2f(0, 1);
+	bar->tex_coord(0, 1);
 	glVertex3f(0, HEIGHT, 0);
 
 	glColor4f(0.5, 0.5, 0.5, 1);
-	glTexCoord2f(value, 0);
+	bar->tex_coord(value, 0);
 	glVertex3f(value * WIDTH, 0, 0);
-	glTexCoord2f(1, 0);
+	bar->tex_coord(1, 0);
 	glVertex3f(WIDTH, 0, 0);
-	glTexCoord2f(1, 1);
+	bar->tex_coord(1, 1);
 	glVertex3f(WIDTH, HEIGHT, 0);
-	glTexCoord2f(value, 1);
+	bar->tex_coord(value, 1);
 	glVertex3f(value * WIDTH, HEIGHT, 0);
 	glEnd();
 }
@@ -3098,6 +3098,45 @@ void handle_event(const SDL_Event &e)
 		}
 }
 
+/* The translucent materials are also needed for the visible sets */
+void load_levels()
+{
+	arena.load("areena.obj");
+	hallway.load("areenaulko.obj");
+	sauna.load("sauna.obj");
+	hallway.set_ambient(Color(0.5, 0.5, 0.5));
+	sauna.set_ambient(Color(0.3, 0.3, 0.3));
+	arena.get_material("Light")->brightness = 0.2;
+	arena.get_material("Light.002")->brightness = 0.2;
+	arena.get_material("Light.003")->brightness = 0.2;
+	arena.get_material("Light.004")->brightness = 0.2;
+	arena.get_material("Light.005")->brightness = 0.2;
+	arena.get_material("Glass")->color.a = 0.3;
+	arena.get_material("Material")->brightness = 0.3;
+	arena.get_material("Material")->color = Color(1, 1, 1);
+	hallway.get_material("Glass")->color.a = 0.3;
+	hallway.get_material("Window")->color.a = 0.3;
+	hallway.get_material("Window")->brightness = 0.6;
+	hallway.get_material("Material.003")->brightness = 0.4;
+	hallway.get_material("Material")->brightness = 0.3;
+	hallway.get_material("asmburgersign")->brightness = 0.3;
+	hallway.get_material("jills")->brightness = 0.3;
+	hallway.get_material("tv")->brightness = 0.3;
+	hallway.get_material("screen")->brightness = 0.3;
+	hallway.get_material("Light")->brightness = 0.4;
+	hallway.get_material("Light.001")->brightness = 0.2;
+	hallway.get_material("Light.002")->brightness = 0.2;
+	sauna.get_material("Light")->brightness = 0.3;
+}
+
+}
+
+void build_pvs()
+{
+	load_levels();
+	arena.build_pvs("areena.obj", "areena.pvs");
+	hallway.build_pvs("areenaulko.obj", "areenaulko.pvs");
+	sauna.build_pvs("sauna.obj", "sauna.pvs");
 }
 
 void game()
@@ -3105,32 +3144,7 @@ void game()
 	bool mouse_ready = false;
 
 	if (persons[0] == NULL) {
-		arena.load("areena.obj");
-		hallway.load("areenaulko.obj");
-		sauna.load("sauna.obj");
-		hallway.set_ambient(Color(0.5, 0.5, 0.5));
-		sauna.set_ambient(Color(0.3, 0.3, 0.3));
-		arena.get_material("Light")->brightness = 0.2;
-		arena.get_material("Light.002")->brightness = 0.2;
-		arena.get_material("Light.003")->brightness = 0.2;
-		arena.get_material("Light.004")->brightness = 0.2;
-		arena.get_material("Light.005")->brightness = 0.2;
-		arena.get_material("Glass")->color.a = 0.3;
-		arena.get_material("Material")->brightness = 0.3;
-		arena.get_material("Material")->color = Color(1, 1, 1);
-		hallway.get_material("Glass")->color.a = 0.3;
-		hallway.get_material("Window")->color.a = 0.3;
-		hallway.get_material("Window")->brightness = 0.6;
-		hallway.get_material("Material.003")->brightness = 0.4;
-		hallway.get_material("Material")->brightness = 0.3;
-		hallway.get_material("asmburgersign")->brightness = 0.3;
-		hallway.get_material("jills")->brightness = 0.3;
-		hallway.get_material("tv")->brightness = 0.3;
-		hallway.get_material("screen")->brightness = 0.3;
-		hallway.get_material("Light")->brightness = 0.4;
-		hallway.get_material("Light.001")->brightness = 0.2;
-		hallway.get_material("Light.002")->brightness = 0.2;
-		sauna.get_material("Light")->brightness = 0.3;
+		load_levels();
 		arena.register_lights();
 		hallway.register_lights();
 		sauna.register_lights();
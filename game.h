@@ -11,5 +11,7 @@
 #define __game_h__
 
 void game();
+/* Writes the potentially visible sets of the levels, see World::build_pvs() */
+void build_pvs();
 
 #endif
@@ -13,50 +13,375 @@
 #include <stdexcept>
 #include <png.h>
 #include <map>
+#include <algorithm>
+#include <queue>
 
 #define str(s) __str(s)
 #define __str(s) #s
 
 size_t faces_drawn;
+size_t draw_calls;
+size_t state_changes;
+size_t leaves_culled;
+size_t texture_binds;
 size_t gfx_memory;
+size_t gfx_memory_saved;
 
 namespace {
 
 Program *current_program = NULL;
+/* The lighting of current_program, see lit_program() */
+bool current_perpixel;
 std::unordered_map<std::string, Texture *> texture_cache;
+/* Textures by pack payload and flags, identical images are loaded once */
+std::map<std::pair<size_t, int>, Texture *> texture_payloads;
+/* Names of the atlas rectangles, and the separately loaded whole textures
+   for the models which do not fit in the rectangle */
+std::unordered_map<const Texture *, std::string> atlas_names;
+std::unordered_map<const Texture *, Texture *> whole_textures;
+/* Texture::bind() skips binding the texture again */
+GLuint bound_texture = INVALID_TEXTURE;
+/* The textures which are loaded when needed, and their sizes and colors
+   by the compiled names, see compile-texture.py */
+std::vector<Texture *> lazy_textures;
+struct TextureInfo {
+	int width;
+	int height;
+	Color color;
+};
+std::unordered_map<std::string, TextureInfo> texture_index;
+unsigned current_frame = 1;
+struct ModelParams {
+	double scale;
+	int first_frame;
+	int num_frames;
+	bool noise;
+};
+std::unordered_map<std::string, ModelParams> model_params;
+
+/* The models are loaded in the loader threads, which look up textures */
+class TextureLock {
+public:
+	TextureLock()
+	{
+		SDL_mutexP(mutex());
+	}
+	~TextureLock()
+	{
+		SDL_mutexV(mutex());
+	}
+
+private:
+	static SDL_mutex *mutex()
+	{
+		static SDL_mutex *lock = SDL_CreateMutex();
+		return lock;
+	}
+};
+
+/* Bound until the texture is loaded. Transparent, so that the HUD does not
+   flash. */
+GLuint placeholder_texture()
+{
+	static GLuint id = INVALID_TEXTURE;
+	if (id == INVALID_TEXTURE) {
+		const uint8_t pixel[] = {255, 255, 255, 0};
+		glGenTextures(1, &id);
+		glBindTexture(GL_TEXTURE_2D, id);
+		bound_texture = id;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA,
+			     GL_UNSIGNED_BYTE, pixel);
+	}
+	return id;
+}
 std::unordered_map<std::string, Model *> model_cache;
+/* The jobs of the queued models until get_model() has the model */
+std::unordered_map<std::string, const Job *> model_jobs;
+
+/* The lights of the current program, see set_light(). Uploaded as arrays
+   when a model is rendered. */
+vec3 light_pos[MAX_LIGHTS];
+Color light_diffuse[MAX_LIGHTS];
+float light_brightness[MAX_LIGHTS];
+size_t num_lights;
+bool lights_changed;
+/* Where the lights of a program come from */
+enum Lighting {
+	SET_LIGHTS, /* set_light() */
+	CLUSTERS, /* upload_clusters() */
+	GBUFFER, /* added from the G-buffer afterwards, see begin_gbuffer() */
+};
+Lighting current_lighting;
+
+/* The clusters, see begin_clusters(). The screen is split to tiles, and the
+   depth to slices which grow exponentially from the near plane of the game
+   to RENDER_DIST. */
+const int CLUSTERS_X = 16;
+const int CLUSTERS_Y = 8;
+const int CLUSTERS_Z = 16;
+const int NUM_CLUSTERS = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+const double CLUSTER_NEAR = 1;
+
+/* Position and reach, and the color of each light */
+struct ClusterLight {
+	float pos[3];
+	float reach;
+	Color color;
+};
+
+std::vector<ClusterLight> cluster_lights;
+/* The offset of the light indices and their count for each cluster, then
+   the indices. Floats, since integer textures need a newer shader. */
+std::vector<float> cluster_data;
+GLuint cluster_buffers[2];
+GLuint cluster_textures[2];
+/* The lights which reach each cluster, while binning */
+std::vector<size_t> cluster_lists[NUM_CLUSTERS];
+/* Clusters per pixel and the origin of the viewport */
+float cluster_scale[4];
+/* The clusters are bound to this texture unit and the next one, after the
+   one of the animation textures */
+const int CLUSTER_UNIT = 2;
+
+const char *const uniform_names[NUM_UNIFORMS] = {
+	"x",
+	"pos_scale",
+	"pos_offset",
+	"tc_scale",
+	"tc_offset",
+	"norm_scale",
+	"light",
+	"light_pos",
+	"light_diffuse",
+	"light_brightness",
+	"vat",
+	"vat_size",
+	"clusters",
+	"cluster_lights",
+	"cluster_scale",
+	"cluster_depth",
+	"gbuffer",
+	"viewport",
+	"unproject",
+	"unproject_offset",
+	"depth_row",
+};
+
+/* Linked programs from the earlier runs, by the hash of the sources. The
+   file is dropped when the driver changes. */
+const char PROGRAM_CACHE[] = "kaal.shaders";
+const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+struct ProgramCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t driver;
+};
+struct ProgramCacheEntry {
+	uint64_t key;
+	uint32_t format;
+	uint32_t size;
+};
+struct ProgramBinary {
+	GLenum format;
+	std::vector<uint8_t> data;
+};
+std::map<uint64_t, ProgramBinary> program_binaries;
+/* Programs linked since the cache was written, see save_program_cache() */
+bool program_cache_dirty = false;
+
+/* FNV-1a */
+uint64_t hash_string(const char *s, uint64_t hash = 14695981039346656037ULL)
+{
+	for (; *s; ++s) {
+		hash = (hash ^ (uint8_t) *s) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint64_t driver_hash()
+{
+	uint64_t hash = hash_string((const char *) glGetString(GL_VENDOR));
+	hash = hash_string((const char *) glGetString(GL_RENDERER), hash);
+	return hash_string((const char *) glGetString(GL_VERSION), hash);
+}
+
+/* Reads the cache once */
+void read_program_cache()
+{
+	static bool read = false;
+	if (read) return;
+	read = true;
+
+	FILE *f = fopen(PROGRAM_CACHE, "rb");
+	if (f == NULL) return;
+	ProgramCacheHeader header;
+	if (fread(&header, sizeof header, 1, f) < 1 ||
+	    memcmp(header.magic, "KSHC", 4) != 0 ||
+	    header.version != PROGRAM_CACHE_VERSION ||
+	    header.driver != driver_hash()) {
+		fclose(f);
+		return;
+	}
+	ProgramCacheEntry entry;
+	while (fread(&entry, sizeof entry, 1, f) == 1) {
+		ProgramBinary &binary = program_binaries[entry.key];
+		binary.format = entry.format;
+		binary.data.resize(entry.size);
+		if (entry.size > 0 &&
+		    fread(&binary.data[0], entry.size, 1, f) < 1) {
+			program_binaries.erase(entry.key);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+void write_program_cache()
+{
+	FILE *f = fopen(PROGRAM_CACHE, "wb");
+	if (f == NULL) {
+		printf("Can not write %s\n", PROGRAM_CACHE);
+		return;
+	}
+	ProgramCacheHeader header;
+	memcpy(header.magic, "KSHC", 4);
+	header.version = PROGRAM_CACHE_VERSION;
+	header.driver = driver_hash();
+	fwrite(&header, sizeof header, 1, f);
+	for (const auto &iter : program_binaries) {
+		ProgramCacheEntry entry;
+		entry.key = iter.first;
+		entry.format = iter.second.format;
+		entry.size = iter.second.data.size();
+		fwrite(&entry, sizeof entry, 1, f);
+		fwrite(&iter.second.data[0], entry.size, 1, f);
+	}
+	fclose(f);
+}
+
+/* Returns false if the program is not cached or the driver rejects it */
+bool load_program_binary(GLuint id, uint64_t key)
+{
+	if (!GLEW_ARB_get_program_binary) return false;
+	read_program_cache();
+	auto iter = program_binaries.find(key);
+	if (iter == program_binaries.end()) return false;
+
+	const ProgramBinary &binary = iter->second;
+	glProgramBinary(id, binary.format, &binary.data[0],
+			binary.data.size());
+	int status;
+	glGetProgramiv(id, GL_LINK_STATUS, &status);
+	if (!status) {
+		program_binaries.erase(iter);
+		return false;
+	}
+	return true;
+}
+
+void save_program_binary(GLuint id, uint64_t key)
+{
+	if (!GLEW_ARB_get_program_binary) return;
+	int size = 0;
+	glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0) return;
+
+	ProgramBinary &binary = program_binaries[key];
+	binary.data.resize(size);
+	GLsizei len = 0;
+	glGetProgramBinary(id, size, &len, &binary.format, &binary.data[0]);
+	binary.data.resize(len);
+	program_cache_dirty = true;
+}
+
+/* The lit vertex shaders are prefixed with these. Instances have their own
+ * modelview matrix and material color, see flush_queue(). Animated instances
+ * read the keyframes from a float texture, each at its own phase. */
+enum Variant {
+	SINGLE,
+	INSTANCED,
+	ANIMATED,
+	NUM_VARIANTS
+};
+
+const char *const variant_defs[NUM_VARIANTS] = {
+"#define MODELVIEW gl_ModelViewMatrix\n\
+#define NORMAL_MATRIX gl_NormalMatrix\n\
+#define MATERIAL gl_FrontMaterial.diffuse\n\
+#define VERTEX ((gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x) * pos_scale + pos_offset)\n\
+#define NORMAL (gl_Normal * (1.0 - x) + gl_MultiTexCoord2.xyz * (x * norm_scale))\n",
+
+"attribute mat4 instance_matrix;\n\
+attribute vec4 instance_color;\n\
+#define MODELVIEW instance_matrix\n\
+#define NORMAL_MATRIX mat3(instance_matrix[0].xyz, instance_matrix[1].xyz, instance_matrix[2].xyz)\n\
+#define MATERIAL instance_color\n\
+#define VERTEX ((gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x) * pos_scale + pos_offset)\n\
+#define NORMAL (gl_Normal * (1.0 - x) + gl_MultiTexCoord2.xyz * (x * norm_scale))\n",
+
+"attribute mat4 instance_matrix;\n\
+attribute vec4 instance_color;\n\
+attribute float instance_anim;\n\
+attribute float vertex_index;\n\
+uniform sampler2D vat;\n\
+uniform vec2 vat_size;\n\
+vec3 vat_fetch(float frame, float row)\n\
+{\n\
+	vec2 tc = vec2((vertex_index + 0.5) / vat_size.x,\n\
+		       (frame * 2.0 + row + 0.5) / (vat_size.y * 2.0));\n\
+	return texture2DLod(vat, tc, 0.0).xyz;\n\
+}\n\
+vec3 vat_blend(float row)\n\
+{\n\
+	float frame = floor(instance_anim);\n\
+	float next = mod(frame + 1.0, vat_size.y);\n\
+	return mix(vat_fetch(frame, row), vat_fetch(next, row),\n\
+		   instance_anim - frame);\n\
+}\n\
+#define MODELVIEW instance_matrix\n\
+#define NORMAL_MATRIX mat3(instance_matrix[0].xyz, instance_matrix[1].xyz, instance_matrix[2].xyz)\n\
+#define MATERIAL instance_color\n\
+#define VERTEX vat_blend(0.0)\n\
+#define NORMAL vat_blend(1.0)\n",
+};
 
 const char simple_vs[] =
-"struct Light {\
-	vec3 pos;\
-	float brightness;\
-	vec4 diffuse;\
-};\
-uniform Light lights[%d];\
+"uniform vec3 light_pos[%d];\
+uniform vec4 light_diffuse[%d];\
+uniform float light_brightness[%d];\
 varying vec4 color;\
 uniform float x;\
+uniform vec3 pos_scale, pos_offset;\
+uniform vec2 tc_scale, tc_offset;\
+uniform float norm_scale;\
 \
 void main(void)\
 {\
-	vec3 vert = gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x;\
-	vec3 normal = gl_Normal * (1.0 - x) + gl_MultiTexCoord2.xyz * x;\
+	vec3 vert = VERTEX;\
+	vec3 normal = NORMAL;\
+	vec2 tc = gl_MultiTexCoord0.xy * tc_scale + tc_offset;\
 	int i;\
 	vec3 d;\
 	float dist, NdotL, att;\
 	vec4 diffuse;\
-	vec4 v = gl_ModelViewMatrix * vec4(vert, 1.0);\
-	vec3 n = gl_NormalMatrix * normal;\
+	vec4 v = MODELVIEW * vec4(vert, 1.0);\
+	vec3 n = NORMAL_MATRIX * normal;\
 \
 	gl_Position = gl_ProjectionMatrix * v;\
-	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\
+	gl_TexCoord[0] = gl_TextureMatrix[0] * vec4(tc, 0.0, 1.0);\
 \
-	color = gl_LightModel.ambient * gl_FrontMaterial.ambient;\
+	color = gl_LightModel.ambient * MATERIAL;\
 	for (i = 0; i < %d; i++) {\
-		d = lights[i].pos - (v.xyz / v.w);\
+		d = light_pos[i] - (v.xyz / v.w);\
 		dist = length(d);\
 		NdotL = max(dot(n, d / dist), 0.2);\
-		diffuse = gl_FrontMaterial.diffuse * lights[i].diffuse;\
-		att = 1.0 - dist / (" str(LIGHT_MAX_DIST) ".0 * lights[i].brightness);\
+		diffuse = MATERIAL * light_diffuse[i];\
+		att = 1.0 - dist / (" str(LIGHT_MAX_DIST) ".0 * light_brightness[i]);\
 		color += diffuse * (NdotL * clamp(att, 0.0, 1.0));\
 	}\
 	color = clamp(color, 0.0, 1.0);\
@@ -73,28 +398,32 @@ void main(void)\
 const char perpixel_vs[] =
 "varying vec4 v;\
 varying vec3 n;\
+varying vec4 material;\
 uniform float x;\
+uniform vec3 pos_scale, pos_offset;\
+uniform vec2 tc_scale, tc_offset;\
+uniform float norm_scale;\
 void main(void)\
 {\
-	vec3 vert = gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x;\
-	vec3 normal = gl_Normal * (1.0 - x) + gl_MultiTexCoord2.xyz * x;\
-	v = gl_ModelViewMatrix * vec4(vert, 1.0);\
-	n = gl_NormalMatrix * normal;\
+	vec3 vert = VERTEX;\
+	vec3 normal = NORMAL;\
+	vec2 tc = gl_MultiTexCoord0.xy * tc_scale + tc_offset;\
+	v = MODELVIEW * vec4(vert, 1.0);\
+	n = NORMAL_MATRIX * normal;\
+	material = MATERIAL;\
 \
 	gl_Position = gl_ProjectionMatrix * v;\
-	gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\
+	gl_TexCoord[0] = gl_TextureMatrix[0] * vec4(tc, 0.0, 1.0);\
 \
 }";
 
 const char perpixel_fs[] =
-"struct Light {\
-	vec3 pos;\
-	float brightness;\
-	vec4 diffuse;\
-};\
-uniform Light lights[%d];\
+"uniform vec3 light_pos[%d];\
+uniform vec4 light_diffuse[%d];\
+uniform float light_brightness[%d];\
 varying vec4 v;\
 varying vec3 n;\
+varying vec4 material;\
 uniform sampler2D tex;\
 void main(void)\
 {\
@@ -103,55 +432,2041 @@ void main(void)\
 	float dist, NdotL, att;\
 	vec4 diffuse;\
 	vec3 normal = normalize(n);\
-	vec4 color = gl_LightModel.ambient * gl_FrontMaterial.ambient;\
+	vec4 color = gl_LightModel.ambient * material;\
 	for (i = 0; i < %d; i++) {\
-		d = lights[i].pos - (v.xyz / v.w);\
+		d = light_pos[i] - (v.xyz / v.w);\
+		dist = length(d);\
+		NdotL = max(dot(normal, d / dist), 0.2);\
+		diffuse = material * light_diffuse[i];\
+		att = 1.0 - dist / (" str(LIGHT_MAX_DIST) ".0 * light_brightness[i]);\
+		color += diffuse * (NdotL * clamp(att, 0.0, 1.0));\
+	}\
+	color = clamp(color, 0.0, 1.0);\
+	gl_FragColor = texture2D(tex, gl_TexCoord[0].xy) * color;\
+}";
+
+/* Like perpixel_fs, with the lights of the cluster of the pixel. The depth
+ * of the pixel is the w of the clip coordinates. */
+const char clustered_fs[] =
+"#extension GL_EXT_gpu_shader4 : require\n\
+uniform samplerBuffer clusters;\
+uniform samplerBuffer cluster_lights;\
+uniform vec4 cluster_scale;\
+uniform vec2 cluster_depth;\
+varying vec4 v;\
+varying vec3 n;\
+varying vec4 material;\
+uniform sampler2D tex;\
+void main(void)\
+{\
+	int i, first, count, cluster;\
+	vec3 d;\
+	vec4 light;\
+	float dist, NdotL, att, slice;\
+	vec4 diffuse;\
+	vec3 normal = normalize(n);\
+	vec4 color = gl_LightModel.ambient * material;\
+	vec2 tile = min((gl_FragCoord.xy - cluster_scale.zw) * cluster_scale.xy,\
+			vec2(%d.0, %d.0));\
+	slice = clamp(log(1.0 / gl_FragCoord.w) * cluster_depth.x +\
+		      cluster_depth.y, 0.0, %d.0);\
+	cluster = (int(slice) * %d + int(tile.y)) * %d + int(tile.x);\
+	first = int(texelFetchBuffer(clusters, cluster * 2).x);\
+	count = int(texelFetchBuffer(clusters, cluster * 2 + 1).x);\
+	for (i = 0; i < count; i++) {\
+		int index = int(texelFetchBuffer(clusters, first + i).x) * 2;\
+		light = texelFetchBuffer(cluster_lights, index);\
+		d = light.xyz - (v.xyz / v.w);\
 		dist = length(d);\
 		NdotL = max(dot(normal, d / dist), 0.2);\
-		diffuse = gl_FrontMaterial.diffuse * lights[i].diffuse;\
-		att = 1.0 - dist / (" str(LIGHT_MAX_DIST) ".0 * lights[i].brightness);\
+		diffuse = material * texelFetchBuffer(cluster_lights, index + 1);\
+		att = 1.0 - dist / light.w;\
 		color += diffuse * (NdotL * clamp(att, 0.0, 1.0));\
 	}\
 	color = clamp(color, 0.0, 1.0);\
 	gl_FragColor = texture2D(tex, gl_TexCoord[0].xy) * color;\
 }";
 
+/* The pixels of the opaque models to the G-buffer: the color, the normal,
+ * the w of the clip coordinates, and the color without the lights */
+const char gbuffer_fs[] =
+"varying vec4 v;\
+varying vec3 n;\
+varying vec4 material;\
+uniform sampler2D tex;\
+void main(void)\
+{\
+	vec4 albedo = texture2D(tex, gl_TexCoord[0].xy) * material;\
+	gl_FragData[0] = albedo;\
+	gl_FragData[1] = vec4(normalize(n), 0.0);\
+	gl_FragData[2] = vec4(1.0 / gl_FragCoord.w);\
+	gl_FragData[3] = clamp(gl_LightModel.ambient, 0.0, 1.0) * albedo;\
+}";
+
 const char shadow_vs[] =
 "uniform float x;\
+uniform vec3 pos_scale, pos_offset;\
+uniform vec2 tc_scale, tc_offset;\
+uniform float norm_scale;\
 uniform vec3 light;\
 void main(void)\
 {\
-	vec3 vert = gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x;\
-	vec3 normal = gl_Normal * (1.0 - x) + gl_MultiTexCoord2.xyz * x;\
+	vec3 vert = (gl_Vertex.xyz * (1.0 - x) + gl_MultiTexCoord1.xyz * x)\
+		* pos_scale + pos_offset;\
+	vec3 normal = gl_Normal * (1.0 - x) +\
+		gl_MultiTexCoord2.xyz * (x * norm_scale);\
+	vec2 tc = gl_MultiTexCoord0.xy * tc_scale + tc_offset;\
 	vec4 v = gl_ModelViewMatrix * vec4(vert, 1.0);\
 	vec3 n = gl_NormalMatrix * normal;\
 \
 	vec3 delta = (v.xyz / v.w) - light;\
 	if (dot(delta, n) > 0.0) {\
-		v = vec4((v.xyz / v.w) + normalize(delta) * gl_MultiTexCoord0.x, 1.0);\
+		v = vec4((v.xyz / v.w) + normalize(delta) * tc.x, 1.0);\
 	}\
 	gl_Position = gl_ProjectionMatrix * v;\
 	gl_FrontColor = gl_Color;\
 }";
 
-const char shadow_fs[] =
-"void main(void)\
-{\
-	gl_FragColor = gl_Color;\
-}";
+const char shadow_fs[] =
+"void main(void)\
+{\
+	gl_FragColor = gl_Color;\
+}";
+
+void png_error_func(png_structp png_ptr, png_const_charp error_msg)
+{
+	(void) png_ptr;
+	throw std::runtime_error(std::string("Error loading PNG: ") +
+				 error_msg);
+}
+
+void png_read_data(png_structp png_ptr, png_bytep data, png_size_t len)
+{
+	PackFile *f = (PackFile *) png_get_io_ptr(png_ptr);
+	if (f->read(data, len) < len) {
+		throw std::runtime_error("Partial PNG");
+	}
+}
+
+/* Decoded PNG or a compiled texture, ready for Texture::load() */
+struct Image {
+	int width;
+	int height;
+	GLuint type;
+	std::vector<uint8_t> pixels;
+
+	/* Compiled textures have all the mipmap levels and the color */
+	PackFile file;
+	std::vector<uint8_t> buf;
+	std::vector<const uint8_t *> levels;
+	Color color;
+};
+
+/* Average of an RGB or RGBA image, otherwise black */
+Color average_color(int width, int height, GLuint type, const uint8_t *data)
+{
+	int channels = 0;
+	if (type == GL_RGB) {
+		channels = 3;
+	} else if (type == GL_RGBA) {
+		channels = 4;
+	} else {
+		return Color(0, 0, 0);
+	}
+	Color sum(0, 0, 0);
+	for (int i = 0; i < width * height; ++i) {
+		sum.r += data[i * channels] / 255.0;
+		sum.g += data[i * channels + 1] / 255.0;
+		sum.b += data[i * channels + 2] / 255.0;
+	}
+	return sum * (1.0 / (width * height));
+}
+
+void decode_png(Image *image, const char *fname, bool alpha)
+{
+	printf("Loading %s\n", fname);
+	PackFile f;
+	f.open(fname);
+
+	png_byte header[8] = {};
+	f.read(header, sizeof header);
+	if (png_sig_cmp(header, 0, sizeof header)) {
+		throw std::runtime_error(std::string("Invalid PNG: ") + fname);
+	}
+
+	png_structp png_ptr =
+		png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	assert(png_ptr != NULL);
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	assert(info_ptr != NULL);
+
+	png_set_error_fn(png_ptr, NULL, png_error_func, NULL);
+	png_set_read_fn(png_ptr, &f, png_read_data);
+	png_set_sig_bytes(png_ptr, sizeof header);
+
+	png_read_info(png_ptr, info_ptr);
+	png_set_expand(png_ptr);
+	png_set_packing(png_ptr);
+
+	png_read_update_info(png_ptr, info_ptr);
+
+	int width = png_get_image_width(png_ptr, info_ptr);
+	int height = png_get_image_height(png_ptr, info_ptr);
+	int channels = png_get_channels(png_ptr, info_ptr);;
+
+	switch (png_get_color_type(png_ptr, info_ptr)) {
+	case PNG_COLOR_TYPE_GRAY:
+		image->type = alpha ? GL_ALPHA : GL_LUMINANCE;
+		break;
+	case PNG_COLOR_TYPE_GRAY_ALPHA:
+		image->type = GL_LUMINANCE_ALPHA;
+		break;
+	case PNG_COLOR_TYPE_RGB:
+		image->type = GL_RGB;
+		break;
+	case PNG_COLOR_TYPE_RGB_ALPHA:
+		image->type = GL_RGBA;
+		break;
+	default:
+		throw std::runtime_error("PNG has unknown color type");
+	}
+
+	image->width = width;
+	image->height = height;
+	image->pixels.assign(width * height * channels, 0);
+	std::vector<png_bytep> rows(height);
+	for (int i = 0; i < height; ++i) {
+		rows[i] = (png_bytep) &image->pixels[width * channels * i];
+	}
+	png_read_image(png_ptr, &rows[0]);
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
+
+struct TextureHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t levels;
+	float color[3];
+};
+
+const uint32_t TEXTURE_VERSION = 1;
+/* Around each rectangle of an atlas, see compile-texture.py */
+const int ATLAS_GUTTER = 16;
+
+/* See compile-texture.py */
+void load_compiled_texture(Image *image, const char *fname, bool alpha)
+{
+	printf("Loading %s\n", fname);
+	image->file.open(fname);
+
+	const uint8_t *data = file_contents(&image->file, &image->buf);
+	size_t size = image->file.size();
+	const TextureHeader *header = (const TextureHeader *) data;
+	if (size < sizeof *header || memcmp(header->magic, "KTEX", 4) != 0 ||
+	    header->version != TEXTURE_VERSION) {
+		throw std::runtime_error(std::string("Unsupported texture: ") +
+					 fname);
+	}
+	image->width = header->width;
+	image->height = header->height;
+	image->type = header->format;
+	if (alpha && image->type == GL_LUMINANCE) {
+		image->type = GL_ALPHA;
+	}
+	image->color = Color(header->color[0], header->color[1],
+			     header->color[2]);
+	size_t pos = sizeof *header;
+	for (uint32_t i = 0; i < header->levels; ++i) {
+		uint32_t len = 0;
+		if (pos + sizeof len <= size) {
+			memcpy(&len, &data[pos], sizeof len);
+		}
+		pos += sizeof len;
+		if (pos + len > size) {
+			throw std::runtime_error(std::string("Truncated texture: ") +
+						 fname);
+		}
+		image->levels.push_back(&data[pos]);
+		pos += (len + 3) & ~3;
+	}
+}
+
+void decode_image(Image *image, const char *fname, bool alpha)
+{
+	LoadTimer timer(fname, LOAD_DECODE);
+	std::string compiled = compiled_texture(fname);
+	if (pack_contains(compiled.c_str())) {
+		load_compiled_texture(image, compiled.c_str(), alpha);
+	} else {
+		decode_png(image, fname, alpha);
+	}
+}
+
+void upload_image(Texture *texture, const Image &image, bool mipmap)
+{
+	if (image.levels.empty()) {
+		texture->load(image.width, image.height, image.type,
+			      &image.pixels[0], mipmap);
+		return;
+	}
+	std::vector<const uint8_t *> levels(image.levels.begin(),
+					    image.levels.begin() +
+					    (mipmap ? image.levels.size() : 1));
+	texture->load(image.width, image.height, image.type, levels,
+		      image.color);
+}
+
+/* The texture which is bound to draw with the given one */
+const Texture *bound_texture_of(const Texture *texture)
+{
+	if (texture != NULL && texture->atlas() != NULL) {
+		return texture->atlas();
+	}
+	return texture;
+}
+
+/* An atlas rectangle as a texture of its own */
+const Texture *whole_texture(const Texture *texture)
+{
+	auto iter = whole_textures.find(texture);
+	if (iter != whole_textures.end()) {
+		return iter->second;
+	}
+	TextureLock lock;
+	Texture *whole = new Texture;
+	whole->load_later(atlas_names[texture].c_str(), true, false,
+			  texture->width(), texture->height(), texture->color());
+	whole_textures[texture] = whole;
+	lazy_textures.push_back(whole);
+	return whole;
+}
+
+class TextureJob : public Job {
+public:
+	TextureJob(Texture *texture, const char *fname, bool mipmap,
+		   bool alpha) :
+		m_texture(texture),
+		m_fname(fname),
+		m_mipmap(mipmap),
+		m_alpha(alpha)
+	{
+	}
+
+	void run()
+	{
+		decode_image(&m_image, m_fname.c_str(), m_alpha);
+	}
+
+	void finish()
+	{
+		LoadTimer timer(m_fname.c_str(), LOAD_UPLOAD);
+		upload_image(m_texture, m_image, m_mipmap);
+		timer.count(m_texture->memory());
+	}
+
+private:
+	Texture *m_texture;
+	std::string m_fname;
+	bool m_mipmap;
+	bool m_alpha;
+	Image m_image;
+};
+
+class ModelJob : public Job {
+public:
+	ModelJob(Model *model, const char *fname, double scale,
+		 int first_frame, int num_frames, bool noise) :
+		m_model(model),
+		m_fname(fname),
+		m_scale(scale),
+		m_first_frame(first_frame),
+		m_num_frames(num_frames),
+		m_noise(noise)
+	{
+	}
+
+	void run()
+	{
+		m_model->load(m_fname.c_str(), m_scale, m_first_frame,
+			      m_num_frames, m_noise);
+	}
+
+	void finish()
+	{
+		LoadTimer timer(m_fname.c_str(), LOAD_UPLOAD);
+		size_t memory = gfx_memory;
+		m_model->upload();
+		timer.count(gfx_memory - memory);
+	}
+
+private:
+	Model *m_model;
+	std::string m_fname;
+	double m_scale;
+	int m_first_frame;
+	int m_num_frames;
+	bool m_noise;
+};
+
+/* Compiled mesh, see compile-mesh.py for the layout */
+const uint32_t MESH_VERSION = 3;
+
+struct MeshHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t frames;
+	uint32_t mtllibs;
+	uint32_t groups;
+	vec3 midpos;
+	float radius;
+};
+struct MeshLib {
+	char name[48];
+};
+struct MeshGroup {
+	char material[64];
+	vec3 midpos;
+	uint32_t vertices;
+	uint32_t indices;
+};
+
+static_assert(sizeof(Vertex) == 32, "compiled vertex layout");
+static_assert(sizeof(CollFace) == 84, "compiled face layout");
+
+/* Walks through the sections of a compiled mesh */
+class MeshReader {
+public:
+	MeshReader(const uint8_t *data, size_t size) :
+		m_pos(data),
+		m_end(data + size)
+	{
+	}
+
+	template<class T>
+	const T *get(size_t count = 1)
+	{
+		if ((size_t) (m_end - m_pos) < count * sizeof(T)) {
+			throw std::runtime_error("Truncated mesh");
+		}
+		const T *p = (const T *) m_pos;
+		m_pos += count * sizeof(T);
+		return p;
+	}
+
+	/* Indices are 16-bit when possible, padded to 32 bits */
+	const void *get_indices(size_t count, GLenum type)
+	{
+		if (type == GL_UNSIGNED_INT) {
+			return get<uint32_t>(count);
+		}
+		const uint16_t *p = get<uint16_t>(count);
+		get<uint16_t>(count & 1);
+		return p;
+	}
+
+private:
+	const uint8_t *m_pos;
+	const uint8_t *m_end;
+};
+
+/* A line based parser for OBJ and MTL files which are in memory */
+class Scanner {
+public:
+	Scanner(const char *data, const char *end) :
+		m_pos(data),
+		m_end(data),
+		m_next(data),
+		m_data_end(end)
+	{
+	}
+
+	/* Moves to the next line, returns false at the end of data */
+	bool next_line()
+	{
+		if (m_next >= m_data_end) return false;
+		m_pos = m_next;
+		const char *eol = (const char *) memchr(m_pos, '\n',
+							m_data_end - m_pos);
+		m_end = eol != NULL ? eol : m_data_end;
+		m_next = eol != NULL ? eol + 1 : m_data_end;
+		return true;
+	}
+
+	/* Checks whether the next word on the line matches */
+	bool match(const char *token)
+	{
+		skip_space();
+		size_t len = strlen(token);
+		if ((size_t) (m_end - m_pos) >= len &&
+		    memcmp(m_pos, token, len) == 0 &&
+		    (m_pos + len == m_end ||
+		     isspace((unsigned char) m_pos[len]))) {
+			m_pos += len;
+			return true;
+		}
+		return false;
+	}
+
+	std::string token()
+	{
+		skip_space();
+		const char *start = m_pos;
+		while (m_pos < m_end && !isspace((unsigned char) *m_pos)) {
+			++m_pos;
+		}
+		return std::string(start, m_pos - start);
+	}
+
+	bool skip(char c)
+	{
+		if (m_pos < m_end && *m_pos == c) {
+			++m_pos;
+			return true;
+		}
+		return false;
+	}
+
+	bool at_end()
+	{
+		skip_space();
+		return m_pos == m_end;
+	}
+
+	/* Unsigned integer, zero if there is none */
+	size_t index()
+	{
+		skip_space();
+		size_t val = 0;
+		while (m_pos < m_end && *m_pos >= '0' && *m_pos <= '9') {
+			val = val * 10 + (*m_pos++ - '0');
+		}
+		return val;
+	}
+
+	float number();
+
+private:
+	const char *m_pos;
+	const char *m_end;
+	const char *m_next;
+	const char *m_data_end;
+
+	void skip_space()
+	{
+		while (m_pos < m_end && isspace((unsigned char) *m_pos)) {
+			++m_pos;
+		}
+	}
+};
+
+/* Reads the sizes and the colors of the compiled textures once */
+void read_texture_index()
+{
+	static bool read = false;
+	if (read) return;
+	read = true;
+	if (!pack_contains("textures.txt")) return;
+
+	printf("Loading textures.txt\n");
+	PackFile f;
+	f.open("textures.txt");
+	std::vector<uint8_t> buf;
+	const char *data = (const char *) file_contents(&f, &buf);
+	Scanner s(data, data + f.size());
+	while (s.next_line()) {
+		std::string name = s.token();
+		if (name.empty()) continue;
+		TextureInfo &info = texture_index[name];
+		info.width = s.index();
+		info.height = s.index();
+		info.color = Color(0, 0, 0);
+		info.color.r = s.number();
+		info.color.g = s.number();
+		info.color.b = s.number();
+	}
+}
+
+/* The texture is loaded when it is first bound, see Texture::request().
+ * Safe to call from the loader threads. */
+Texture *lazy_texture(const char *fname, bool mipmap, bool alpha)
+{
+	TextureLock lock;
+	auto cached = texture_cache.find(fname);
+	if (cached != texture_cache.end()) {
+		return cached->second;
+	}
+	if (!pack_contains(fname)) {
+		throw std::runtime_error(std::string("Texture not found: ") +
+					 fname);
+	}
+	std::pair<size_t, int> key(pack_payload(fname), mipmap * 2 + alpha);
+	auto iter = texture_payloads.find(key);
+	if (iter != texture_payloads.end()) {
+		texture_cache[fname] = iter->second;
+		return iter->second;
+	}
+
+	read_texture_index();
+	Texture *texture = new Texture;
+	auto info = texture_index.find(compiled_texture(fname));
+	if (info != texture_index.end()) {
+		texture->load_later(fname, mipmap, alpha, info->second.width,
+				    info->second.height, info->second.color);
+	} else {
+		/* Not compiled, the PNG is decoded twice */
+		Image image;
+		decode_png(&image, fname, alpha);
+		texture->load_later(fname, mipmap, alpha, image.width,
+				    image.height,
+				    average_color(image.width, image.height,
+						  image.type,
+						  &image.pixels[0]));
+	}
+	texture_cache[fname] = texture;
+	texture_payloads[key] = texture;
+	lazy_textures.push_back(texture);
+	return texture;
+}
+
+/* Exact when the digits fit in the mantissa of a double and the power of
+ * ten is small enough, otherwise falls back to strtod().
+ */
+float Scanner::number()
+{
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22
+	};
+
+	skip_space();
+	const char *start = m_pos;
+	const char *p = m_pos;
+	bool negative = false;
+	if (p < m_end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	while (p < m_end && *p >= '0' && *p <= '9') {
+		mantissa = mantissa * 10 + (*p++ - '0');
+		digits++;
+	}
+	if (p < m_end && *p == '.') {
+		++p;
+		while (p < m_end && *p >= '0' && *p <= '9') {
+			mantissa = mantissa * 10 + (*p++ - '0');
+			digits++;
+			exponent--;
+		}
+	}
+	/* strtod() also reads "nan" and "inf" */
+	bool slow = digits == 0 || digits > 15;
+	if (p < m_end && (*p == 'e' || *p == 'E')) {
+		slow = true;
+	}
+	if (!slow && exponent >= -22) {
+		m_pos = p;
+		double val = mantissa / powers[-exponent];
+		return negative ? -val : val;
+	}
+
+	char buf[64];
+	size_t len = std::min<size_t>(m_end - start, sizeof buf - 1);
+	memcpy(buf, start, len);
+	buf[len] = 0;
+	char *endp;
+	double val = strtod(buf, &endp);
+	if (endp == buf) {
+		throw std::runtime_error("Number expected");
+	}
+	m_pos = start + (endp - buf);
+	return val;
+}
+
+const Texture *noise_texture()
+{
+	/* Models are loaded in several threads at once */
+	static const Texture *noise_tex = get_texture("noise.png");
+	return noise_tex;
+}
+
+GLuint upload_buffer(GLenum target, const void *data, size_t size)
+{
+	gfx_memory += size;
+
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(target, buffer);
+	glBufferData(target, size, data, GL_STATIC_DRAW);
+	return buffer;
+}
+
+/* Video memory used by a texture level */
+size_t texture_size(GLenum format, int width, int height)
+{
+	switch (format) {
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		return ((width + 3) / 4) * ((height + 3) / 4) * 16;
+	case GL_RGBA:
+		return width * height * 4;
+	case GL_LUMINANCE_ALPHA:
+		return width * height * 2;
+	case GL_LUMINANCE:
+	case GL_ALPHA:
+		return width * height;
+	}
+	return width * height * 3;
+}
+
+/* Size of the post-transform vertex cache optimize_triangles() assumes */
+const size_t VERTEX_CACHE_SIZE = 32;
+
+/* Levels of detail, including the full model */
+const size_t MAX_LODS = 4;
+/* Compared to the size of a group, doubled for each level */
+const double LOD_MAX_ERROR = 0.01;
+
+double vertex_score(int cache_pos, size_t remaining)
+{
+	if (remaining == 0) return -1;
+
+	double score = 0;
+	if (cache_pos >= 3) {
+		score = pow(1 - (cache_pos - 3) /
+			    (double) (VERTEX_CACHE_SIZE - 3), 1.5);
+	} else if (cache_pos >= 0) {
+		/* The last triangle was just drawn */
+		score = 0.75;
+	}
+	/* Finish off vertices with only a few triangles left */
+	return score + 2 / sqrt(remaining);
+}
+
+/* Reorders the triangles so that the vertices are found from the vertex
+ * cache of the GPU as often as possible. This is the greedy algorithm by
+ * Tom Forsyth, "Linear-Speed Vertex Cache Optimisation". compile-mesh.py
+ * does exactly the same.
+ */
+void optimize_triangles(std::vector<uint32_t> *indices, size_t num_verts)
+{
+	size_t num_tris = indices->size() / 3;
+
+	/* Triangles which use each vertex and have not been drawn yet */
+	std::vector<size_t> remaining(num_verts, 0);
+	for (uint32_t i : *indices) {
+		remaining[i]++;
+	}
+	std::vector<size_t> first(num_verts + 1, 0);
+	for (size_t i = 0; i < num_verts; ++i) {
+		first[i + 1] = first[i] + remaining[i];
+	}
+	std::vector<uint32_t> tris(indices->size());
+	std::vector<size_t> fill(first.begin(), first.end() - 1);
+	for (size_t i = 0; i < indices->size(); ++i) {
+		tris[fill[(*indices)[i]]++] = i / 3;
+	}
+
+	std::vector<int> cache_pos(num_verts, -1);
+	std::vector<double> score(num_verts);
+	for (size_t i = 0; i < num_verts; ++i) {
+		score[i] = vertex_score(-1, remaining[i]);
+	}
+
+	std::vector<bool> drawn(num_tris, false);
+	std::vector<uint32_t> out;
+	out.reserve(indices->size());
+	std::vector<uint32_t> cache;
+	size_t next_tri = 0;
+	while (out.size() < indices->size()) {
+		/* The best triangle which uses a vertex in the cache */
+		size_t best = num_tris;
+		double best_score = -1;
+		for (uint32_t v : cache) {
+			for (size_t i = 0; i < remaining[v]; ++i) {
+				uint32_t t = tris[first[v] + i];
+				const uint32_t *tri = &(*indices)[t * 3];
+				double s = score[tri[0]] + score[tri[1]] +
+					   score[tri[2]];
+				if (s > best_score) {
+					best_score = s;
+					best = t;
+				}
+			}
+		}
+		if (best == num_tris) {
+			while (drawn[next_tri]) next_tri++;
+			best = next_tri;
+		}
+
+		drawn[best] = true;
+		const uint32_t *tri = &(*indices)[best * 3];
+		for (int i = 0; i < 3; ++i) {
+			uint32_t v = tri[i];
+			out.push_back(v);
+
+			uint32_t *list = &tris[first[v]];
+			size_t j = 0;
+			while (list[j] != best) j++;
+			list[j] = list[--remaining[v]];
+
+			auto pos = std::find(cache.begin(), cache.end(), v);
+			if (pos != cache.end()) {
+				cache.erase(pos);
+			}
+			cache.insert(cache.begin(), v);
+		}
+
+		for (size_t i = 0; i < cache.size(); ++i) {
+			uint32_t v = cache[i];
+			cache_pos[v] = i < VERTEX_CACHE_SIZE ? (int) i : -1;
+			score[v] = vertex_score(cache_pos[v], remaining[v]);
+		}
+		if (cache.size() > VERTEX_CACHE_SIZE) {
+			cache.resize(VERTEX_CACHE_SIZE);
+		}
+	}
+	indices->swap(out);
+}
+
+template<class V>
+struct VertexHash {
+	size_t operator()(const V &v) const
+	{
+		/* FNV-1a */
+		const uint8_t *p = (const uint8_t *) &v;
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < sizeof v; ++i) {
+			hash = (hash ^ p[i]) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+template<class V>
+struct VertexEqual {
+	bool operator()(const V &a, const V &b) const
+	{
+		return memcmp(&a, &b, sizeof a) == 0;
+	}
+};
+
+/* A vertex in a keyframe, and what it is like in the earlier ones */
+struct KeyedVertex {
+	uint32_t id;
+	Vertex v;
+};
+
+/* Merges the vertices of triangle lists which are identical in every
+ * keyframe and returns the indices of the triangles, ordered for the vertex
+ * cache. The vertices are stored in the order they are first used.
+ */
+void index_vertices(const std::vector<std::vector<Vertex>> &in,
+		    std::vector<std::vector<Vertex>> *out,
+		    std::vector<uint32_t> *indices)
+{
+	size_t count = in[0].size();
+	indices->assign(count, 0);
+	size_t num_verts = 0;
+	for (const std::vector<Vertex> &keyframe : in) {
+		if (keyframe.size() != count) {
+			throw std::runtime_error("Keyframes have different faces");
+		}
+		std::unordered_map<KeyedVertex, uint32_t,
+				   VertexHash<KeyedVertex>,
+				   VertexEqual<KeyedVertex>> welded;
+		for (size_t i = 0; i < count; ++i) {
+			KeyedVertex key;
+			key.id = (*indices)[i];
+			key.v = keyframe[i];
+			auto iter = welded.insert(std::make_pair(key,
+							(uint32_t) welded.size()));
+			(*indices)[i] = iter.first->second;
+		}
+		num_verts = welded.size();
+	}
+
+	/* A face corner for each vertex */
+	std::vector<size_t> corner(num_verts);
+	for (size_t i = count; i-- > 0;) {
+		corner[(*indices)[i]] = i;
+	}
+
+	optimize_triangles(indices, num_verts);
+
+	std::vector<uint32_t> remap(num_verts, (uint32_t) -1);
+	std::vector<size_t> order;
+	order.reserve(num_verts);
+	for (uint32_t &i : *indices) {
+		if (remap[i] == (uint32_t) -1) {
+			remap[i] = order.size();
+			order.push_back(corner[i]);
+		}
+		i = remap[i];
+	}
+
+	out->resize(in.size());
+	for (size_t k = 0; k < in.size(); ++k) {
+		(*out)[k].clear();
+		(*out)[k].reserve(order.size());
+		for (size_t i : order) {
+			(*out)[k].push_back(in[k][i]);
+		}
+	}
+}
+
+vec3 middle(const std::vector<Vertex> &vertices)
+{
+	vec3 box_min(1e10, 1e10, 1e10);
+	vec3 box_max(-1e10, -1e10, -1e10);
+	for (const Vertex &v : vertices) {
+		box_min = min(box_min, v.vert);
+		box_max = max(box_max, v.vert);
+	}
+	return (box_min + box_max) * 0.5;
+}
+
+/* Quantized vertex, see compact_vertices. The position and the texture
+ * coordinates are relative to the bounding box of the group. */
+struct CompactVertex {
+	int16_t vert[4]; /* the last one is padding */
+	uint32_t norm; /* signed 2:10:10:10 */
+	int16_t tc[2];
+};
+
+static_assert(sizeof(CompactVertex) == 16, "compact vertex layout");
+
+const int QUANT_MAX = 32767;
+const int NORM_MAX = 511;
+
+Quantization identity_quantization()
+{
+	Quantization quant;
+	quant.pos_scale = vec3(1, 1, 1);
+	quant.pos_offset = vec3(0, 0, 0);
+	quant.tc_scale = vec2(1, 1);
+	quant.tc_offset = vec2(0, 0);
+	quant.norm_scale = 1;
+	return quant;
+}
+
+/* Finds the quantization which covers all the keyframes */
+class VertexBounds {
+public:
+	VertexBounds() :
+		m_min(1e10, 1e10, 1e10),
+		m_max(-1e10, -1e10, -1e10),
+		m_tc_min(1e10, 1e10),
+		m_tc_max(-1e10, -1e10)
+	{
+	}
+
+	void add(const Vertex *v, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			m_min = min(m_min, v[i].vert);
+			m_max = max(m_max, v[i].vert);
+			m_tc_min.x = std::min(m_tc_min.x, v[i].tc.x);
+			m_tc_min.y = std::min(m_tc_min.y, v[i].tc.y);
+			m_tc_max.x = std::max(m_tc_max.x, v[i].tc.x);
+			m_tc_max.y = std::max(m_tc_max.y, v[i].tc.y);
+		}
+	}
+
+	Quantization quantization() const
+	{
+		Quantization quant = identity_quantization();
+		if (m_min.x > m_max.x) return quant;
+
+		/* The offset is the middle of the box */
+		quant.pos_offset = (m_min + m_max) * 0.5;
+		quant.pos_scale = vec3(step(m_min.x, m_max.x),
+				       step(m_min.y, m_max.y),
+				       step(m_min.z, m_max.z));
+		quant.tc_offset = (m_tc_min + m_tc_max) * 0.5;
+		quant.tc_scale = vec2(step(m_tc_min.x, m_tc_max.x),
+				      step(m_tc_min.y, m_tc_max.y));
+		quant.norm_scale = 1.0 / NORM_MAX;
+		return quant;
+	}
+
+private:
+	vec3 m_min, m_max;
+	vec2 m_tc_min, m_tc_max;
+
+	static float step(float lo, float hi)
+	{
+		return std::max<float>(hi - lo, 1e-3) * 0.5 / QUANT_MAX;
+	}
+};
+
+int16_t quantize(float x, float offset, float scale)
+{
+	long i = lround((x - offset) / scale);
+	return std::max<long>(std::min<long>(i, QUANT_MAX), -QUANT_MAX);
+}
+
+CompactVertex compact_vertex(const Vertex &v, const Quantization &quant)
+{
+	CompactVertex out;
+	out.vert[0] = quantize(v.vert.x, quant.pos_offset.x, quant.pos_scale.x);
+	out.vert[1] = quantize(v.vert.y, quant.pos_offset.y, quant.pos_scale.y);
+	out.vert[2] = quantize(v.vert.z, quant.pos_offset.z, quant.pos_scale.z);
+	out.vert[3] = 0;
+	out.tc[0] = quantize(v.tc.x, quant.tc_offset.x, quant.tc_scale.x);
+	out.tc[1] = quantize(v.tc.y, quant.tc_offset.y, quant.tc_scale.y);
+
+	const float norm[] = {v.norm.x, v.norm.y, v.norm.z};
+	out.norm = 0;
+	for (int i = 0; i < 3; ++i) {
+		long c = lround(std::max(std::min(norm[i], 1.0f), -1.0f) *
+				NORM_MAX);
+		out.norm |= (uint32_t) (c & 0x3ff) << (i * 10);
+	}
+	return out;
+}
+
+/* The coordinates are also mapped to the rectangle of an atlas texture */
+void set_quantization(const Quantization &quant,
+		      const Texture *texture = NULL)
+{
+	vec2 tc_scale = quant.tc_scale;
+	vec2 tc_offset = quant.tc_offset;
+	if (texture != NULL && texture->atlas() != NULL) {
+		vec2 scale = texture->tc_scale();
+		vec2 offset = texture->tc_offset();
+		tc_scale = vec2(quant.tc_scale.x * scale.x,
+				quant.tc_scale.y * scale.y);
+		tc_offset = vec2(quant.tc_offset.x * scale.x + offset.x,
+				 quant.tc_offset.y * scale.y + offset.y);
+	}
+	glUniform3fv(current_program->uniform(UNIFORM_POS_SCALE), 1,
+		     &quant.pos_scale.x);
+	glUniform3fv(current_program->uniform(UNIFORM_POS_OFFSET), 1,
+		     &quant.pos_offset.x);
+	glUniform2fv(current_program->uniform(UNIFORM_TC_SCALE), 1,
+		     &tc_scale.x);
+	glUniform2fv(current_program->uniform(UNIFORM_TC_OFFSET), 1,
+		     &tc_offset.x);
+	glUniform1f(current_program->uniform(UNIFORM_NORM_SCALE),
+		    quant.norm_scale);
+}
+
+/* The textures are bound in upload_clusters() */
+void set_cluster_uniforms()
+{
+	double depth_scale = CLUSTERS_Z / log(RENDER_DIST / CLUSTER_NEAR);
+	glUniform1i(current_program->uniform(UNIFORM_CLUSTERS), CLUSTER_UNIT);
+	glUniform1i(current_program->uniform(UNIFORM_CLUSTER_LIGHTS),
+		    CLUSTER_UNIT + 1);
+	glUniform4fv(current_program->uniform(UNIFORM_CLUSTER_SCALE), 1,
+		     cluster_scale);
+	glUniform2f(current_program->uniform(UNIFORM_CLUSTER_DEPTH),
+		    depth_scale, -log(CLUSTER_NEAR) * depth_scale);
+}
+
+/* All lights set since begin_rendering() at once */
+void upload_lights()
+{
+	if (!lights_changed) return;
+	lights_changed = false;
+	if (current_lighting == CLUSTERS) {
+		set_cluster_uniforms();
+		return;
+	}
+	glUniform3fv(current_program->uniform(UNIFORM_LIGHT_POS), num_lights,
+		     &light_pos[0].x);
+	glUniform4fv(current_program->uniform(UNIFORM_LIGHT_DIFFUSE),
+		     num_lights, &light_diffuse[0].r);
+	glUniform1fv(current_program->uniform(UNIFORM_LIGHT_BRIGHTNESS),
+		     num_lights, light_brightness);
+}
+
+/* The shaders blend from the first keyframe to the next one */
+void bind_vertices(GLuint buffer, GLuint next, bool animated, bool compact)
+{
+	if (compact) {
+		/* OpenGL normalizes the normals, but not the texture
+		 * coordinates. The shaders scale the next keyframe. */
+		CompactVertex *v = NULL;
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glVertexPointer(3, GL_SHORT, sizeof *v, v->vert);
+		glNormalPointer(GL_INT_2_10_10_10_REV, sizeof *v, &v->norm);
+		glTexCoordPointer(2, GL_SHORT, sizeof *v, v->tc);
+		if (!animated) return;
+
+		glBindBuffer(GL_ARRAY_BUFFER, next);
+		glClientActiveTexture(GL_TEXTURE1);
+		glTexCoordPointer(3, GL_SHORT, sizeof *v, v->vert);
+		glClientActiveTexture(GL_TEXTURE2);
+		glTexCoordPointer(4, GL_INT_2_10_10_10_REV, sizeof *v,
+				  &v->norm);
+		glClientActiveTexture(GL_TEXTURE0);
+		return;
+	}
+
+	Vertex *v = NULL;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &v->vert);
+	glNormalPointer(GL_FLOAT, sizeof(Vertex), &v->norm);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &v->tc);
+	if (!animated) return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, next);
+	glClientActiveTexture(GL_TEXTURE1);
+	glTexCoordPointer(3, GL_FLOAT, sizeof(Vertex), &v->vert);
+	glClientActiveTexture(GL_TEXTURE2);
+	glTexCoordPointer(3, GL_FLOAT, sizeof(Vertex), &v->norm);
+	glClientActiveTexture(GL_TEXTURE0);
+}
+
+/* 16-bit indices are used when possible */
+GLenum index_type(size_t num_verts)
+{
+	return num_verts <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+size_t index_size(GLenum type)
+{
+	return type == GL_UNSIGNED_SHORT ? 2 : 4;
+}
+
+/* Each variant is compiled when it is first used. Hey, look!
+ * Self-modifying (shader) code */
+Program *lit_program(size_t numlights, bool perpixel, Variant variant)
+{
+	static Program simple_programs[NUM_VARIANTS][MAX_LIGHTS + 1];
+	static Program perpixel_programs[NUM_VARIANTS][MAX_LIGHTS + 1];
+
+	Program *program = perpixel ? &perpixel_programs[variant][numlights] :
+		&simple_programs[variant][numlights];
+	if (program->loaded()) {
+		return program;
+	}
+	LoadTimer timer("shaders", LOAD_UPLOAD);
+	std::string vs = variant_defs[variant];
+	/* Some NVIDIA drivers can not arrays of length 1 */
+	int size = std::max<int>(numlights, 2);
+	if (perpixel) {
+		char buf[sizeof perpixel_fs + 32];
+		sprintf(buf, perpixel_fs, size, size, size, (int) numlights);
+		vs += perpixel_vs;
+		program->load(vs.c_str(), buf);
+	} else {
+		char buf[sizeof simple_vs + 32];
+		sprintf(buf, simple_vs, size, size, size, (int) numlights);
+		vs += buf;
+		program->load(vs.c_str(), simple_fs);
+	}
+	return program;
+}
+
+/* Per-pixel lighting from the clusters, see begin_clusters() */
+Program *clustered_program(Variant variant)
+{
+	static Program programs[NUM_VARIANTS];
+
+	Program *program = &programs[variant];
+	if (program->loaded()) {
+		return program;
+	}
+	LoadTimer timer("shaders", LOAD_UPLOAD);
+	std::string vs = variant_defs[variant];
+	vs += perpixel_vs;
+	char buf[sizeof clustered_fs + 32];
+	sprintf(buf, clustered_fs, CLUSTERS_X - 1, CLUSTERS_Y - 1,
+		CLUSTERS_Z - 1, CLUSTERS_Y, CLUSTERS_X);
+	program->load(vs.c_str(), buf);
+	return program;
+}
+
+int cluster_slice(double depth)
+{
+	int slice = floor(log(depth / CLUSTER_NEAR) * CLUSTERS_Z /
+			  log(RENDER_DIST / CLUSTER_NEAR));
+	return std::max(std::min(slice, CLUSTERS_Z - 1), 0);
+}
+
+/* The tiles along one axis which a point can fall on, when its clip
+ * coordinate is within reach from c, and w is between w0 and w1 */
+bool cluster_tiles(double c, double reach, double w0, double w1,
+		   int tiles, int *first, int *last)
+{
+	double lo = std::min((c - reach) / w0, (c - reach) / w1);
+	double hi = std::max((c + reach) / w0, (c + reach) / w1);
+	if (hi < -1 || lo > 1) return false;
+	lo = std::max(lo, -1.0);
+	hi = std::min(hi, 1.0);
+	*first = std::max((int) floor((lo + 1) * 0.5 * tiles), 0);
+	*last = std::min((int) floor((hi + 1) * 0.5 * tiles), tiles - 1);
+	return true;
+}
+
+/* Replaces the contents of one of the cluster textures */
+void upload_cluster_texture(int i, GLenum format, const void *data,
+			    size_t size)
+{
+	if (cluster_buffers[i] == 0) {
+		glGenBuffers(1, &cluster_buffers[i]);
+		glGenTextures(1, &cluster_textures[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER_ARB, cluster_buffers[i]);
+	glBufferData(GL_TEXTURE_BUFFER_ARB, size, data, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER_ARB, 0);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_UNIT + i);
+	glBindTexture(GL_TEXTURE_BUFFER_ARB, cluster_textures[i]);
+	glTexBufferARB(GL_TEXTURE_BUFFER_ARB, format, cluster_buffers[i]);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/* See begin_gbuffer() */
+Program *gbuffer_program(Variant variant)
+{
+	static Program programs[NUM_VARIANTS];
+
+	Program *program = &programs[variant];
+	if (program->loaded()) {
+		return program;
+	}
+	LoadTimer timer("shaders", LOAD_UPLOAD);
+	std::string vs = variant_defs[variant];
+	vs += perpixel_vs;
+	program->load(vs.c_str(), gbuffer_fs);
+	return program;
+}
+
+const size_t NONE = (size_t) -1;
+
+/* A program and the values of its lights */
+struct LightSet {
+	const Program *program;
+	bool perpixel;
+	Lighting lighting;
+	size_t num_lights;
+	vec3 pos[MAX_LIGHTS];
+	Color diffuse[MAX_LIGHTS];
+	float brightness[MAX_LIGHTS];
+};
+
+/* Everything needed to draw a group. Copied, since objects replace the
+ * materials of shared models while they are rendered. */
+struct DrawPacket {
+	size_t light_set; /* NONE for the current program and lights */
+	size_t matrix; /* NONE for the current modelview matrix */
+	const Texture *texture;
+	const Material *mat; /* only sorted by */
+	Color ambient;
+	Color color;
+	int frame, num_frames, num_cols;
+	float anim;
+	const Quantization *quant;
+	GLuint buffer, next;
+	bool animated, compact;
+	GLuint index_buffer;
+	size_t num_indices;
+	GLenum index_type;
+	/* Drawn as an animated instance if there is a vertex animation
+	 * texture, see Model::queue_vat() */
+	GLuint vat;
+	size_t vat_width, vat_frames;
+	float phase; /* keyframe and the blend to the next one */
+};
+
+struct ModelView {
+	float m[16];
+};
+
+/* The generic vertex attributes of the instanced programs. The locations
+ * do not alias the fixed function ones the shaders use. */
+const GLuint VERTEX_INDEX_ATTRIB = 6;
+const GLuint INSTANCE_ANIM_ATTRIB = 7;
+const GLuint INSTANCE_MATRIX_ATTRIB = 11; /* four locations */
+const GLuint INSTANCE_COLOR_ATTRIB = 15; /* the one after them */
+/* Fewer are drawn one by one */
+const size_t MIN_INSTANCES = 2;
+
+struct Instance {
+	float matrix[16];
+	Color color;
+	float anim;
+};
+
+/* The state which the previous packet left, to skip setting it again */
+struct DrawState {
+	const Program *program;
+	size_t light_set;
+	size_t matrix; /* NONE if unknown, IDENTITY for instances */
+	bool have_ambient;
+	Color ambient;
+	bool have_color;
+	Color color;
+	const Quantization *quant;
+	const Texture *quant_texture;
+	float anim;
+	bool texture_matrix;
+	int frame, num_frames, num_cols;
+	GLuint buffer, next;
+	bool animated_arrays;
+	/* Only enabled for the instances, the ordinary groups can have more
+	 * vertices than the vertex indices */
+	bool instance_arrays;
+	bool vertex_index_array;
+	GLuint index_buffer;
+
+	DrawState() :
+		program(NULL),
+		light_set(NONE),
+		matrix(NONE),
+		have_ambient(false),
+		have_color(false),
+		quant(NULL),
+		quant_texture(NULL),
+		anim(-1),
+		texture_matrix(false),
+		frame(0),
+		num_frames(0),
+		num_cols(0),
+		buffer(0),
+		next(0),
+		animated_arrays(false),
+		instance_arrays(false),
+		vertex_index_array(false),
+		index_buffer(0)
+	{
+	}
+};
+
+const size_t IDENTITY = NONE - 1;
+
+/* See begin_queue() */
+bool queue_active;
+bool queue_sorted;
+std::vector<DrawPacket> draw_queue;
+std::vector<LightSet> light_sets;
+std::vector<ModelView> draw_matrices;
+std::vector<Instance> instances;
+GLuint instance_buffer;
+/* 0, 1, 2... as floats, vertex_index of the animated instances */
+GLuint vertex_index_buffer;
+size_t vertex_index_count;
+/* The lights set since begin_rendering() as a LightSet, or NONE */
+size_t current_light_set = NONE;
+
+bool same_color(const Color &a, const Color &b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+/* Sorted by the program and the lights, which are in the order the leaves
+ * are drawn, then by the texture, the material and the vertices */
+bool packet_order(const DrawPacket &a, const DrawPacket &b)
+{
+	if (a.light_set != b.light_set) return a.light_set < b.light_set;
+	const Texture *ta = bound_texture_of(a.texture);
+	const Texture *tb = bound_texture_of(b.texture);
+	if (ta != tb) return ta < tb;
+	if (a.mat != b.mat) return a.mat < b.mat;
+	return a.buffer < b.buffer;
+}
+
+/* The current program and lights, shared with the earlier leaves which
+ * have the same ones */
+size_t capture_light_set()
+{
+	if (current_light_set != NONE) {
+		return current_light_set;
+	}
+	LightSet set;
+	set.program = current_program;
+	set.perpixel = current_perpixel;
+	set.lighting = current_lighting;
+	set.num_lights = num_lights;
+	for (size_t i = 0; i < num_lights; ++i) {
+		set.pos[i] = light_pos[i];
+		set.diffuse[i] = light_diffuse[i];
+		set.brightness[i] = light_brightness[i];
+	}
+	for (size_t i = 0; i < light_sets.size(); ++i) {
+		const LightSet &other = light_sets[i];
+		if (other.program == set.program &&
+		    other.num_lights == set.num_lights &&
+		    memcmp(other.pos, set.pos, sizeof(vec3) * num_lights) == 0 &&
+		    memcmp(other.diffuse, set.diffuse,
+			   sizeof(Color) * num_lights) == 0 &&
+		    memcmp(other.brightness, set.brightness,
+			   sizeof(float) * num_lights) == 0) {
+			current_light_set = i;
+			return i;
+		}
+	}
+	current_light_set = light_sets.size();
+	light_sets.push_back(set);
+	return current_light_set;
+}
+
+/* Instances of a group can be drawn with a single call if they only differ by
+ * the modelview matrix and the color */
+bool same_instance(const DrawPacket &a, const DrawPacket &b)
+{
+	return a.light_set == b.light_set && a.texture == b.texture &&
+		same_color(a.ambient, b.ambient) &&
+		a.frame == b.frame && a.num_frames == b.num_frames &&
+		a.num_cols == b.num_cols && a.anim == b.anim &&
+		a.quant == b.quant && a.buffer == b.buffer && !a.animated &&
+		!b.animated && a.compact == b.compact &&
+		a.index_buffer == b.index_buffer &&
+		a.num_indices == b.num_indices && a.vat == b.vat;
+}
+
+void set_instance_arrays(bool instanced, bool indexed, DrawState *state)
+{
+	if (instanced != state->instance_arrays) {
+		for (GLuint a = INSTANCE_MATRIX_ATTRIB;
+		     a <= INSTANCE_COLOR_ATTRIB; ++a) {
+			if (instanced) {
+				glEnableVertexAttribArray(a);
+			} else {
+				glDisableVertexAttribArray(a);
+			}
+			glVertexAttribDivisorARB(a, instanced);
+		}
+		if (instanced) {
+			glEnableVertexAttribArray(INSTANCE_ANIM_ATTRIB);
+		} else {
+			glDisableVertexAttribArray(INSTANCE_ANIM_ATTRIB);
+		}
+		glVertexAttribDivisorARB(INSTANCE_ANIM_ATTRIB, instanced);
+		state->instance_arrays = instanced;
+		state_changes++;
+	}
+	if (indexed != state->vertex_index_array) {
+		if (indexed) {
+			glBindBuffer(GL_ARRAY_BUFFER, vertex_index_buffer);
+			glVertexAttribPointer(VERTEX_INDEX_ATTRIB, 1, GL_FLOAT,
+					      GL_FALSE, 0, NULL);
+			glEnableVertexAttribArray(VERTEX_INDEX_ATTRIB);
+		} else {
+			glDisableVertexAttribArray(VERTEX_INDEX_ATTRIB);
+		}
+		state->vertex_index_array = indexed;
+		state_changes++;
+	}
+}
+
+void use_program(const Program *program, DrawState *state)
+{
+	if (program == state->program) return;
+	current_program = const_cast<Program *>(program);
+	current_program->use();
+	state->program = program;
+	/* The uniforms belong to the program */
+	state->light_set = NONE;
+	state->quant = NULL;
+	state->anim = -1;
+	state_changes++;
+}
+
+/* Draws count instances of the packet if count > 0, see flush_queue() */
+void submit(const DrawPacket &p, DrawState *state, size_t count = 0,
+	    size_t first_instance = 0)
+{
+	if (p.light_set != NONE) {
+		const LightSet &set = light_sets[p.light_set];
+		Variant variant = SINGLE;
+		if (p.vat != 0) {
+			variant = ANIMATED;
+		} else if (count > 0) {
+			variant = INSTANCED;
+		}
+		if (set.lighting == CLUSTERS) {
+			use_program(clustered_program(variant), state);
+		} else if (set.lighting == GBUFFER) {
+			use_program(gbuffer_program(variant), state);
+		} else if (variant != SINGLE) {
+			use_program(lit_program(set.num_lights, set.perpixel,
+						variant), state);
+		} else {
+			use_program(set.program, state);
+		}
+	}
+	if (p.light_set != NONE && p.light_set != state->light_set) {
+		const LightSet &set = light_sets[p.light_set];
+		if (set.lighting == CLUSTERS) {
+			set_cluster_uniforms();
+		} else if (set.lighting == SET_LIGHTS) {
+			glUniform3fv(current_program->uniform(UNIFORM_LIGHT_POS),
+				     set.num_lights, &set.pos[0].x);
+			glUniform4fv(current_program->uniform(UNIFORM_LIGHT_DIFFUSE),
+				     set.num_lights, &set.diffuse[0].r);
+			glUniform1fv(current_program->uniform(UNIFORM_LIGHT_BRIGHTNESS),
+				     set.num_lights, set.brightness);
+		}
+		state->light_set = p.light_set;
+		state_changes++;
+	}
+	size_t matrix = count > 0 ? IDENTITY : p.matrix;
+	if (matrix != NONE && matrix != state->matrix) {
+		if (matrix == IDENTITY) {
+			glLoadIdentity();
+		} else {
+			glLoadMatrixf(draw_matrices[matrix].m);
+		}
+		state->matrix = matrix;
+		state_changes++;
+	}
+	if (p.anim != state->anim) {
+		glUniform1f(current_program->uniform(UNIFORM_X), p.anim);
+		state->anim = p.anim;
+		state_changes++;
+	}
+
+	if (p.num_frames > 0 || state->texture_matrix) {
+		if (p.num_frames != state->num_frames ||
+		    p.num_cols != state->num_cols ||
+		    p.frame != state->frame) {
+			glMatrixMode(GL_TEXTURE);
+			glLoadIdentity();
+			if (p.num_frames > 0) {
+				glScalef(1.0 / p.num_cols,
+					 1.0 / (p.num_frames / p.num_cols), 1);
+				glTranslatef(p.frame / (p.num_frames / p.num_cols),
+					     p.frame, 0);
+			}
+			glMatrixMode(GL_MODELVIEW);
+			state->texture_matrix = p.num_frames > 0;
+			state->num_frames = p.num_frames;
+			state->num_cols = p.num_cols;
+			state->frame = p.frame;
+			state_changes++;
+		}
+	}
+
+	GLuint prev_texture = bound_texture;
+	p.texture->bind();
+	if (bound_texture != prev_texture) {
+		state_changes++;
+	}
+	if (!state->have_ambient || !same_color(p.ambient, state->ambient)) {
+		glLightModelfv(GL_LIGHT_MODEL_AMBIENT, &p.ambient.r);
+		state->ambient = p.ambient;
+		state->have_ambient = true;
+		state_changes++;
+	}
+	if (count == 0 &&
+	    (!state->have_color || !same_color(p.color, state->color))) {
+		glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE,
+			     &p.color.r);
+		state->color = p.color;
+		state->have_color = true;
+		state_changes++;
+	}
+	if (p.quant != state->quant || p.texture != state->quant_texture) {
+		set_quantization(*p.quant, p.texture);
+		state->quant = p.quant;
+		state->quant_texture = p.texture;
+		state_changes++;
+	}
+
+	if (p.animated != state->animated_arrays) {
+		void (*set)(GLenum) = p.animated ? glEnableClientState :
+			glDisableClientState;
+		glClientActiveTexture(GL_TEXTURE1);
+		set(GL_TEXTURE_COORD_ARRAY);
+		glClientActiveTexture(GL_TEXTURE2);
+		set(GL_TEXTURE_COORD_ARRAY);
+		glClientActiveTexture(GL_TEXTURE0);
+		state->animated_arrays = p.animated;
+		state->buffer = 0;
+		state_changes++;
+	}
+	if (p.buffer != state->buffer || p.next != state->next) {
+		bind_vertices(p.buffer, p.next, p.animated, p.compact);
+		state->buffer = p.buffer;
+		state->next = p.next;
+		state_changes++;
+	}
+	if (p.index_buffer != state->index_buffer) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, p.index_buffer);
+		state->index_buffer = p.index_buffer;
+		state_changes++;
+	}
+	if (p.vat != 0) {
+		/* The texture unit 0 is for the color */
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, p.vat);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(current_program->uniform(UNIFORM_VAT), 1);
+		glUniform2f(current_program->uniform(UNIFORM_VAT_SIZE),
+			    p.vat_width, p.vat_frames);
+		state_changes++;
+	}
+	set_instance_arrays(count > 0, p.vat != 0, state);
+	if (count > 0) {
+		Instance *i = (Instance *) (first_instance * sizeof(Instance));
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		for (int col = 0; col < 4; ++col) {
+			glVertexAttribPointer(INSTANCE_MATRIX_ATTRIB + col, 4,
+					      GL_FLOAT, GL_FALSE,
+					      sizeof(Instance),
+					      &i->matrix[col * 4]);
+		}
+		glVertexAttribPointer(INSTANCE_COLOR_ATTRIB, 4, GL_FLOAT,
+				      GL_FALSE, sizeof(Instance), &i->color);
+		glVertexAttribPointer(INSTANCE_ANIM_ATTRIB, 1, GL_FLOAT,
+				      GL_FALSE, sizeof(Instance), &i->anim);
+		glDrawElementsInstancedARB(GL_TRIANGLES, p.num_indices,
+					   p.index_type, NULL, count);
+		faces_drawn += p.num_indices / 3 * count;
+	} else {
+		glDrawElements(GL_TRIANGLES, p.num_indices, p.index_type,
+			       NULL);
+		faces_drawn += p.num_indices / 3;
+	}
+	draw_calls++;
+}
+
+/* Puts back the state which the groups do not expect */
+void finish_submit(const DrawState &state)
+{
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	if (state.texture_matrix) {
+		glMatrixMode(GL_TEXTURE);
+		glLoadIdentity();
+		glMatrixMode(GL_MODELVIEW);
+	}
+	if (state.animated_arrays) {
+		glClientActiveTexture(GL_TEXTURE1);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glClientActiveTexture(GL_TEXTURE2);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glClientActiveTexture(GL_TEXTURE0);
+	}
+	if (state.instance_arrays || state.vertex_index_array) {
+		DrawState off = state;
+		set_instance_arrays(false, false, &off);
+	}
+}
+
+/* See Model::queue_vat(). The vertex indices grow to the widest texture. */
+GLuint upload_vat(const void *data, size_t width, size_t size)
+{
+	GLsizei height = size / (width * 4 * sizeof(float));
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	if ((GLint) width > max_size || height > max_size) {
+		/* Drawn one by one */
+		return 0;
+	}
+	gfx_memory += size;
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, width, height, 0,
+		     GL_RGBA, GL_FLOAT, data);
+	glActiveTexture(GL_TEXTURE0);
+
+	if (width > vertex_index_count) {
+		std::vector<float> indices(width);
+		for (size_t i = 0; i < width; ++i) {
+			indices[i] = i;
+		}
+		if (vertex_index_buffer == 0) {
+			glGenBuffers(1, &vertex_index_buffer);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_index_buffer);
+		glBufferData(GL_ARRAY_BUFFER, width * sizeof(float),
+			     indices.data(), GL_STATIC_DRAW);
+		gfx_memory += (width - vertex_index_count) * sizeof(float);
+		vertex_index_count = width;
+	}
+	return texture;
+}
+
+const void *pack_indices(const std::vector<uint32_t> &indices, GLenum type,
+			 std::vector<uint16_t> *buf)
+{
+	if (type == GL_UNSIGNED_INT) return indices.data();
+
+	buf->assign(indices.begin(), indices.end());
+	return buf->data();
+}
+
+void unpack_indices(const void *data, size_t count, GLenum type,
+		    std::vector<uint32_t> *indices)
+{
+	if (type == GL_UNSIGNED_INT) {
+		const uint32_t *p = (const uint32_t *) data;
+		indices->assign(p, p + count);
+	} else {
+		const uint16_t *p = (const uint16_t *) data;
+		indices->assign(p, p + count);
+	}
+}
+
+/* Bounds of the texture coordinates in all keyframes */
+void tc_bounds(const std::vector<const Vertex *> &keyframes, size_t count,
+	       vec2 *tc_min, vec2 *tc_max)
+{
+	*tc_min = vec2(0, 0);
+	*tc_max = vec2(0, 0);
+	if (keyframes.empty() || count == 0) return;
+	*tc_min = *tc_max = keyframes[0][0].tc;
+	for (const Vertex *v : keyframes) {
+		for (size_t i = 0; i < count; ++i) {
+			tc_min->x = std::min(tc_min->x, v[i].tc.x);
+			tc_min->y = std::min(tc_min->y, v[i].tc.y);
+			tc_max->x = std::max(tc_max->x, v[i].tc.x);
+			tc_max->y = std::max(tc_max->y, v[i].tc.y);
+		}
+	}
+}
+
+/* Sum of the squared distances to a set of planes */
+class Quadric {
+public:
+	Quadric()
+	{
+		std::fill(m_a, m_a + 10, 0);
+	}
+
+	void add_plane(const vec3 &n, double d)
+	{
+		const double p[] = {n.x, n.y, n.z, d};
+		int k = 0;
+		for (int i = 0; i < 4; ++i) {
+			for (int j = i; j < 4; ++j) {
+				m_a[k++] += p[i] * p[j];
+			}
+		}
+	}
+
+	void add(const Quadric &q)
+	{
+		for (int i = 0; i < 10; ++i) {
+			m_a[i] += q.m_a[i];
+		}
+	}
+
+	double error(const vec3 &v) const
+	{
+		const double p[] = {v.x, v.y, v.z, 1};
+		double sum = 0;
+		int k = 0;
+		for (int i = 0; i < 4; ++i) {
+			for (int j = i; j < 4; ++j) {
+				sum += m_a[k++] * p[i] * p[j] * (i == j ? 1 : 2);
+			}
+		}
+		return sum;
+	}
+
+private:
+	double m_a[10];
+};
+
+/* Simplifies the triangles of a group by collapsing the edges which change
+ * the shape the least, see Garland & Heckbert, "Surface Simplification Using
+ * Quadric Error Metrics". The vertices which share a position (seams) move
+ * together, and only into existing vertices so that the keyframes can share
+ * the simplified indices. The borders stay in place, so the groups of the
+ * model do not crack apart.
+ */
+class Simplifier {
+public:
+	Simplifier(const Vertex *vertices, size_t num_verts,
+		   const std::vector<uint32_t> &indices);
+
+	size_t num_tris() const { return m_live; }
+	double size() const { return m_size; }
+
+	void simplify(size_t max_tris, double max_error);
+	void get_indices(std::vector<uint32_t> *indices) const;
+
+private:
+	struct Collapse {
+		double cost;
+		uint32_t from, to;
+		uint32_t from_version, to_version;
+
+		bool operator < (const Collapse &other) const
+		{
+			return cost > other.cost;
+		}
+	};
+
+	const Vertex *m_vertices;
+	std::vector<uint32_t> m_corners; /* three vertices for each face */
+	std::vector<bool> m_removed;
+	std::vector<uint32_t> m_pos; /* of each vertex */
+	std::vector<vec3> m_points;
+	std::vector<Quadric> m_quadrics;
+	std::vector<std::vector<uint32_t>> m_tris; /* using each position */
+	std::vector<std::vector<uint32_t>> m_verts; /* at each position */
+	std::vector<uint32_t> m_version;
+	std::vector<bool> m_locked;
+	std::priority_queue<Collapse> m_queue;
+	size_t m_live;
+	double m_size;
+
+	uint32_t position(uint32_t tri, int i) const
+	{
+		return m_pos[m_corners[tri * 3 + i]];
+	}
+	void neighbors(uint32_t p, std::vector<uint32_t> *out) const;
+	void push_edges(uint32_t p);
+	void collapse(uint32_t from, uint32_t to);
+	uint32_t closest_vertex(uint32_t vertex, uint32_t p) const;
+};
+
+Simplifier::Simplifier(const Vertex *vertices, size_t num_verts,
+		       const std::vector<uint32_t> &indices) :
+	m_vertices(vertices),
+	m_corners(indices),
+	m_removed(indices.size() / 3, false),
+	m_pos(num_verts),
+	m_live(0)
+{
+	std::unordered_map<vec3, uint32_t, VertexHash<vec3>,
+			   VertexEqual<vec3>> welded;
+	vec3 box_min(1e10, 1e10, 1e10);
+	vec3 box_max(-1e10, -1e10, -1e10);
+	for (size_t i = 0; i < num_verts; ++i) {
+		auto iter = welded.insert(std::make_pair(vertices[i].vert,
+						(uint32_t) m_points.size()));
+		if (iter.second) {
+			m_points.push_back(vertices[i].vert);
+			m_verts.push_back(std::vector<uint32_t>());
+		}
+		m_pos[i] = iter.first->second;
+		m_verts[m_pos[i]].push_back(i);
+		box_min = min(box_min, vertices[i].vert);
+		box_max = max(box_max, vertices[i].vert);
+	}
+	m_size = length(box_max - box_min);
+
+	size_t num_points = m_points.size();
+	m_quadrics.resize(num_points);
+	m_tris.resize(num_points);
+	m_version.assign(num_points, 0);
+	m_locked.assign(num_points, false);
+
+	/* Edges which do not have a face on both sides are borders */
+	std::unordered_map<uint64_t, int> edges;
+	for (uint32_t t = 0; t < m_removed.size(); ++t) {
+		uint32_t p[3];
+		for (int i = 0; i < 3; ++i) {
+			p[i] = position(t, i);
+		}
+		if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0]) {
+			m_removed[t] = true;
+			continue;
+		}
+		m_live++;
+
+		vec3 n = cross(m_points[p[1]] - m_points[p[0]],
+			       m_points[p[2]] - m_points[p[0]]);
+		if (length(n) > 1e-12) {
+			n *= 1 / length(n);
+		}
+		Quadric q;
+		q.add_plane(n, -dot(n, m_points[p[0]]));
+		for (int i = 0; i < 3; ++i) {
+			m_quadrics[p[i]].add(q);
+			m_tris[p[i]].push_back(t);
+
+			uint32_t a = p[i], b = p[(i + 1) % 3];
+			edges[(uint64_t) std::min(a, b) << 32 |
+			      std::max(a, b)]++;
+		}
+	}
+	for (const auto &edge : edges) {
+		if (edge.second != 2) {
+			m_locked[edge.first >> 32] = true;
+			m_locked[edge.first & 0xffffffff] = true;
+		}
+	}
+
+	for (uint32_t p = 0; p < num_points; ++p) {
+		push_edges(p);
+	}
+}
+
+void Simplifier::neighbors(uint32_t p, std::vector<uint32_t> *out) const
+{
+	out->clear();
+	for (uint32_t t : m_tris[p]) {
+		if (m_removed[t]) continue;
+		for (int i = 0; i < 3; ++i) {
+			if (position(t, i) != p) {
+				out->push_back(position(t, i));
+			}
+		}
+	}
+	std::sort(out->begin(), out->end());
+	out->erase(std::unique(out->begin(), out->end()), out->end());
+}
+
+void Simplifier::push_edges(uint32_t p)
+{
+	std::vector<uint32_t> near;
+	neighbors(p, &near);
+	for (uint32_t q : near) {
+		Quadric sum = m_quadrics[p];
+		sum.add(m_quadrics[q]);
+		Collapse c;
+		c.from_version = m_version[p];
+		c.to_version = m_version[q];
+		if (!m_locked[p]) {
+			c.cost = sum.error(m_points[q]);
+			c.from = p;
+			c.to = q;
+			m_queue.push(c);
+		}
+		if (!m_locked[q]) {
+			c.cost = sum.error(m_points[p]);
+			c.from = q;
+			c.to = p;
+			std::swap(c.from_version, c.to_version);
+			m_queue.push(c);
+		}
+	}
+}
+
+void Simplifier::simplify(size_t max_tris, double max_error)
+{
+	while (m_live > max_tris && !m_queue.empty()) {
+		Collapse c = m_queue.top();
+		if (c.cost > max_error) break;
+		m_queue.pop();
+		if (c.from_version != m_version[c.from] ||
+		    c.to_version != m_version[c.to]) {
+			continue;
+		}
+		collapse(c.from, c.to);
+	}
+}
+
+/* The vertex at the position which looks the most like the given one */
+uint32_t Simplifier::closest_vertex(uint32_t vertex, uint32_t p) const
+{
+	const Vertex &v = m_vertices[vertex];
+	uint32_t best = m_verts[p][0];
+	double best_dist = 1e10;
+	for (uint32_t i : m_verts[p]) {
+		vec3 dn = m_vertices[i].norm - v.norm;
+		vec2 dtc = m_vertices[i].tc - v.tc;
+		double dist = dot(dn, dn) + dtc.x * dtc.x + dtc.y * dtc.y;
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = i;
+		}
+	}
+	return best;
+}
+
+void Simplifier::collapse(uint32_t from, uint32_t to)
+{
+	/* The faces around the edge must be the only ones which the ends
+	 * share, otherwise the surface would fold onto itself.
+	 */
+	std::vector<uint32_t> near_from, near_to, common;
+	neighbors(from, &near_from);
+	neighbors(to, &near_to);
+	std::set_intersection(near_from.begin(), near_from.end(),
+			      near_to.begin(), near_to.end(),
+			      std::back_inserter(common));
+
+	std::vector<std::pair<uint32_t, uint32_t>> remap;
+	size_t shared = 0;
+	for (uint32_t t : m_tris[from]) {
+		if (m_removed[t]) continue;
+
+		int i_from = -1, i_to = -1;
+		for (int i = 0; i < 3; ++i) {
+			if (position(t, i) == from) i_from = i;
+			if (position(t, i) == to) i_to = i;
+		}
+		if (i_to >= 0) {
+			/* The vertices of the face keep their attributes */
+			remap.push_back(std::make_pair(m_corners[t * 3 + i_from],
+						       m_corners[t * 3 + i_to]));
+			shared++;
+			continue;
+		}
+
+		/* Do not flip faces */
+		const vec3 &a = m_points[position(t, (i_from + 1) % 3)];
+		const vec3 &b = m_points[position(t, (i_from + 2) % 3)];
+		vec3 before = cross(a - m_points[from], b - m_points[from]);
+		vec3 after = cross(a - m_points[to], b - m_points[to]);
+		if (dot(before, after) <= 1e-6 * length(before) * length(before)) {
+			return;
+		}
+	}
+	if (common.size() != shared) {
+		return;
+	}
 
-void png_error_func(png_structp png_ptr, png_const_charp error_msg)
-{
-	(void) png_ptr;
-	throw std::runtime_error(std::string("Error loading PNG: ") +
-				 error_msg);
+	for (uint32_t t : m_tris[from]) {
+		if (m_removed[t]) continue;
+
+		bool degenerate = false;
+		for (int i = 0; i < 3; ++i) {
+			if (position(t, i) == to) degenerate = true;
+		}
+		if (degenerate) {
+			m_removed[t] = true;
+			m_live--;
+			continue;
+		}
+		for (int i = 0; i < 3; ++i) {
+			uint32_t &v = m_corners[t * 3 + i];
+			if (m_pos[v] != from) continue;
+
+			auto iter = remap.begin();
+			while (iter != remap.end() && iter->first != v) ++iter;
+			if (iter == remap.end()) {
+				remap.push_back(std::make_pair(v,
+						closest_vertex(v, to)));
+				iter = remap.end() - 1;
+			}
+			v = iter->second;
+		}
+		m_tris[to].push_back(t);
+	}
+	m_tris[from].clear();
+	m_quadrics[to].add(m_quadrics[from]);
+	m_version[from]++;
+	m_version[to]++;
+
+	std::vector<uint32_t> live;
+	for (uint32_t t : m_tris[to]) {
+		if (!m_removed[t]) live.push_back(t);
+	}
+	m_tris[to].swap(live);
+	push_edges(to);
 }
 
-void png_read_data(png_structp png_ptr, png_bytep data, png_size_t len)
+void Simplifier::get_indices(std::vector<uint32_t> *indices) const
 {
-	PackFile *f = (PackFile *) png_get_io_ptr(png_ptr);
-	if (f->read(data, len) < len) {
-		throw std::runtime_error("Partial PNG");
+	indices->clear();
+	for (uint32_t t = 0; t < m_removed.size(); ++t) {
+		if (m_removed[t]) continue;
+		indices->insert(indices->end(), &m_corners[t * 3],
+				&m_corners[t * 3 + 3]);
 	}
 }
 
@@ -160,69 +2475,77 @@ void png_read_data(png_structp png_ptr, png_bytep data, png_size_t len)
 Texture::Texture() :
 	m_id(INVALID_TEXTURE),
 	m_width(0),
-	m_height(0)
+	m_height(0),
+	m_atlas(NULL),
+	m_tc_offset(0, 0),
+	m_tc_scale(1, 1),
+	m_memory(0),
+	m_mipmap(false),
+	m_alpha(false),
+	m_requested(false),
+	m_job(NULL),
+	m_used(0)
 {
 }
 
 void Texture::load(const char *fname, bool mipmap, bool alpha)
 {
-	printf("Loading %s\n", fname);
-	PackFile f;
-	f.open(fname);
-
-	png_byte header[8] = {};
-	f.read(header, sizeof header);
-	if (png_sig_cmp(header, 0, sizeof header)) {
-		throw std::runtime_error(std::string("Invalid PNG: ") + fname);
-	}
-
-	png_structp png_ptr =
-		png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	assert(png_ptr != NULL);
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	assert(info_ptr != NULL);
-
-	png_set_error_fn(png_ptr, NULL, png_error_func, NULL);
-	png_set_read_fn(png_ptr, &f, png_read_data);
-	png_set_sig_bytes(png_ptr, sizeof header);
-
-	png_read_info(png_ptr, info_ptr);
-	png_set_expand(png_ptr);
-	png_set_packing(png_ptr);
-
-	png_read_update_info(png_ptr, info_ptr);
+	Image image;
+	decode_image(&image, fname, alpha);
+	LoadTimer timer(fname, LOAD_UPLOAD);
+	upload_image(this, image, mipmap);
+	timer.count(m_memory);
+}
 
-	int width = png_get_image_width(png_ptr, info_ptr);
-	int height = png_get_image_height(png_ptr, info_ptr);
-	int channels = png_get_channels(png_ptr, info_ptr);;
+/* The size and the color are known before the texture is loaded */
+void Texture::load_later(const char *fname, bool mipmap, bool alpha,
+			 int width, int height, const Color &color)
+{
+	m_fname = fname;
+	m_mipmap = mipmap;
+	m_alpha = alpha;
+	m_width = width;
+	m_height = height;
+	m_color = color;
+}
 
-	GLuint type;
-	switch (png_get_color_type(png_ptr, info_ptr)) {
-	case PNG_COLOR_TYPE_GRAY:
-		type = alpha ? GL_ALPHA : GL_LUMINANCE;
-		break;
-	case PNG_COLOR_TYPE_GRAY_ALPHA:
-		type = GL_LUMINANCE_ALPHA;
-		break;
-	case PNG_COLOR_TYPE_RGB:
-		type = GL_RGB;
-		break;
-	case PNG_COLOR_TYPE_RGB_ALPHA:
-		type = GL_RGBA;
-		break;
-	default:
-		throw std::runtime_error("PNG has unknown color type");
+/* Starts loading the texture in the background, unless it is loaded or
+ * being loaded */
+void Texture::request(bool urgent) const
+{
+	if (m_atlas != NULL) {
+		m_atlas->request(urgent);
+		return;
 	}
-
-	std::vector<uint8_t> pixels(width * height * channels, 0);
-	std::vector<png_bytep> rows(height);
-	for (int i = 0; i < height; ++i) {
-		rows[i] = (png_bytep) &pixels[width * channels * i];
+	if (m_id != INVALID_TEXTURE || m_fname.empty()) return;
+	if (m_requested) {
+		/* Requested in advance, but now it is needed */
+		if (urgent) {
+			hurry_job(m_job);
+		}
+		return;
 	}
-	png_read_image(png_ptr, &rows[0]);
-	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	m_requested = true;
+	Job *job = new TextureJob(const_cast<Texture *>(this), m_fname.c_str(),
+				  m_mipmap, m_alpha);
+	m_job = job;
+	start_job(job, urgent);
+}
 
-	load(width, height, type, &pixels[0], mipmap);
+/* Frees the texture until it is bound again */
+void Texture::evict()
+{
+	assert(!m_fname.empty());
+	if (m_id == INVALID_TEXTURE) return;
+	printf("Evicting %s\n", m_fname.c_str());
+	if (bound_texture == m_id) {
+		bound_texture = INVALID_TEXTURE;
+	}
+	glDeleteTextures(1, &m_id);
+	m_id = INVALID_TEXTURE;
+	m_requested = false;
+	gfx_memory -= m_memory;
+	m_memory = 0;
 }
 
 void Texture::load(int width, int height, GLuint type, const uint8_t *data,
@@ -235,31 +2558,14 @@ void Texture::load(int width, int height, GLuint type, const uint8_t *data,
 
 	m_width = width;
 	m_height = height;
-	m_color = Color(0, 0, 0);
-
-	if (type == GL_RGB) {
-		Color sum(0, 0, 0);
-		for (int i = 0; i < width * height; ++i) {
-			sum.r += data[i * 3] / 255.0;
-			sum.g += data[i * 3 + 1] / 255.0;
-			sum.b += data[i * 3 + 2] / 255.0;
-		}
-		m_color = sum * (1.0 / (m_width*m_height));
-	} else if (type == GL_RGBA) {
-		Color sum(0, 0, 0);
-		for (int i = 0; i < width * height; ++i) {
-			sum.r += data[i * 4] / 255.0;
-			sum.g += data[i * 4 + 1] / 255.0;
-			sum.b += data[i * 4 + 2] / 255.0;
-		}
-		m_color = sum * (1.0 / (m_width*m_height));
-	}
+	m_color = average_color(width, height, type, data);
 
 	if (m_id == INVALID_TEXTURE) {
 		glGenTextures(1, &m_id);
 		assert(m_id != INVALID_TEXTURE);
 	}
 	glBindTexture(GL_TEXTURE_2D, m_id);
+	bound_texture = m_id;
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
 			mipmap ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
@@ -267,19 +2573,117 @@ void Texture::load(int width, int height, GLuint type, const uint8_t *data,
 	glTexImage2D(GL_TEXTURE_2D, 0, type, width, height, 0,
 		     type, GL_UNSIGNED_BYTE, data);
 
+	gfx_memory -= m_memory;
+	m_memory = 0;
 	while (width > 0 && height > 0) {
-		gfx_memory += width * height *
+		m_memory += width * height *
 			(type == GL_RGBA ? 4 : 3);
 		if (!mipmap) break;
 		width /= 2;
 		height /= 2;
 	}
+	gfx_memory += m_memory;
 }
 
-void Texture::bind() const
+/* Uploads the precomputed mipmap levels, starting from the full size. The
+ * driver compresses them if enabled. */
+void Texture::load(int width, int height, GLuint type,
+		   const std::vector<const uint8_t *> &levels,
+		   const Color &color)
 {
-	assert(m_id != INVALID_TEXTURE);
+	if ((width & (width - 1)) > 0 ||
+	    (height & (height - 1)) > 0) {
+		throw std::runtime_error("Non-power-of-two texture");
+	}
+
+	m_width = width;
+	m_height = height;
+	m_color = color;
+
+	GLenum format = type;
+	if (compress_textures && levels.size() > 1) {
+		if (type == GL_RGB) {
+			format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		} else if (type == GL_RGBA) {
+			format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		}
+	}
+
+	if (m_id == INVALID_TEXTURE) {
+		glGenTextures(1, &m_id);
+		assert(m_id != INVALID_TEXTURE);
+	}
 	glBindTexture(GL_TEXTURE_2D, m_id);
+	bound_texture = m_id;
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			levels.size() > 1 ? GL_LINEAR_MIPMAP_NEAREST :
+			GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_FALSE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,
+			levels.size() - 1);
+	/* The rows are not padded */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	gfx_memory -= m_memory;
+	m_memory = 0;
+	for (size_t i = 0; i < levels.size(); ++i) {
+		glTexImage2D(GL_TEXTURE_2D, i, format, width, height, 0,
+			     type, GL_UNSIGNED_BYTE, levels[i]);
+		m_memory += texture_size(format, width, height);
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	gfx_memory += m_memory;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+/* A rectangle of an atlas, which must not be freed before it. The atlas
+ * may be loaded later. The rectangle is drawn with the same texture
+ * coordinates as a whole texture. */
+void Texture::load(const Texture *atlas, int atlas_width, int atlas_height,
+		   int x, int y, int width, int height, const Color &color)
+{
+	m_atlas = atlas;
+	m_width = width;
+	m_height = height;
+	m_color = color;
+	m_tc_offset = vec2((double) x / atlas_width,
+			   (double) y / atlas_height);
+	m_tc_scale = vec2((double) width / atlas_width,
+			  (double) height / atlas_height);
+}
+
+/* Whether the coordinates stay in the rectangle and its gutter, so they
+ * can be drawn from the atlas */
+bool Texture::covers(const vec2 &tc_min, const vec2 &tc_max) const
+{
+	if (m_atlas == NULL) return true;
+	double x = (double) ATLAS_GUTTER / m_width;
+	double y = (double) ATLAS_GUTTER / m_height;
+	return tc_min.x >= -x && tc_min.y >= -y &&
+		tc_max.x <= 1 + x && tc_max.y <= 1 + y;
+}
+
+void Texture::bind() const
+{
+	const Texture *texture = m_atlas != NULL ? m_atlas : this;
+	texture->m_used = current_frame;
+	GLuint id = texture->m_id;
+	if (id == INVALID_TEXTURE) {
+		texture->request(true);
+		id = placeholder_texture();
+	}
+	if (id == bound_texture) return;
+	glBindTexture(GL_TEXTURE_2D, id);
+	bound_texture = id;
+	texture_binds++;
+}
+
+/* Maps the coordinate to the rectangle in the atlas */
+void Texture::tex_coord(double u, double v) const
+{
+	glTexCoord2f(u * m_tc_scale.x + m_tc_offset.x,
+		     v * m_tc_scale.y + m_tc_offset.y);
 }
 
 void Texture::draw() const
@@ -291,20 +2695,25 @@ void Texture::draw() const
 	bind();
 
 	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
+	tex_coord(0, 0);
 	glVertex3f(0, 0, 0);
-	glTexCoord2f(0, 1);
+	tex_coord(0, 1);
 	glVertex3f(0, m_height, 0);
-	glTexCoord2f(1, 1);
+	tex_coord(1, 1);
 	glVertex3f(m_width, m_height, 0);
-	glTexCoord2f(1, 0);
+	tex_coord(1, 0);
 	glVertex3f(m_width, 0, 0);
 	glEnd();
 }
 
 Model::Model() :
 	m_radius(0),
-	m_midpos(0, 0, 0)
+	m_midpos(0, 0, 0),
+	m_compact(compact_vertices),
+	m_build_lods(false),
+	m_num_lods(1),
+	m_uploaded(false),
+	m_memory_saved(0)
 {
 }
 
@@ -312,6 +2721,14 @@ void Model::load(const char *fname, double scale, int first_frame,
 		 int num_frames, bool noise)
 {
 	assert(num_frames >= 1);
+	m_build_lods = true;
+	LoadTimer timer(fname, LOAD_DECODE);
+
+	std::string compiled = compiled_mesh(fname);
+	if (pack_contains(compiled.c_str()) &&
+	    load_compiled(compiled.c_str(), scale, num_frames, noise)) {
+		return;
+	}
 
 	if (num_frames == 1) {
 		Mesh mesh;
@@ -325,26 +2742,247 @@ void Model::load(const char *fname, double scale, int first_frame,
 	m_frames.resize(num_frames);
 	m_radius = 0;
 
-	Mesh meshes[2];
-	Mesh first;
+	/* The keyframes use the same materials */
+	Mesh mesh;
+	std::vector<bool> drawn;
+	std::vector<FrameVertices> keyframes(num_frames);
+	std::vector<std::vector<Vertex>> shadows(num_frames);
+	std::vector<GLuint *> shadow_buffers;
+	std::vector<const Vertex *> shadow_vertices;
 	for (int i = 0; i < num_frames; ++i) {
 		char buf[64];
 		sprintf(buf, "%s_%06d.obj", fname, first_frame + i);
-		Mesh *mesh = &meshes[i & 1];
-		load_mesh(mesh, buf, scale);
+		load_mesh(&mesh, buf, scale);
 		if (i == 0) {
-			m_materials = meshes[0].materials;
-			meshes[1].materials = m_materials;
-			first = meshes[0];
-		} else {
-			load_frame(&m_frames[i - 1], &meshes[(i - 1) & 1],
-				   mesh);
+			m_materials = mesh.materials;
 		}
+		load_frame(&m_frames[i], &mesh, &drawn, &keyframes[i],
+			   &shadows[i]);
+		shadow_buffers.push_back(&m_frames[i].shadow_buffer);
+		shadow_vertices.push_back(shadows[i].data());
 	}
-	load_frame(&m_frames[num_frames - 1], &meshes[(num_frames - 1) & 1],
-		   &first);
 
 	m_radius = sqrt(m_radius);
+
+	/* The same faces are drawn, so every keyframe has as many */
+	queue_keyframes(shadow_buffers, shadow_vertices,
+			m_frames[0].shadow_count, 1, false, false,
+			&m_shadow_quant);
+
+	for (const auto &i : keyframes[0]) {
+		Group group;
+		group.mat = i.first;
+		group.midpos = middle(i.second);
+		std::vector<std::vector<Vertex>> vertices;
+		for (FrameVertices &keyframe : keyframes) {
+			vertices.push_back(keyframe[i.first]);
+		}
+		m_groups.push_back(group);
+		index_group(&m_groups.back(), vertices);
+	}
+}
+
+bool Model::load_compiled(const char *fname, double scale, int num_frames,
+			  bool noise)
+{
+	printf("Loading %s\n", fname);
+	PackFile f;
+	f.open(fname);
+
+	std::vector<uint8_t> buf;
+	MeshReader r(file_contents(&f, &buf), f.size());
+	const MeshHeader *header = r.get<MeshHeader>();
+	if (memcmp(header->magic, "KMSH", 4) != 0 ||
+	    header->version != MESH_VERSION) {
+		throw std::runtime_error(std::string("Unsupported mesh: ") +
+					 fname);
+	}
+	if ((int) header->frames != num_frames) {
+		printf("%s has %d frames, expected %d\n", fname,
+		       header->frames, num_frames);
+		return false;
+	}
+
+	Mesh mesh;
+	const MeshLib *libs = r.get<MeshLib>(header->mtllibs);
+	for (uint32_t i = 0; i < header->mtllibs; ++i) {
+		std::string name(libs[i].name,
+				 strnlen(libs[i].name, sizeof libs[i].name));
+		if (mesh.mtllibs.insert(pack_payload(name.c_str())).second) {
+			load_mtl(&mesh, name.c_str());
+		}
+	}
+
+	assert(m_frames.empty());
+	m_frames.resize(num_frames);
+	m_materials = mesh.materials;
+
+	bool animated = num_frames > 1;
+	if (noise && !animated) {
+		for (auto iter : m_materials) {
+			if (iter.second->texture == NULL) {
+				iter.second->texture = noise_texture();
+			}
+		}
+	}
+
+	const MeshGroup *groups = r.get<MeshGroup>(header->groups);
+	for (uint32_t i = 0; i < header->groups; ++i) {
+		std::string name(groups[i].material,
+				 strnlen(groups[i].material,
+					 sizeof groups[i].material));
+		auto iter = m_materials.find(name);
+		if (iter == m_materials.end()) {
+			throw std::runtime_error("Undefined material");
+		}
+		Group group;
+		group.mat = iter->second;
+		group.midpos = groups[i].midpos * scale;
+		group.count = groups[i].vertices;
+		group.num_indices = groups[i].indices;
+		group.index_type = index_type(group.count);
+		group.buffers.resize(num_frames);
+		m_groups.push_back(group);
+	}
+	std::vector<const void *> group_indices;
+	for (Group &group : m_groups) {
+		const void *indices = r.get_indices(group.num_indices,
+						    group.index_type);
+		queue_upload(GL_ELEMENT_ARRAY_BUFFER, &group.index_buffer,
+			     indices,
+			     group.num_indices * index_size(group.index_type),
+			     f.mapped());
+		count_savings(&group);
+		group_indices.push_back(indices);
+	}
+
+	/* The keyframes are queued together, they share the quantization */
+	std::vector<std::vector<const Vertex *>> vertices(m_groups.size());
+	std::vector<GLuint *> shadow_buffers;
+	std::vector<const Vertex *> shadow_vertices;
+	for (int i = 0; i < num_frames; ++i) {
+		Frame &frame = m_frames[i];
+		const uint32_t *counts = r.get<uint32_t>(2);
+		size_t j = 0;
+		for (Group &group : m_groups) {
+			vertices[j++].push_back(r.get<Vertex>(group.count));
+		}
+
+		frame.shadow_count = counts[0];
+		if (frame.shadow_count != m_frames[0].shadow_count) {
+			throw std::runtime_error("Keyframes have different faces");
+		}
+		shadow_buffers.push_back(&frame.shadow_buffer);
+		shadow_vertices.push_back(r.get<Vertex>(frame.shadow_count));
+
+		uint32_t num_faces = counts[1];
+		const CollFace *faces = r.get<CollFace>(num_faces);
+		frame.faces.assign(faces, faces + num_faces);
+		if (scale != 1) {
+			for (CollFace &face : frame.faces) {
+				for (int i = 0; i < 3; ++i) {
+					face.vert[i] *= scale;
+				}
+			}
+		}
+	}
+
+	size_t j = 0;
+	std::vector<uint32_t> indices;
+	for (Group &group : m_groups) {
+		std::vector<GLuint *> buffers;
+		for (GLuint &buffer : group.buffers) {
+			buffers.push_back(&buffer);
+		}
+		queue_keyframes(buffers, vertices[j], group.count, scale,
+				group.mat->texture == noise_texture(),
+				f.mapped(), &group.quant, &group.vat);
+		tc_bounds(vertices[j], group.count, &group.tc_min,
+			  &group.tc_max);
+
+		unpack_indices(group_indices[j], group.num_indices,
+			       group.index_type, &indices);
+		build_lods(&group, vertices[j][0], indices);
+		j++;
+	}
+	queue_keyframes(shadow_buffers, shadow_vertices,
+			m_frames[0].shadow_count, scale, false, f.mapped(),
+			&m_shadow_quant);
+
+	m_midpos = header->midpos * scale;
+	m_radius = header->radius * scale;
+	return true;
+}
+
+/* The compiled data is not scaled. Returns the given vertices if there is
+ * nothing to change, otherwise a scaled copy in the buffer. */
+const Vertex *Model::scale_vertices(const Vertex *v, size_t count,
+				    double scale, bool noise,
+				    std::vector<Vertex> *buf)
+{
+	if (scale == 1 && !noise) return v;
+
+	buf->assign(v, v + count);
+	for (Vertex &i : *buf) {
+		i.vert *= scale;
+		if (noise) {
+			i.tc = vec2((i.vert.x + i.vert.y) * 0.1,
+				    (i.vert.z + i.vert.y) * 0.1);
+		}
+	}
+	return buf->data();
+}
+
+/* Queues the vertices of each keyframe, quantized if the model is compact.
+ * The pointers must stay valid until upload() if the data is mapped. */
+void Model::queue_keyframes(const std::vector<GLuint *> &buffers,
+			    const std::vector<const Vertex *> &keyframes,
+			    size_t count, double scale, bool noise,
+			    bool mapped, Quantization *quant, GLuint *vat)
+{
+	assert(buffers.size() == keyframes.size());
+
+	std::vector<std::vector<Vertex>> scaled(keyframes.size());
+	std::vector<const Vertex *> vertices;
+	for (size_t i = 0; i < keyframes.size(); ++i) {
+		vertices.push_back(scale_vertices(keyframes[i], count, scale,
+						  noise, &scaled[i]));
+	}
+	if (vat != NULL) {
+		*vat = 0;
+		if (animation_textures && keyframes.size() > 1) {
+			queue_vat(vat, vertices, count);
+		}
+	}
+
+	if (!m_compact) {
+		*quant = identity_quantization();
+		for (size_t i = 0; i < keyframes.size(); ++i) {
+			queue_upload(GL_ARRAY_BUFFER, buffers[i], vertices[i],
+				     count * sizeof(Vertex),
+				     mapped && vertices[i] == keyframes[i]);
+		}
+		return;
+	}
+
+	VertexBounds bounds;
+	for (const Vertex *v : vertices) {
+		bounds.add(v, count);
+	}
+	*quant = bounds.quantization();
+	std::vector<CompactVertex> compact(count);
+	for (size_t i = 0; i < keyframes.size(); ++i) {
+		for (size_t j = 0; j < count; ++j) {
+			compact[j] = compact_vertex(vertices[i][j], *quant);
+		}
+		queue_upload(GL_ARRAY_BUFFER, buffers[i], compact.data(),
+			     count * sizeof(CompactVertex));
+	}
+}
+
+size_t Model::vertex_size() const
+{
+	return m_compact ? sizeof(CompactVertex) : sizeof(Vertex);
 }
 
 Material *Model::get_material(const char *name) const
@@ -356,85 +2994,73 @@ Material *Model::get_material(const char *name) const
 	return iter->second;
 }
 
-void Model::load_frame(Frame *frame, const Mesh *mesh, const Mesh *next)
+/* The faces which are drawn are decided by the first keyframe, since all
+ * keyframes must have the same triangles.
+ */
+void Model::load_frame(Frame *frame, const Mesh *mesh,
+		       std::vector<bool> *drawn, FrameVertices *vertices,
+		       std::vector<Vertex> *shadow)
 {
+	bool first = drawn->empty();
+	if (!first && drawn->size() != mesh->faces.size()) {
+		throw std::runtime_error("Keyframes have different faces");
+	}
+
 	vec3 box_min(1e10, 1e10, 1e10);
 	vec3 box_max(-1e10, -1e10, -1e10);
 
-	/* Assumes both meshes have the same materials and the faces are
-	 * in the same order. Also, texture coordinates are not animated.
-	 */
-	std::vector<GLAnimVertex> shadow;
-	std::unordered_map<const Material *, std::vector<GLAnimVertex>> materials;
-	auto nextiter = next->faces.begin();
-	for (const Face &a : mesh->faces) {
-		assert(nextiter != next->faces.end());
-		const Face &b = *nextiter;
-		++nextiter;
+	/* Texture coordinates are not animated */
+	for (size_t j = 0; j < mesh->faces.size(); ++j) {
+		const Face &f = mesh->faces[j];
 
 		CollFace coll;
 		coll.norm = normalize(cross(
-			a.vert[1].vert - a.vert[0].vert,
-			a.vert[2].vert - a.vert[0].vert));
-		if (coll.norm < 1e-4) {
-			printf("an empty face\n");
-			continue;
+			f.vert[1].vert - f.vert[0].vert,
+			f.vert[2].vert - f.vert[0].vert));
+		bool empty = coll.norm < 1e-4;
+		if (first) {
+			if (empty) {
+				printf("an empty face\n");
+			}
+			drawn->push_back(!empty);
 		}
-
-		/* Calculate edge vectors, which are used to find out whether a
-		 * point is inside the face.
-		 */
-		for (int i = 0; i < 3; ++i) {
-			coll.vert[i] = a.vert[i].vert;
-			vec3 d = a.vert[(i + 1) % 3].vert - a.vert[i].vert;
-			coll.edges[i] = normalize(cross(coll.norm, d));
+		if (!empty) {
+			/* Calculate edge vectors, which are used to find out
+			 * whether a point is inside the face.
+			 */
+			for (int i = 0; i < 3; ++i) {
+				coll.vert[i] = f.vert[i].vert;
+				vec3 d = f.vert[(i + 1) % 3].vert - f.vert[i].vert;
+				coll.edges[i] = normalize(cross(coll.norm, d));
+			}
+			frame->faces.push_back(coll);
 		}
-
-		frame->faces.push_back(coll);
+		if (!(*drawn)[j]) continue;
 
 		for (int i = 0; i < 3; ++i) {
-			GLAnimVertex v;
-			v.a_vert = a.vert[i].vert;
-			v.b_vert = b.vert[i].vert;
-
-			box_min = min(box_min, v.a_vert);
-			box_max = max(box_max, v.a_vert);
-
-			v.tc = a.vert[i].tc;
-			v.a_norm = a.vert[i].norm;
-			v.b_norm = b.vert[i].norm;
-			materials[a.mat].push_back(v);
+			box_min = min(box_min, f.vert[i].vert);
+			box_max = max(box_max, f.vert[i].vert);
+			(*vertices)[f.mat].push_back(f.vert[i]);
 		}
 
-		vec3 b_norm = normalize(cross(
-			b.vert[1].vert - b.vert[0].vert,
-			b.vert[2].vert - b.vert[0].vert));
-
 		/* Shadow volume which extrudes from each edge */
 		for (int i = 0; i < 3; ++i) {
-			GLAnimVertex v1;
-			GLAnimVertex v2;
-			v1.a_vert = a.vert[i].vert;
-			v1.b_vert = b.vert[i].vert;
-			v2.a_vert = a.vert[(i + 1) % 3].vert;
-			v2.b_vert = b.vert[(i + 1) % 3].vert;
-			v1.a_norm = coll.norm;
-			v1.b_norm = b_norm;
-			v2.a_norm = coll.norm;
-			v2.b_norm = b_norm;
+			Vertex v1 = f.vert[i];
+			Vertex v2 = f.vert[(i + 1) % 3];
+			v1.norm = coll.norm;
+			v2.norm = coll.norm;
 			v1.tc = vec2(0, 0);
 			v2.tc = vec2(0, 0);
-			shadow.push_back(v2);
-			shadow.push_back(v1);
+			shadow->push_back(v2);
+			shadow->push_back(v1);
 			v1.tc = vec2(RENDER_DIST, 0);
 			v2.tc = vec2(RENDER_DIST, 0);
-			shadow.push_back(v1);
-			shadow.push_back(v2);
+			shadow->push_back(v1);
+			shadow->push_back(v2);
 		}
 	}
-	assert(nextiter == next->faces.end());
 
-	if (frame == &m_frames[0]) {
+	if (first) {
 		m_midpos = (box_min + box_max) * 0.5;
 	}
 
@@ -449,39 +3075,13 @@ void Model::load_frame(Frame *frame, const Mesh *mesh, const Mesh *next)
 		}
 	}
 
-	for (const auto &i : materials) {
-		Group group;
-		group.mat = i.first;
-
-		gfx_memory += i.second.size() * sizeof(GLAnimVertex);
-
-		group.count = i.second.size();
-		glGenBuffers(1, &group.buffer);
-		glBindBuffer(GL_ARRAY_BUFFER, group.buffer);
-		glBufferData(GL_ARRAY_BUFFER,
-			     i.second.size() * sizeof(GLAnimVertex),
-			     &i.second[0],  GL_STATIC_DRAW);
-		frame->groups.push_back(group);
-	}
-
-	gfx_memory += shadow.size() * sizeof(GLAnimVertex);
-
-	frame->shadow_count = shadow.size();
-	glGenBuffers(1, &frame->shadow_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, frame->shadow_buffer);
-	glBufferData(GL_ARRAY_BUFFER,
-		     shadow.size() * sizeof(GLAnimVertex),
-		     &shadow[0],  GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	frame->shadow_count = shadow->size();
 }
 
-void Model::load(const Mesh *mesh, const std::list<Face> &faces,
+void Model::load(const Mesh *mesh, const std::vector<Face> &faces,
 		 bool noise)
 {
-	static const Texture *noise_tex;
-	if (noise_tex == NULL) {
-		noise_tex = get_texture("noise.png");
-	}
+	const Texture *noise_tex = noise_texture();
 
 	assert(m_frames.empty());
 	m_frames.resize(1);
@@ -567,39 +3167,183 @@ void Model::load(const Mesh *mesh, const std::list<Face> &faces,
 	}
 	m_radius = sqrt(m_radius);
 
-	for (const auto &i : materials) {
+	for (auto &i : materials) {
 		Group group;
 		group.mat = i.first;
-
 		/* TODO: Move this to somewhere else. Separate light init? */
-		vec3 box_min(1e10, 1e10, 1e10);
-		vec3 box_max(-1e10, -1e10, -1e10);
-		for (const Vertex &v : i.second) {
-			box_min = min(box_min, v.vert);
-			box_max = max(box_max, v.vert);
-		}
-		group.midpos = (box_min + box_max) * 0.5;
+		group.midpos = middle(i.second);
+		m_groups.push_back(group);
+		std::vector<std::vector<Vertex>> vertices(1);
+		vertices[0].swap(i.second);
+		index_group(&m_groups.back(), vertices);
+	}
+
+	m_frames[0].shadow_count = shadow.size();
+	queue_keyframes({&m_frames[0].shadow_buffer}, {shadow.data()},
+			shadow.size(), 1, false, false, &m_shadow_quant);
+}
+
+/* Welds the vertices of the keyframes and queues the indexed group */
+void Model::index_group(Group *group,
+			const std::vector<std::vector<Vertex>> &keyframes)
+{
+	std::vector<std::vector<Vertex>> vertices;
+	std::vector<uint32_t> indices;
+	index_vertices(keyframes, &vertices, &indices);
+
+	group->count = vertices[0].size();
+	group->num_indices = indices.size();
+	group->index_type = index_type(group->count);
+	group->buffers.resize(vertices.size());
+	std::vector<GLuint *> buffers;
+	std::vector<const Vertex *> data;
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		buffers.push_back(&group->buffers[i]);
+		data.push_back(vertices[i].data());
+	}
+	queue_keyframes(buffers, data, group->count, 1, false, false,
+			&group->quant, &group->vat);
+	tc_bounds(data, group->count, &group->tc_min, &group->tc_max);
+	std::vector<uint16_t> buf;
+	queue_upload(GL_ELEMENT_ARRAY_BUFFER, &group->index_buffer,
+		     pack_indices(indices, group->index_type, &buf),
+		     group->num_indices * index_size(group->index_type));
+	count_savings(group);
+	build_lods(group, vertices[0].data(), indices);
+}
 
-		gfx_memory += i.second.size() * sizeof(Vertex);
+/* Each level has about half of the faces of the previous one, unless the
+ * shape would change too much. The coarser levels may change it more. */
+void Model::build_lods(Group *group, const Vertex *vertices,
+		       const std::vector<uint32_t> &indices)
+{
+	if (!m_build_lods) return;
+
+	Simplifier simplifier(vertices, group->count, indices);
+	double max_error = simplifier.size() * LOD_MAX_ERROR;
+
+	std::vector<std::vector<uint32_t>> levels;
+	size_t num_tris = simplifier.num_tris();
+	for (size_t i = 1; i < MAX_LODS; ++i, max_error *= 2) {
+		simplifier.simplify(num_tris / 2, max_error * max_error);
+		/* Not worth another level */
+		if (simplifier.num_tris() * 4 > num_tris * 3) continue;
+
+		num_tris = simplifier.num_tris();
+		levels.push_back(std::vector<uint32_t>());
+		simplifier.get_indices(&levels.back());
+		optimize_triangles(&levels.back(), group->count);
+	}
+
+	group->lods.resize(levels.size());
+	std::vector<uint16_t> buf;
+	for (size_t i = 0; i < levels.size(); ++i) {
+		Lod *lod = &group->lods[i];
+		lod->num_indices = levels[i].size();
+		queue_upload(GL_ELEMENT_ARRAY_BUFFER, &lod->index_buffer,
+			     pack_indices(levels[i], group->index_type, &buf),
+			     lod->num_indices * index_size(group->index_type));
+	}
+	m_num_lods = std::max(m_num_lods, levels.size() + 1);
+}
+
+/* Compared to three vertices for each face in each keyframe */
+void Model::count_savings(const Group *group)
+{
+	size_t frames = group->buffers.size();
+	size_t used = group->count * vertex_size() * frames +
+		      group->num_indices * index_size(group->index_type);
+	size_t unshared = group->num_indices * vertex_size() * frames;
+	if (unshared > used) {
+		m_memory_saved += unshared - used;
+	}
+}
 
-		group.count = i.second.size();
-		glGenBuffers(1, &group.buffer);
-		glBindBuffer(GL_ARRAY_BUFFER, group.buffer);
-		glBufferData(GL_ARRAY_BUFFER,
-			     i.second.size() * sizeof(Vertex),
-			     &i.second[0],  GL_STATIC_DRAW);
-		m_frames[0].groups.push_back(group);
+/* The vertex data is kept until upload() unless it is in the mapped pack */
+void Model::queue_upload(GLenum target, GLuint *buffer, const void *data,
+			 size_t size, bool mapped)
+{
+	*buffer = 0;
+	m_uploads.push_back(Upload());
+	Upload *upload = &m_uploads.back();
+	upload->target = target;
+	upload->buffer = buffer;
+	upload->size = size;
+	upload->width = 0;
+	if (mapped) {
+		upload->data = data;
+	} else {
+		const uint8_t *p = (const uint8_t *) data;
+		upload->copy.assign(p, p + size);
+		upload->data = upload->copy.data();
 	}
+}
 
-	gfx_memory += shadow.size() * sizeof(Vertex);
+/* The positions and normals of each keyframe are rows of a float texture,
+ * which the animated instances read by the vertex index */
+void Model::queue_vat(GLuint *vat, const std::vector<const Vertex *> &keyframes,
+		      size_t count)
+{
+	std::vector<float> texels;
+	texels.reserve(count * keyframes.size() * 8);
+	for (const Vertex *v : keyframes) {
+		for (size_t i = 0; i < count; ++i) {
+			const vec3 &p = v[i].vert;
+			texels.insert(texels.end(), {p.x, p.y, p.z, 1});
+		}
+		for (size_t i = 0; i < count; ++i) {
+			const vec3 &n = v[i].norm;
+			texels.insert(texels.end(), {n.x, n.y, n.z, 0});
+		}
+	}
+	queue_upload(GL_TEXTURE_2D, vat, texels.data(),
+		     texels.size() * sizeof(float));
+	m_uploads.back().width = count;
+}
 
-	m_frames[0].shadow_count = shadow.size();
-	glGenBuffers(1, &m_frames[0].shadow_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, m_frames[0].shadow_buffer);
-	glBufferData(GL_ARRAY_BUFFER,
-		     shadow.size() * sizeof(Vertex),
-		     &shadow[0],  GL_STATIC_DRAW);
+void Model::upload()
+{
+	for (const Upload &upload : m_uploads) {
+		if (upload.target == GL_TEXTURE_2D) {
+			*upload.buffer = upload_vat(upload.data, upload.width,
+						    upload.size);
+			continue;
+		}
+		*upload.buffer = upload_buffer(upload.target, upload.data,
+					       upload.size);
+	}
+	m_uploads.clear();
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	/* The atlas can not repeat a texture or animate it */
+	for (Group &g : m_groups) {
+		const Texture *texture = g.mat->texture;
+		g.texture = NULL;
+		if (texture != NULL && texture->atlas() != NULL &&
+		    (g.mat->num_frames > 0 ||
+		     !texture->covers(g.tc_min, g.tc_max))) {
+			g.texture = whole_texture(texture);
+		}
+		/* Loaded in the background while the model is placed */
+		if (g.texture != NULL) {
+			g.texture->request();
+		} else if (texture != NULL) {
+			texture->request();
+		}
+	}
+	/* Groups which draw from the same texture or atlas follow each other,
+	   so it is bound only once */
+	m_groups.sort([](const Group &a, const Group &b) {
+		return bound_texture_of(a.texture != NULL ? a.texture :
+					a.mat->texture) <
+			bound_texture_of(b.texture != NULL ? b.texture :
+					 b.mat->texture);
+	});
+
+	gfx_memory_saved += m_memory_saved;
+	m_memory_saved = 0;
+	m_uploaded = true;
 }
 
 bool Model::raytrace(const vec3 &pos, const vec3 &ray, double anim,
@@ -653,56 +3397,43 @@ std::list<const CollFace *> Model::find_collisions(const vec3 &pos, double rad,
 }
 
 /* Assumes we are in a render mode, see begin_rendering(). */
-void Model::render(int flags, double anim, const Color &ambient) const
+void Model::render(int flags, double anim, const Color &ambient,
+		   size_t lod) const
 {
 	static const Texture *blank;
-	const float black[] = {0, 0, 0, 1};
-	const float white[] = {1, 1, 1, 1};
 
 	if (m_frames.empty()) return;
 
 	assert(current_program != NULL);
+	assert(m_uploads.empty());
 
 	/* It's easier to switch to a blank texture for textures without one */
 	if (blank == NULL) {
 		blank = get_texture("blank.png");
 	}
 
-	if (m_frames.size() > 1) {
-		GLint loc = current_program->uniform("x");
-		glUniform1f(loc, anim - (int) floor(anim));
-
-		glClientActiveTexture(GL_TEXTURE1);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glClientActiveTexture(GL_TEXTURE2);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glClientActiveTexture(GL_TEXTURE0);
-	} else {
-		/* We always use the animation shader, so better set this */
-		GLint loc = current_program->uniform("x");
-		glUniform1f(loc, 0);
-	}
-
-	const Frame *frame = &m_frames[(int) floor(anim) % m_frames.size()];
+	size_t keyframe = (size_t) floor(anim) % m_frames.size();
+	size_t next = (keyframe + 1) % m_frames.size();
+	bool animated = m_frames.size() > 1;
+	const Frame *frame = &m_frames[keyframe];
 
 	if (flags & RENDER_SHADOW_VOL) {
-		glBindBuffer(GL_ARRAY_BUFFER, frame->shadow_buffer);
-		if (m_frames.size() == 1) {
-			Vertex *v = NULL;
-			glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &v->vert);
-			glNormalPointer(GL_FLOAT, sizeof(Vertex), &v->norm);
-			glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &v->tc);
-		} else {
-			GLAnimVertex *v = NULL;
-			glVertexPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->a_vert);
-			glNormalPointer(GL_FLOAT, sizeof(GLAnimVertex), &v->a_norm);
-			glTexCoordPointer(2, GL_FLOAT, sizeof(GLAnimVertex), &v->tc);
+		assert(!queue_active);
+		upload_lights();
+		/* We always use the animation shader, so better set this */
+		GLint loc = current_program->uniform(UNIFORM_X);
+		glUniform1f(loc, animated ? anim - (int) floor(anim) : 0);
+		if (animated) {
 			glClientActiveTexture(GL_TEXTURE1);
-			glTexCoordPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->b_vert);
+			glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 			glClientActiveTexture(GL_TEXTURE2);
-			glTexCoordPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->b_norm);
+			glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 			glClientActiveTexture(GL_TEXTURE0);
 		}
+		set_quantization(m_shadow_quant);
+		bind_vertices(frame->shadow_buffer,
+			      m_frames[next].shadow_buffer, animated,
+			      m_compact);
 		glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
 		glFrontFace(GL_CCW);
 		glDrawArrays(GL_QUADS, 0, frame->shadow_count);
@@ -712,89 +3443,109 @@ void Model::render(int flags, double anim, const Color &ambient) const
 		glDrawArrays(GL_QUADS, 0, frame->shadow_count);
 
 		faces_drawn += frame->shadow_count / 2;
-	} else
-	for (const Group &g : frame->groups) {
-		GLState gl;
+		draw_calls += 2;
+		DrawState state;
+		state.animated_arrays = animated;
+		finish_submit(state);
+		return;
+	}
+
+	/* Drawn right away, unless a queue is active */
+	DrawState state;
+	size_t light_set = NONE;
+	size_t matrix = NONE;
+	if (queue_active) {
+		light_set = capture_light_set();
+	} else {
+		upload_lights();
+	}
+	for (const Group &g : m_groups) {
 		if (g.mat->color.a < 1) {
 			if (!(flags & RENDER_GLASS)) continue;
 		} else {
 			if (flags & RENDER_GLASS) continue;
 		}
-		if (g.mat->num_frames > 0) {
-			glMatrixMode(GL_TEXTURE);
-			glScalef(1.0 / g.mat->num_cols,
-				 1.0 / (g.mat->num_frames / g.mat->num_cols),
-				 1);
-			glTranslatef(g.mat->frame / (g.mat->num_frames / g.mat->num_cols),
-				     g.mat->frame, 0);
-			glMatrixMode(GL_MODELVIEW);
+		DrawPacket p;
+		p.light_set = light_set;
+		p.matrix = matrix;
+		p.mat = g.mat;
+		p.frame = g.mat->frame;
+		p.num_frames = g.mat->num_frames;
+		p.num_cols = g.mat->num_cols;
+		p.anim = animated ? anim - (int) floor(anim) : 0;
+
+		const Texture *texture = g.texture != NULL ? g.texture :
+			g.mat->texture;
+		if (texture == NULL) {
+			texture = blank;
 		}
 		if (flags & RENDER_BLOOM) {
 			/* We don't have any lights so everything is based on
 			 * the ambient we set here.
 			 */
 			if (g.mat->brightness > 0 && (flags & RENDER_LIGHTS_ON)) {
-				if (g.mat->texture != NULL) {
-					g.mat->texture->bind();
-				} else {
-					blank->bind();
-				}
-				float ambient[] = {(float) g.mat->brightness,
-						   (float) g.mat->brightness,
-						   (float) g.mat->brightness, 1};
-				glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
+				p.ambient = Color(g.mat->brightness,
+						  g.mat->brightness,
+						  g.mat->brightness);
 			} else {
-				glLightModelfv(GL_LIGHT_MODEL_AMBIENT, black);
-				blank->bind();
+				p.ambient = Color(0, 0, 0);
+				texture = blank;
 			}
 		} else {
-			if (g.mat->texture != NULL) {
-				g.mat->texture->bind();
-			} else {
-				blank->bind();
-			}
 			if (g.mat->brightness > 0 && (flags & RENDER_LIGHTS_ON)) {
-				glLightModelfv(GL_LIGHT_MODEL_AMBIENT, white);
+				p.ambient = Color(1, 1, 1);
 			} else {
-				glLightModelfv(GL_LIGHT_MODEL_AMBIENT,
-						&ambient.r);
+				p.ambient = ambient;
 			}
 		}
-		glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE,
-			     &g.mat->color.r);
-
-		glBindBuffer(GL_ARRAY_BUFFER, g.buffer);
-		if (m_frames.size() == 1) {
-			Vertex *v = NULL;
-			glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &v->vert);
-			glNormalPointer(GL_FLOAT, sizeof(Vertex), &v->norm);
-			glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &v->tc);
-		} else {
-			GLAnimVertex *v = NULL;
-			glVertexPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->a_vert);
-			glNormalPointer(GL_FLOAT, sizeof(GLAnimVertex), &v->a_norm);
-			glTexCoordPointer(2, GL_FLOAT, sizeof(GLAnimVertex), &v->tc);
-			glClientActiveTexture(GL_TEXTURE1);
-			glTexCoordPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->b_vert);
-			glClientActiveTexture(GL_TEXTURE2);
-			glTexCoordPointer(3, GL_FLOAT, sizeof(GLAnimVertex), &v->b_norm);
-			glClientActiveTexture(GL_TEXTURE0);
+		p.texture = texture;
+		p.color = g.mat->color;
+
+		p.quant = &g.quant;
+		p.buffer = g.buffers[keyframe];
+		p.next = g.buffers[next];
+		p.animated = animated;
+		p.compact = m_compact;
+		p.index_buffer = g.index_buffer;
+		p.num_indices = g.num_indices;
+		p.index_type = g.index_type;
+		p.vat = 0;
+		p.vat_width = 0;
+		p.vat_frames = 0;
+		p.phase = 0;
+		if (queue_active && g.vat != 0) {
+			/* The shader blends the keyframes */
+			p.vat = g.vat;
+			p.vat_width = g.count;
+			p.vat_frames = m_frames.size();
+			p.phase = keyframe + (anim - floor(anim));
+			p.anim = 0;
+			p.buffer = g.buffers[0];
+			p.next = 0;
+			p.animated = false;
+		}
+		if (lod > 0 && !g.lods.empty()) {
+			const Lod &l = g.lods[std::min(lod, g.lods.size()) - 1];
+			p.index_buffer = l.index_buffer;
+			p.num_indices = l.num_indices;
 		}
-		glDrawArrays(GL_TRIANGLES, 0, g.count);
-		faces_drawn += g.count / 3;
 
-		if (g.mat->num_frames > 0) {
-			glMatrixMode(GL_TEXTURE);
-			glLoadIdentity();
-			glMatrixMode(GL_MODELVIEW);
+		if (!queue_active) {
+			submit(p, &state);
+			continue;
 		}
+		if (matrix == NONE) {
+			/* Objects move the modelview matrix between models */
+			ModelView m;
+			glGetFloatv(GL_MODELVIEW_MATRIX, m.m);
+			matrix = draw_matrices.size();
+			draw_matrices.push_back(m);
+			p.matrix = matrix;
+		}
+		draw_queue.push_back(p);
 	}
-	if (m_frames.size() > 1) {
-		glClientActiveTexture(GL_TEXTURE1);
-		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-		glClientActiveTexture(GL_TEXTURE2);
-		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-		glClientActiveTexture(GL_TEXTURE0);
+	if (!queue_active) {
+		finish_submit(state);
 	}
 }
 
@@ -804,7 +3555,7 @@ std::list<Model::Light> Model::get_lights() const
 	if (m_frames.empty()) {
 		return lights;
 	}
-	for (const Group & g : m_frames[0].groups) {
+	for (const Group &g : m_groups) {
 		if (g.mat->brightness > 0) {
 			Light l;
 			l.pos = g.midpos;
@@ -815,6 +3566,13 @@ std::list<Model::Light> Model::get_lights() const
 	return lights;
 }
 
+void save_program_cache()
+{
+	if (!program_cache_dirty) return;
+	program_cache_dirty = false;
+	write_program_cache();
+}
+
 void check_gl_errors()
 {
 	static int modelview_stack_depth = -1;
@@ -843,41 +3601,71 @@ void check_gl_errors()
 
 FBO::FBO() :
 	m_fbo(0),
-	m_texture(INVALID_TEXTURE),
+	m_num_textures(0),
 	m_depthbuf(0)
 {
+	for (int i = 0; i < MAX_TEXTURES; ++i) {
+		m_textures[i] = INVALID_TEXTURE;
+	}
 }
 
 void FBO::init(int width, int height, bool bilinear, bool depth, bool stencil)
+{
+	const GLenum format = GL_RGB8;
+	init_textures(width, height, &format, 1,
+		      bilinear ? GL_LINEAR : GL_NEAREST, depth);
+}
+
+void FBO::init(int width, int height, const GLenum *formats, int count,
+	       bool depth)
+{
+	init_textures(width, height, formats, count, GL_NEAREST, depth);
+}
+
+void FBO::init_textures(int width, int height, const GLenum *formats,
+			int count, GLenum filter, bool depth)
 {
 	printf("creating FBO %d x %d\n", width, height);
+	assert(count > 0 && count <= MAX_TEXTURES);
 
 	if (m_fbo == 0) {
 		glGenFramebuffers(1, &m_fbo);
-		glGenTextures(1, &m_texture);
 		assert(m_fbo > 0);
-		assert(m_texture != INVALID_TEXTURE);
+	}
+	if (m_num_textures < count) {
+		glGenTextures(count - m_num_textures,
+			      &m_textures[m_num_textures]);
+		m_num_textures = count;
 	}
 	if (depth && m_depthbuf == 0) {
 		glGenRenderbuffers(1, &m_depthbuf);
 	}
 
-	GLenum filter = bilinear ? GL_LINEAR : GL_NEAREST;
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, m_texture);
-	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_S,
-			GL_CLAMP_TO_EDGE);
-	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_T,
-			GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER,
-			filter);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER,
-			filter);
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGB8, width, height,
-		     0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			       GL_TEXTURE_RECTANGLE_ARB, m_texture, 0);
+	GLenum buffers[MAX_TEXTURES];
+	for (int i = 0; i < count; ++i) {
+		assert(m_textures[i] != INVALID_TEXTURE);
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, m_textures[i]);
+		glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+		glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER,
+				filter);
+		glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER,
+				filter);
+		/* No data, so the float formats take this too */
+		glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, formats[i], width,
+			     height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+		buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+		glFramebufferTexture2D(GL_FRAMEBUFFER, buffers[i],
+				       GL_TEXTURE_RECTANGLE_ARB, m_textures[i], 0);
+	}
+	if (count > 1) {
+		/* Belongs to the FBO */
+		glDrawBuffers(count, buffers);
+	}
 
 	if (depth) {
 		glBindRenderbuffer(GL_RENDERBUFFER, m_depthbuf);
@@ -914,10 +3702,10 @@ void FBO::begin_drawing() const
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 }
 
-void FBO::bind_texture() const
+void FBO::bind_texture(int i) const
 {
-	assert(m_texture != INVALID_TEXTURE);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, m_texture);
+	assert(i < m_num_textures);
+	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, m_textures[i]);
 }
 
 Font::Font()
@@ -927,6 +3715,7 @@ Font::Font()
 void Font::load(const char *fname)
 {
 	printf("Loading %s\n", fname);
+	LoadTimer timer(fname, LOAD_DECODE);
 	PackFile f;
 	f.open(fname);
 
@@ -1064,11 +3853,22 @@ void print_shader_log(GLuint obj)
 Program::Program() :
 	m_id(0)
 {
+	for (int i = 0; i < NUM_UNIFORMS; ++i) {
+		m_uniforms[i] = -1;
+	}
 }
 
 void Program::load(const char *vertex_shader, const char *frag_shader)
 {
-	m_lookup.clear();
+	if (m_id == 0) {
+		m_id = glCreateProgram();
+		assert(m_id > 0);
+	}
+	uint64_t key = hash_string(frag_shader, hash_string(vertex_shader));
+	if (load_program_binary(m_id, key)) {
+		find_uniforms();
+		return;
+	}
 
 	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
 	glShaderSource(vs, 1, &vertex_shader, NULL);
@@ -1080,13 +3880,16 @@ void Program::load(const char *vertex_shader, const char *frag_shader)
 	glCompileShader(fs);
 	print_shader_log(fs);
 
-	if (m_id == 0) {
-		m_id = glCreateProgram();
-		assert(m_id > 0);
-	}
-
 	glAttachShader(m_id, vs);
 	glAttachShader(m_id, fs);
+	if (GLEW_ARB_get_program_binary) {
+		glProgramParameteri(m_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+				    GL_TRUE);
+	}
+	glBindAttribLocation(m_id, INSTANCE_MATRIX_ATTRIB, "instance_matrix");
+	glBindAttribLocation(m_id, INSTANCE_COLOR_ATTRIB, "instance_color");
+	glBindAttribLocation(m_id, INSTANCE_ANIM_ATTRIB, "instance_anim");
+	glBindAttribLocation(m_id, VERTEX_INDEX_ATTRIB, "vertex_index");
 	glLinkProgram(m_id);
 	print_shader_log(m_id);
 	int status;
@@ -1100,64 +3903,64 @@ void Program::load(const char *vertex_shader, const char *frag_shader)
 	 */
 	glUseProgram(m_id);
 	glUseProgram(0);
+
+	save_program_binary(m_id, key);
+	find_uniforms();
 }
 
-void Program::use() const
+/* Missing ones are -1, which OpenGL ignores */
+void Program::find_uniforms()
 {
-	assert(m_id > 0);
-	glUseProgram(m_id);
+	for (int i = 0; i < NUM_UNIFORMS; ++i) {
+		m_uniforms[i] = glGetUniformLocation(m_id, uniform_names[i]);
+	}
 }
 
-GLint Program::uniform(const char *name)
+void Program::use() const
 {
 	assert(m_id > 0);
-	auto iter = m_lookup.find(name);
-	GLint location;
-	if (iter == m_lookup.end()) {
-		location = glGetUniformLocation(m_id, name);
-		if (location == -1) {
-			throw std::runtime_error(std::string("Uniform not found: ") +
-					   name);
-		}
-		m_lookup[name] = location;
-	} else {
-		location = iter->second;
-	}
-	return location;
+	glUseProgram(m_id);
 }
 
 void begin_rendering(size_t numlights, int flags, const vec3 &light)
 {
-	static Program simple_programs[MAX_LIGHTS + 1];
-	static Program perpixel_programs[MAX_LIGHTS + 1];
 	static Program shadow_program;
-	if (!simple_programs[0].loaded()) {
-		/* Hey, look! Self-modifying (shader) code */
-		for (size_t i = 0; i <= MAX_LIGHTS; ++i) {
-			char buf[sizeof simple_vs + 16];
-			/* Some NVIDIA drivers can not arrays of length 1 */
-			sprintf(buf, simple_vs, std::max<int>(i, 2), (int) i);
-			simple_programs[i].load(buf, simple_fs);
-		}
-		for (size_t i = 0; i <= MAX_LIGHTS; ++i) {
-			char buf[sizeof perpixel_fs + 16];
-			sprintf(buf, perpixel_fs, std::max<int>(i, 2), (int) i);
-			perpixel_programs[i].load(perpixel_vs, buf);
-		}
-		shadow_program.load(shadow_vs, shadow_fs);
-	}
 	assert(numlights <= MAX_LIGHTS);
+	num_lights = numlights;
+	lights_changed = false;
+	current_light_set = NONE;
+	current_lighting = SET_LIGHTS;
+
 	if (flags & RENDER_SHADOW_VOL) {
 		current_program = &shadow_program;
+		if (!current_program->loaded()) {
+			LoadTimer timer("shaders", LOAD_UPLOAD);
+			current_program->load(shadow_vs, shadow_fs);
+		}
+		assert(!queue_active);
 		current_program->use();
-		GLint loc = current_program->uniform("light");
+		GLint loc = current_program->uniform(UNIFORM_LIGHT);
 		glUniform3fv(loc, 1, &light.x);
 
-	} else if (quality >= 2 && !(flags & RENDER_BLOOM)) {
-		current_program = &perpixel_programs[numlights];
-		current_program->use();
 	} else {
-		current_program = &simple_programs[numlights];
+		current_perpixel = quality >= 2 && !(flags & RENDER_BLOOM);
+		if (flags & RENDER_DEFERRED) {
+			assert(numlights == 0 && current_perpixel);
+			current_lighting = GBUFFER;
+			current_program = gbuffer_program(SINGLE);
+		} else if (flags & RENDER_CLUSTERED) {
+			assert(numlights == 0 && current_perpixel);
+			current_lighting = CLUSTERS;
+			current_program = clustered_program(SINGLE);
+			lights_changed = true;
+		} else {
+			current_program = lit_program(numlights,
+						      current_perpixel, SINGLE);
+		}
+		if (queue_active) {
+			/* flush_queue() sets up the state */
+			return;
+		}
 		current_program->use();
 	}
 
@@ -1168,6 +3971,10 @@ void begin_rendering(size_t numlights, int flags, const vec3 &light)
 
 void end_rendering()
 {
+	if (queue_active) {
+		current_program = NULL;
+		return;
+	}
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -1178,45 +3985,216 @@ void end_rendering()
 
 void set_light(int n, const vec3 &pos, const Color &color, double brightness)
 {
-	assert(n >= 0 && n < (int) MAX_LIGHTS);
+	assert(n >= 0 && n < (int) num_lights);
 	assert(brightness > 0);
 
-	char buf[64];
-	sprintf(buf, "lights[%d].pos", n);
-	GLint loc = current_program->uniform(buf);
-	glUniform3fv(loc, 1, &pos.x);
+	light_pos[n] = pos;
+	light_diffuse[n] = color;
+	light_brightness[n] = brightness;
+	lights_changed = true;
+	current_light_set = NONE;
+}
+
+void begin_clusters()
+{
+	cluster_lights.clear();
+}
+
+void add_cluster_light(const vec3 &pos, const Color &color,
+		       double brightness)
+{
+	assert(brightness > 0);
+	ClusterLight light;
+	light.pos[0] = pos.x;
+	light.pos[1] = pos.y;
+	light.pos[2] = pos.z;
+	light.reach = LIGHT_MAX_DIST * brightness;
+	light.color = color;
+	cluster_lights.push_back(light);
+}
+
+/* The shader finds the cluster of a pixel from its window coordinates and
+ * the w of its clip coordinates. The game has the camera in the projection
+ * matrix, so it maps the world to the clip coordinates. */
+void upload_clusters()
+{
+	float m[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, m);
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	cluster_scale[0] = (float) CLUSTERS_X / viewport[2];
+	cluster_scale[1] = (float) CLUSTERS_Y / viewport[3];
+	cluster_scale[2] = viewport[0];
+	cluster_scale[3] = viewport[1];
+
+	double slice_scale = log(RENDER_DIST / CLUSTER_NEAR) / CLUSTERS_Z;
+	for (std::vector<size_t> &list : cluster_lists) {
+		list.clear();
+	}
+	for (size_t i = 0; i < cluster_lights.size(); ++i) {
+		const ClusterLight &light = cluster_lights[i];
+		/* The clip coordinates of the light, and how much they change
+		 * within its reach */
+		double clip[4], reach[4];
+		for (int row = 0; row < 4; ++row) {
+			const float *r = &m[row];
+			clip[row] = r[0] * light.pos[0] + r[4] * light.pos[1] +
+				    r[8] * light.pos[2] + r[12];
+			reach[row] = sqrt(r[0] * r[0] + r[4] * r[4] +
+					  r[8] * r[8]) * light.reach;
+		}
+		/* Windows headers define near and far */
+		double closest = std::max(clip[3] - reach[3], CLUSTER_NEAR);
+		double farthest = std::min(clip[3] + reach[3],
+					   (double) RENDER_DIST);
+		if (closest > farthest) continue;
+
+		int last_slice = cluster_slice(farthest);
+		for (int z = cluster_slice(closest); z <= last_slice; ++z) {
+			/* The light covers less of the nearer slices */
+			double z0 = std::max(closest,
+					CLUSTER_NEAR * exp(z * slice_scale));
+			double z1 = std::min(farthest,
+					CLUSTER_NEAR * exp((z + 1) * slice_scale));
+			int x0, x1, y0, y1;
+			if (!cluster_tiles(clip[0], reach[0], z0, z1,
+					   CLUSTERS_X, &x0, &x1) ||
+			    !cluster_tiles(clip[1], reach[1], z0, z1,
+					   CLUSTERS_Y, &y0, &y1)) {
+				continue;
+			}
+			for (int y = y0; y <= y1; ++y) {
+				for (int x = x0; x <= x1; ++x) {
+					int c = (z * CLUSTERS_Y + y) *
+						CLUSTERS_X + x;
+					cluster_lists[c].push_back(i);
+				}
+			}
+		}
+	}
+
+	static GLint max_size;
+	if (max_size == 0) {
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE_ARB, &max_size);
+	}
+	cluster_data.resize(NUM_CLUSTERS * 2);
+	for (int c = 0; c < NUM_CLUSTERS; ++c) {
+		/* The lights of the farthest clusters are dropped if the
+		 * texture would be too large */
+		size_t count = std::min(cluster_lists[c].size(),
+					max_size - cluster_data.size());
+		cluster_data[c * 2] = cluster_data.size();
+		cluster_data[c * 2 + 1] = count;
+		cluster_data.insert(cluster_data.end(),
+				    cluster_lists[c].begin(),
+				    cluster_lists[c].begin() + count);
+	}
+	if (cluster_lights.empty()) {
+		/* Never read, but the buffer can not be empty */
+		cluster_lights.push_back(ClusterLight());
+	}
+	upload_cluster_texture(0, GL_LUMINANCE32F_ARB, &cluster_data[0],
+			       sizeof(float) * cluster_data.size());
+	upload_cluster_texture(1, GL_RGBA32F_ARB, &cluster_lights[0],
+			       sizeof(ClusterLight) * cluster_lights.size());
+}
+
+void begin_queue(bool sort)
+{
+	assert(!queue_active);
+	queue_active = true;
+	queue_sorted = sort;
+	draw_queue.clear();
+	light_sets.clear();
+	draw_matrices.clear();
+}
+
+void flush_queue()
+{
+	assert(queue_active);
+	queue_active = false;
+	if (queue_sorted) {
+		/* Stable, so the groups which are drawn with the same state stay
+		 * in front-to-back order */
+		std::stable_sort(draw_queue.begin(), draw_queue.end(),
+				 packet_order);
+	}
 
-	sprintf(buf, "lights[%d].diffuse", n);
-	loc = current_program->uniform(buf);
-	glUniform4fv(loc, 1, &color.r);
+	/* The runs of the same group which are next to each other after
+	 * sorting become instances */
+	std::vector<size_t> runs;
+	instances.clear();
+	for (size_t i = 0; i < draw_queue.size(); i += runs.back()) {
+		size_t n = 1;
+		while (instancing && i + n < draw_queue.size() &&
+		       same_instance(draw_queue[i], draw_queue[i + n])) {
+			n++;
+		}
+		if (n < MIN_INSTANCES) {
+			n = 1;
+		}
+		runs.push_back(n);
+		/* Only instances are animated from a texture */
+		if (n == 1 && draw_queue[i].vat == 0) continue;
+		for (size_t j = i; j < i + n; ++j) {
+			Instance inst;
+			memcpy(inst.matrix, draw_matrices[draw_queue[j].matrix].m,
+			       sizeof inst.matrix);
+			inst.color = draw_queue[j].color;
+			inst.anim = draw_queue[j].phase;
+			instances.push_back(inst);
+		}
+	}
+	if (!instances.empty()) {
+		if (instance_buffer == 0) {
+			glGenBuffers(1, &instance_buffer);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * instances.size(),
+			     &instances[0], GL_STREAM_DRAW);
+	}
 
-	sprintf(buf, "lights[%d].brightness", n);
-	loc = current_program->uniform(buf);
-	glUniform1f(loc, brightness);
+	glPushMatrix();
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	DrawState state;
+	size_t first_instance = 0;
+	size_t i = 0;
+	for (size_t n : runs) {
+		if (n > 1 || draw_queue[i].vat != 0) {
+			submit(draw_queue[i], &state, n, first_instance);
+			first_instance += n;
+		} else {
+			submit(draw_queue[i], &state);
+		}
+		i += n;
+	}
+	finish_submit(state);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+	glPopMatrix();
+	current_program = NULL;
 }
 
 void load_mtl(Mesh *mesh, const char *fname)
 {
 	printf("Loading materials: %s\n", fname);
+	LoadTimer timer(fname, LOAD_DECODE);
 	PackFile f;
 	f.open(fname);
 
-	Material *material = NULL;
-	char line[256];
-	size_t avail = 0;
-	while (1) {
-		line[avail] = 0;
-		char *end = strchr(line, '\n');
-		if (end == NULL) {
-			avail += f.read(&line[avail], sizeof line - avail - 1);
-			line[avail] = 0;
-			end = strchr(line, '\n');
-		}
-		if (end != NULL) *end = 0;
-		char *p = line;
+	std::vector<uint8_t> buf;
+	const char *data = (const char *) file_contents(&f, &buf);
+	Scanner s(data, data + f.size());
 
-		if (match(p, "newmtl")) {
-			std::string name = token(p);
+	Material *material = NULL;
+	while (s.next_line()) {
+		if (s.match("newmtl")) {
+			std::string name = s.token();
 			auto iter = mesh->materials.find(name);
 			if (iter == mesh->materials.end()) {
 				material = new Material;
@@ -1232,134 +4210,139 @@ void load_mtl(Mesh *mesh, const char *fname)
 				material = iter->second;
 			}
 
-		} else if (match(p, "Kd")) {
-			assert(material != NULL);
-			Color color(1, 1, 1);
-			if (sscanf(p, "%f%f%f", &color.r, &color.g, &color.b) != 3) {
-				throw std::runtime_error("Invalid color");
+		} else if (s.match("Kd")) {
+			if (material == NULL) {
+				throw std::runtime_error("Color without a material");
 			}
+			Color color(1, 1, 1);
+			color.r = s.number();
+			color.g = s.number();
+			color.b = s.number();
 			if (material->texture == NULL) {
 				material->color = color;
 				material->light_color = color;
 			}
 
-		} else if (match(p, "map_Kd")) {
-			assert(material != NULL);
-			std::string fname = token(p);
+		} else if (s.match("map_Kd")) {
+			if (material == NULL) {
+				throw std::runtime_error("Texture without a material");
+			}
+			std::string fname = s.token();
 			material->texture = get_texture(fname.c_str());
 			material->color = Color(1, 1, 1);
 			material->light_color = material->texture->color();
 		}
-
-		if (end == NULL) break;
-		++end;
-		avail -= end - line;
-		memmove(line, end, avail);
 	}
 }
 
 void load_mesh(Mesh *mesh, const char *fname, double scale)
 {
 	printf("Loading %s\n", fname);
+	LoadTimer timer(fname, LOAD_DECODE);
 	PackFile f;
 	f.open(fname);
 
+	std::vector<uint8_t> buf;
+	const char *data = (const char *) file_contents(&f, &buf);
+	const char *end = data + f.size();
+
+	/* Count the elements first to avoid growing the arrays */
+	size_t num_vert = 0, num_norm = 0, num_tc = 0, num_faces = 0;
+	for (const char *p = data; p < end; ++p) {
+		if (end - p > 2 && p[1] == ' ') {
+			num_vert += p[0] == 'v';
+			num_faces += p[0] == 'f';
+		} else if (end - p > 3 && p[0] == 'v' && p[2] == ' ') {
+			num_norm += p[1] == 'n';
+			num_tc += p[1] == 't';
+		}
+		p = (const char *) memchr(p, '\n', end - p);
+		if (p == NULL) break;
+	}
+
 	mesh->faces.clear();
+	mesh->faces.reserve(num_faces);
 
 	Material *material = NULL;
 	std::vector<vec3> vert;
 	std::vector<vec3> norm;
 	std::vector<vec2> tc;
+	vert.reserve(num_vert);
+	norm.reserve(num_norm);
+	tc.reserve(num_tc);
 
-	char line[256];
-	size_t avail = 0;
-	while (1) {
-		line[avail] = 0;
-		char *end = strchr(line, '\n');
-		if (end == NULL) {
-			avail += f.read(&line[avail], sizeof line - avail - 1);
-			line[avail] = 0;
-			end = strchr(line, '\n');
-		}
-		if (end != NULL) *end = 0;
-		char *p = line;
-
-		if (match(p, "v")) {
+	Scanner s(data, end);
+	while (s.next_line()) {
+		if (s.match("v")) {
 			vec3 v;
-			if (sscanf(p, "%f%f%f", &v.x, &v.y, &v.z) != 3) {
-				throw std::runtime_error("invalid vertex");
-			}
+			v.x = s.number();
+			v.y = s.number();
+			v.z = s.number();
 			vert.push_back(v * scale);
 
-		} else if (match(p, "vn")) {
+		} else if (s.match("vn")) {
 			vec3 v;
-			if (sscanf(p, "%f%f%f", &v.x, &v.y, &v.z) != 3) {
-				throw std::runtime_error("invalid vertex");
-			}
+			v.x = s.number();
+			v.y = s.number();
+			v.z = s.number();
 			norm.push_back(v);
 
-		} else if (match(p, "vt")) {
+		} else if (s.match("vt")) {
 			vec2 v;
-			if (sscanf(p, "%f%f", &v.x, &v.y) != 2) {
-				throw std::runtime_error("invalid vertex");
-			}
-			v.y = 1 - v.y;
+			v.x = s.number();
+			v.y = 1 - s.number();
 			tc.push_back(v);
 
-		} else if (match(p, "mtllib")) {
-			std::string fname = token(p);
-			load_mtl(mesh, fname.c_str());
+		} else if (s.match("mtllib")) {
+			std::string fname = s.token();
+			/* Animation frames usually share the same library */
+			size_t payload = pack_payload(fname.c_str());
+			if (mesh->mtllibs.insert(payload).second) {
+				load_mtl(mesh, fname.c_str());
+			}
 			material = NULL;
 
-		} else if (match(p, "usemtl")) {
-			auto iter = mesh->materials.find(token(p));
+		} else if (s.match("usemtl")) {
+			auto iter = mesh->materials.find(s.token());
 			if (iter == mesh->materials.end()) {
 				throw std::runtime_error("Undefined material");
 			}
 			material = iter->second;
 
-		} else if (match(p, "f")) {
-			assert(material != NULL);
+		} else if (s.match("f")) {
+			if (material == NULL) {
+				throw std::runtime_error("Face without a material");
+			}
 			Face f;
 			f.mat = material;
 			for (int i = 0; i < 3; ++i) {
-				size_t idx = strtoul(p, &p, 10);
+				size_t idx = s.index();
 				if (idx <= 0 || idx > vert.size()) {
-					throw std::runtime_error(std::string("Invalid vertex: ") +
-								 line);
+					throw std::runtime_error("Invalid vertex");
 				}
 				f.vert[i].vert = vert[idx - 1];
-				if (*p == '/') {
-					++p;
-					if (*p != '/') {
-						idx = strtoul(p, &p, 10);
-						assert(idx > 0 &&
-							idx <= tc.size());
-						f.vert[i].tc = tc[idx - 1];
-					} else {
-						f.vert[i].tc = vec2(0, 0);
+				f.vert[i].tc = vec2(0, 0);
+				f.vert[i].norm = vec3(0, 0, 0);
+				if (!s.skip('/')) continue;
+				if (!s.skip('/')) {
+					idx = s.index();
+					if (idx <= 0 || idx > tc.size()) {
+						throw std::runtime_error("Invalid texture coordinate");
 					}
+					f.vert[i].tc = tc[idx - 1];
+					if (!s.skip('/')) continue;
 				}
-				if (*p == '/') {
-					++p;
-					idx = strtoul(p, &p, 10);
-					assert(idx > 0 && idx <= norm.size());
-					f.vert[i].norm = norm[idx - 1];
-				} else {
-					f.vert[i].norm = vec3(0, 0, 0);
+				idx = s.index();
+				if (idx <= 0 || idx > norm.size()) {
+					throw std::runtime_error("Invalid normal");
 				}
+				f.vert[i].norm = norm[idx - 1];
 			}
-			while (isspace(*p)) ++p;
-			if (*p != 0) {
+			if (!s.at_end()) {
 				throw std::runtime_error("Triangles expected");
 			}
 			mesh->faces.push_back(f);
 		}
-
-		if (end == NULL) break;
-		++end;
-		avail -= end - line;
-		memmove(line, end, avail);
 	}
 }
 
@@ -1387,29 +4370,192 @@ void mult_matrix_reverse(const Matrix &m)
 
 const Texture *get_texture(const char *fname)
 {
-	auto iter = texture_cache.find(fname);
-	if (iter == texture_cache.end()) {
-		throw std::runtime_error(std::string("Texture not found: ") +
-					 fname);
-	}
-	return iter->second;
+	return lazy_texture(fname, true, false);
+}
+
+void declare_texture(const char *fname, bool mipmap, bool alpha)
+{
+	lazy_texture(fname, mipmap, alpha);
 }
 
 void load_texture(const char *fname, bool mipmap, bool alpha)
 {
+	TextureLock lock;
+	auto cached = texture_cache.find(fname);
+	if (cached != texture_cache.end() && cached->second->atlas() != NULL) {
+		return;
+	}
+	std::pair<size_t, int> key(pack_payload(fname), mipmap * 2 + alpha);
+	auto iter = texture_payloads.find(key);
+	if (iter != texture_payloads.end()) {
+		texture_cache[fname] = iter->second;
+		return;
+	}
 	Texture *texture = new Texture;
 	texture->load(fname, mipmap, alpha);
 	texture_cache[fname] = texture;
+	texture_payloads[key] = texture;
+}
+
+void queue_texture(const char *fname, bool mipmap, bool alpha)
+{
+	lazy_texture(fname, mipmap, alpha)->request();
+}
+
+/* The index lists the rectangles, see compile-texture.py */
+void declare_atlas(const char *fname)
+{
+	std::string index = fname;
+	size_t dot = index.rfind('.');
+	if (dot != std::string::npos) {
+		index.resize(dot);
+	}
+	index += ".txt";
+	if (!pack_contains(fname) || !pack_contains(index.c_str())) {
+		return;
+	}
+
+	printf("Loading %s\n", index.c_str());
+	PackFile f;
+	f.open(index.c_str());
+	std::vector<uint8_t> buf;
+	const char *data = (const char *) file_contents(&f, &buf);
+	Scanner s(data, data + f.size());
+
+	/* The rectangles are set up before the atlas is loaded */
+	s.next_line();
+	int width = s.index();
+	int height = s.index();
+	if (width <= 0 || height <= 0) {
+		throw std::runtime_error(std::string("Invalid atlas: ") +
+					 index);
+	}
+	TextureLock lock;
+	Texture *atlas = new Texture;
+	atlas->load_later(fname, true, false, width, height, Color(0, 0, 0));
+	lazy_textures.push_back(atlas);
+	while (s.next_line()) {
+		std::string name = s.token();
+		if (name.empty()) continue;
+		int x = s.index();
+		int y = s.index();
+		int w = s.index();
+		int h = s.index();
+		Color color(0, 0, 0);
+		color.r = s.number();
+		color.g = s.number();
+		color.b = s.number();
+		if (x + w > width || y + h > height) {
+			throw std::runtime_error(std::string("Invalid atlas: ") +
+						 index);
+		}
+
+		Texture *texture = new Texture;
+		texture->load(atlas, width, height, x, y, w, h, color);
+		texture_cache[name] = texture;
+		atlas_names[texture] = name;
+	}
 }
 
+void evict_textures()
+{
+	current_frame++;
+	if (texture_budget <= 0) return;
+
+	TextureLock lock;
+	size_t total = 0;
+	std::vector<Texture *> unused;
+	for (Texture *texture : lazy_textures) {
+		total += texture->memory();
+		/* Not drawn in the last frame */
+		if (texture->memory() > 0 &&
+		    texture->last_used() + 1 < current_frame) {
+			unused.push_back(texture);
+		}
+	}
+	size_t budget = (size_t) texture_budget << 20;
+	if (total <= budget) return;
+
+	std::sort(unused.begin(), unused.end(),
+		  [](const Texture *a, const Texture *b) {
+			return a->last_used() < b->last_used();
+		  });
+	for (Texture *texture : unused) {
+		if (total <= budget) break;
+		total -= texture->memory();
+		texture->evict();
+	}
+}
+
+std::string compiled_texture(const char *fname)
+{
+	std::string name = fname;
+	size_t dot = name.rfind('.');
+	if (dot != std::string::npos) {
+		name.resize(dot);
+	}
+	return name + ".ktex";
+}
+
+std::string compiled_mesh(const char *fname)
+{
+	std::string name = fname;
+	size_t len = name.size();
+	if (len > 4 && name.compare(len - 4, 4, ".obj") == 0) {
+		name.resize(len - 4);
+	}
+	return name + ".kmesh";
+}
+
+/* The callers use the materials and the bounds right away, so the first
+ * request waits until the model is loaded */
 const Model *get_model(const char *fname)
 {
 	auto iter = model_cache.find(fname);
 	if (iter == model_cache.end()) {
+		prefetch_model(fname);
+		iter = model_cache.find(fname);
+	}
+	Model *model = iter->second;
+	auto job = model_jobs.find(fname);
+	if (job != model_jobs.end()) {
+		/* Not behind the models which are only prefetched */
+		if (!model->loaded()) {
+			hurry_job(job->second);
+		}
+		model_jobs.erase(job);
+	}
+	while (!model->loaded()) {
+		if (pending_jobs() == 0) {
+			throw std::runtime_error(std::string("Model not loaded: ") +
+						 fname);
+		}
+		finish_jobs(10);
+	}
+	return model;
+}
+
+void declare_model(const char *fname, double scale, int first_frame,
+		   int num_frames, bool noise)
+{
+	ModelParams &params = model_params[fname];
+	params.scale = scale;
+	params.first_frame = first_frame;
+	params.num_frames = num_frames;
+	params.noise = noise;
+}
+
+void prefetch_model(const char *fname)
+{
+	if (model_cache.find(fname) != model_cache.end()) return;
+	auto iter = model_params.find(fname);
+	if (iter == model_params.end()) {
 		throw std::runtime_error(std::string("model not found: ") +
 					 fname);
 	}
-	return iter->second;
+	const ModelParams &params = iter->second;
+	queue_model(fname, params.scale, params.first_frame, params.num_frames,
+		    params.noise);
 }
 
 void load_model(const char *fname, double scale, int first_frame,
@@ -1417,5 +4563,20 @@ void load_model(const char *fname, double scale, int first_frame,
 {
 	Model *model = new Model;
 	model->load(fname, scale, first_frame, num_frames, noise);
+	LoadTimer timer(fname, LOAD_UPLOAD);
+	size_t memory = gfx_memory;
+	model->upload();
+	timer.count(gfx_memory - memory);
+	model_cache[fname] = model;
+}
+
+void queue_model(const char *fname, double scale, int first_frame,
+		 int num_frames, bool noise)
+{
+	Model *model = new Model;
 	model_cache[fname] = model;
+	Job *job = new ModelJob(model, fname, scale, first_frame, num_frames,
+				noise);
+	model_jobs[fname] = job;
+	start_job(job);
 }
@@ -31,6 +31,8 @@ enum {
 	RENDER_GLASS = 2,
 	RENDER_SHADOW_VOL = 4,
 	RENDER_LIGHTS_ON = 8,
+	RENDER_CLUSTERED = 16, /* all lights from upload_clusters() */
+	RENDER_DEFERRED = 32, /* to the G-buffer, see begin_gbuffer() */
 };
 
 class Color {
@@ -54,19 +56,43 @@ static inline Color operator * (const Color &c, double s)
 
 const GLuint INVALID_TEXTURE = -1;
 
+class Job;
+
 class Texture {
 public:
-	GLuint id() { return m_id; }
+	GLuint id() { return m_atlas != NULL ? m_atlas->m_id : m_id; }
 	Color color() const { return m_color; }
 	int width() const { return m_width; }
 	int height() const { return m_height; }
-	bool loaded() const { return m_id != INVALID_TEXTURE; }
+	bool loaded() const
+	{
+		return m_atlas != NULL ? m_atlas->loaded() :
+			m_id != INVALID_TEXTURE;
+	}
+	/* Rectangle in an atlas, or NULL for a whole texture */
+	const Texture *atlas() const { return m_atlas; }
+	vec2 tc_offset() const { return m_tc_offset; }
+	vec2 tc_scale() const { return m_tc_scale; }
 
 	Texture();
 	void load(const char *fname, bool mipmap = false, bool alpha = false);
+	void load_later(const char *fname, bool mipmap, bool alpha, int width,
+			int height, const Color &color);
 	void load(int width, int height, GLuint type, const uint8_t *data,
 		  bool mipmap = false);
+	void load(int width, int height, GLuint type,
+		  const std::vector<const uint8_t *> &levels,
+		  const Color &color);
+	void load(const Texture *atlas, int atlas_width, int atlas_height,
+		  int x, int y, int width, int height, const Color &color);
+	bool covers(const vec2 &tc_min, const vec2 &tc_max) const;
+	/* Urgent when the placeholder is drawn instead */
+	void request(bool urgent = false) const;
+	void evict();
+	unsigned last_used() const { return m_used; }
+	size_t memory() const { return m_memory; }
 	void bind() const;
+	void tex_coord(double u, double v) const;
 	void draw() const;
 
 private:
@@ -74,6 +100,19 @@ private:
 	Color m_color;
 	int m_width;
 	int m_height;
+	const Texture *m_atlas;
+	vec2 m_tc_offset;
+	vec2 m_tc_scale;
+	size_t m_memory;
+
+	/* Loaded in the background when it is first bound, see
+	 * load_later() */
+	std::string m_fname;
+	bool m_mipmap;
+	bool m_alpha;
+	mutable bool m_requested;
+	mutable const Job *m_job; /* while it is being loaded */
+	mutable unsigned m_used; /* frame when last bound */
 
 	DISALLOW_COPY_AND_ASSIGN(Texture);
 };
@@ -100,8 +139,9 @@ struct Face {
 	Material *mat;
 };
 struct Mesh {
-	std::list<Face> faces;
+	std::vector<Face> faces;
 	std::unordered_map<std::string, Material *> materials;
+	std::set<size_t> mtllibs; /* payloads of the loaded libraries */
 };
 
 /* RAII approach to OpenGL state machine - Use this to enable OpenGL states
@@ -133,27 +173,52 @@ private:
 	int m_num_states;
 };
 
+/* Compact vertices are decoded in the shaders with these */
+struct Quantization {
+	vec3 pos_scale;
+	vec3 pos_offset;
+	vec2 tc_scale;
+	vec2 tc_offset;
+	float norm_scale; /* of the next keyframe */
+};
+
 class Model {
-	struct GLAnimVertex {
-		vec3 a_vert;
-		vec3 a_norm;
-		vec3 b_vert; /* MultiTexCoord1 */
-		vec3 b_norm; /* MultiTexCoord2 */
-		vec2 tc;
+	/* The keyframes share the indices, and each keyframe has its own
+	 * vertex buffer. The next keyframe is bound as MultiTexCoord1 and
+	 * MultiTexCoord2 for blending. The simplified levels of detail use
+	 * the same vertices with fewer faces.
+	 */
+	struct Lod {
+		GLuint index_buffer;
+		size_t num_indices;
 	};
 	struct Group {
 		const Material *mat;
-		GLuint buffer;
-		size_t count;
+		std::vector<GLuint> buffers; /* for each keyframe */
+		GLuint index_buffer;
+		GLenum index_type;
+		size_t count; /* vertices */
+		size_t num_indices;
 		vec3 midpos;
+		Quantization quant;
+		std::vector<Lod> lods; /* coarser and coarser */
+		vec2 tc_min, tc_max;
+		/* Replaces an atlas texture which can not be used, see
+		 * upload() */
+		const Texture *texture;
+		/* The keyframes as a float texture for drawing animated
+		 * instances, or 0 */
+		GLuint vat;
 	};
 	struct Frame {
-		std::list<Group> groups;
 		GLuint shadow_buffer;
 		size_t shadow_count;
-		std::list<CollFace> faces;
-		std::list<CollFace> coll_faces;
+		std::vector<CollFace> faces;
+		std::vector<CollFace> coll_faces;
 	};
+	/* Three vertices for each face */
+	typedef std::unordered_map<const Material *, std::vector<Vertex>>
+		FrameVertices;
 
 public:
 	struct Light {
@@ -161,67 +226,151 @@ public:
 		const Material *mat;
 	};
 
-	bool loaded() const { return !m_frames.empty(); }
+	/* The loader thread fills the frames before the buffers are
+	 * uploaded, so the model is only ready after upload() */
+	bool loaded() const { return m_uploaded; }
 	double rad() const { return m_radius; }
 	vec3 midpos() const { return m_midpos; }
+	size_t num_lods() const { return m_num_lods; }
 	std::unordered_map<std::string, Material *> materials() const { return m_materials; }
 
 	Model();
 	void load(const char *fname, double scale = 1, int first_frame = 1,
 		  int num_frames = 1, bool noise = false);
-	void load_frame(Frame *frame, const Mesh *mesh, const Mesh *next);
-	void load(const Mesh *mesh, const std::list<Face> &faces,
+	void load_frame(Frame *frame, const Mesh *mesh,
+			std::vector<bool> *drawn, FrameVertices *vertices,
+			std::vector<Vertex> *shadow);
+	void load(const Mesh *mesh, const std::vector<Face> &faces,
 		  bool noise = false);
+	/* Loading does not use OpenGL, this creates the buffers */
+	void upload();
+	bool load_compiled(const char *fname, double scale, int num_frames,
+			   bool noise);
 	Material *get_material(const char *name) const;
 	bool raytrace(const vec3 &pos, const vec3 &ray, double anim,
 		      double *dist, const CollFace **face = NULL) const;
 	std::list<const CollFace *> find_collisions(const vec3 &pos, double rad,
 						    double anim = 0);
 	void render(int flags = 0, double anim = 0,
-		    const Color &ambient = Color(0, 0, 0)) const;
+		    const Color &ambient = Color(0, 0, 0), size_t lod = 0) const;
 	std::list<Light> get_lights() const;
 
 private:
 	std::unordered_map<std::string, Material *> m_materials;
 	std::vector<Frame> m_frames;
+	std::list<Group> m_groups;
 	std::list<Light> m_lights;
 	double m_radius;
 	vec3 m_midpos;
+	bool m_compact; /* see compact_vertices */
+	Quantization m_shadow_quant;
+	bool m_build_lods; /* for the models loaded from files */
+	size_t m_num_lods;
+	bool m_uploaded;
+
+	struct Upload {
+		GLenum target;
+		GLuint *buffer;
+		const void *data;
+		size_t size;
+		size_t width; /* of a texture */
+		std::vector<uint8_t> copy;
+	};
+	std::list<Upload> m_uploads;
+	size_t m_memory_saved; /* by indexing, added to gfx_memory_saved */
+
+	void queue_upload(GLenum target, GLuint *buffer, const void *data,
+			  size_t size, bool mapped = false);
+	void queue_vat(GLuint *vat, const std::vector<const Vertex *> &keyframes,
+		       size_t count);
+	void index_group(Group *group,
+			 const std::vector<std::vector<Vertex>> &keyframes);
+	void count_savings(const Group *group);
+	void build_lods(Group *group, const Vertex *vertices,
+			const std::vector<uint32_t> &indices);
+	void queue_keyframes(const std::vector<GLuint *> &buffers,
+			     const std::vector<const Vertex *> &keyframes,
+			     size_t count, double scale, bool noise,
+			     bool mapped, Quantization *quant,
+			     GLuint *vat = NULL);
+	size_t vertex_size() const;
+
+	static const Vertex *scale_vertices(const Vertex *v, size_t count,
+					    double scale, bool noise,
+					    std::vector<Vertex> *buf);
 
 	DISALLOW_COPY_AND_ASSIGN(Model);
 };
 
 class FBO {
 public:
+	static const int MAX_TEXTURES = 4;
+
 	GLuint fbo() { return m_fbo; }
-	GLuint texture() { return m_texture; }
+	GLuint texture(int i = 0) { return m_textures[i]; }
 
 	FBO();
 	void init(int width, int height, bool bilinear, bool depth = false,
 		  bool stencil = false);
+	/* Several textures in the given formats, which are drawn at once.
+	 * The fragment shaders write gl_FragData[i] to the texture i. */
+	void init(int width, int height, const GLenum *formats, int count,
+		  bool depth = false);
 	void begin_drawing() const;
-	void bind_texture() const;
+	void bind_texture(int i = 0) const;
 
 private:
 	GLuint m_fbo;
-	GLuint m_texture;
+	GLuint m_textures[MAX_TEXTURES];
+	int m_num_textures;
 	GLuint m_depthbuf;
 
+	void init_textures(int width, int height, const GLenum *formats,
+			   int count, GLenum filter, bool depth);
+
 	DISALLOW_COPY_AND_ASSIGN(FBO);
 };
 
+/* The uniforms of the shaders, looked up when a program is loaded */
+enum Uniform {
+	UNIFORM_X,
+	UNIFORM_POS_SCALE,
+	UNIFORM_POS_OFFSET,
+	UNIFORM_TC_SCALE,
+	UNIFORM_TC_OFFSET,
+	UNIFORM_NORM_SCALE,
+	UNIFORM_LIGHT,
+	UNIFORM_LIGHT_POS,
+	UNIFORM_LIGHT_DIFFUSE,
+	UNIFORM_LIGHT_BRIGHTNESS,
+	UNIFORM_VAT,
+	UNIFORM_VAT_SIZE,
+	UNIFORM_CLUSTERS,
+	UNIFORM_CLUSTER_LIGHTS,
+	UNIFORM_CLUSTER_SCALE,
+	UNIFORM_CLUSTER_DEPTH,
+	UNIFORM_GBUFFER,
+	UNIFORM_VIEWPORT,
+	UNIFORM_UNPROJECT,
+	UNIFORM_UNPROJECT_OFFSET,
+	UNIFORM_DEPTH_ROW,
+	NUM_UNIFORMS
+};
+
 class Program {
 public:
 	bool loaded() const { return m_id != 0; }
+	GLint uniform(Uniform u) const { return m_uniforms[u]; }
 
 	Program();
 	void load(const char *vs_source, const char *fs_source);
 	void use() const;
-	GLint uniform(const char *name);
 
 private:
 	GLuint m_id;
-	std::unordered_map<std::string, GLint> m_lookup;
+	GLint m_uniforms[NUM_UNIFORMS];
+
+	void find_uniforms();
 };
 
 class Font {
@@ -241,21 +390,63 @@ private:
 };
 
 extern size_t faces_drawn;
+extern size_t draw_calls;
+extern size_t state_changes;
+extern size_t leaves_culled; /* by the world */
+extern size_t texture_binds;
 extern size_t gfx_memory;
+extern size_t gfx_memory_saved;
 
 GLuint load_png(const char *fname);
 void check_gl_errors();
+/* Writes the program binaries if programs were linked since the last call.
+ * The variants are linked when first drawn, so this is not done after each
+ * link but between loading and the game and at exit. */
+void save_program_cache();
 void set_light(int n, const vec3 &pos, const Color &c, double brightness = 1);
+void load_mtl(Mesh *mesh, const char *fname);
 void load_mesh(Mesh *mesh, const char *fname, double scale = 1);
+/* Name of the compiled mesh for an OBJ file or an animation */
+std::string compiled_mesh(const char *fname);
+std::string compiled_texture(const char *fname);
 void open_pack(const char *fname);
 void begin_rendering(size_t numlights, int flags, const vec3 &light = vec3(0, 0, 0));
 void end_rendering();
+/* Clustered lighting: the view of the current projection matrix is split to
+ * clusters, and each of them lists the lights added since begin_clusters()
+ * which reach it. Rendering with RENDER_CLUSTERED lights each pixel with the
+ * lights of its cluster instead of the ones given to set_light(). */
+void begin_clusters();
+void add_cluster_light(const vec3 &pos, const Color &c, double brightness);
+void upload_clusters();
+/* Collects the models rendered until flush_queue() and draws them sorted by
+ * their state, or in the order they were rendered if sort is false */
+void begin_queue(bool sort);
+void flush_queue();
 void mult_matrix(const Matrix &m);
 void mult_matrix_reverse(const Matrix &m);
+/* The texture is loaded in the background when it is first drawn, and a
+ * placeholder is drawn until then. Undeclared textures are mipmapped. */
 const Texture *get_texture(const char *fname);
+void declare_texture(const char *fname, bool mipmap, bool alpha);
 void load_texture(const char *fname, bool mipmap, bool alpha);
+/* Decodes the texture in a loader thread, see start_job() */
+void queue_texture(const char *fname, bool mipmap, bool alpha);
+/* The textures in the atlas are not loaded separately. Nothing happens if
+ * the pack has no atlas. */
+void declare_atlas(const char *fname);
+/* Frees the least recently drawn textures over texture_budget. Called once
+ * a frame. */
+void evict_textures();
+/* Waits for the model if it has not been loaded yet */
 const Model *get_model(const char *fname);
+/* How get_model() and prefetch_model() load the model */
+void declare_model(const char *fname, double scale, int first_frame,
+		   int num_frames, bool noise);
+void prefetch_model(const char *fname);
 void load_model(const char *fname, double scale, int first_frame,
 		int num_frames, bool noise);
+void queue_model(const char *fname, double scale, int first_frame,
+		 int num_frames, bool noise);
 
 #endif
@@ -18,6 +18,7 @@
 #include "sfx.h"
 #include "game.h"
 #include "system.h"
+#include "bench.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -251,6 +252,20 @@ struct ModelInfo models[] = {
 	{"kiuas.obj", 1, 1, 1, false},
 };
 
+/* Only needed in the sauna and the minigames, loaded when first used */
+const char *on_demand_models[] = {
+	"burger1.obj", "burger2.obj", "burger3.obj", "burger4.obj",
+	"tray.obj", "cup.obj", "fries.obj", "friespile.obj", "tap.obj",
+	"fishpizza.obj", "shroompizza.obj", "spidereyepizza.obj",
+	"pepperonipizza.obj", "slice.obj", "coffee.obj", "kahvi.obj",
+	"tux", "kauha.obj", "kiulu.obj", "kiuas.obj",
+};
+
+/* The menu scene */
+const char *menu_models[] = {
+	"logo.obj", "snake.obj", "snake2.obj",
+};
+
 double menu_time;
 int active_item;
 double slide[MENU_ITEMS];
@@ -325,7 +340,7 @@ void render_menu_scene(bool light)
 	end_rendering();
 }
 
-bool preload_step(int n)
+bool preload_step(size_t done, size_t total)
 {
 	static Uint32 last_tics = 0;
 
@@ -357,9 +372,7 @@ bool preload_step(int n)
 	glLoadIdentity();
 
 	char buf[64];
-	sprintf(buf, "Loading: %d %%", n * 100 / (int) (
-			lengthof(textures) + lengthof(sounds) +
-			lengthof(models)));
+	sprintf(buf, "Loading: %d %%", (int) (done * 100 / total));
 	glColor3f(1, 1, 1);
 	glTranslatef(scr_width/2 - small_font.text_width(buf)/2,
 	     scr_height/2, 0);
@@ -369,37 +382,69 @@ bool preload_step(int n)
 	return true;
 }
 
-bool preload()
+/* Uploads the finished jobs until all of them are done. The jobs can
+   start more jobs. */
+bool preload_wait()
 {
-	int n = 0;
-	for (size_t i = 0; i < lengthof(textures); ++i) {
-		if (!preload_step(n)) {
+	size_t total = pending_jobs();
+	while (pending_jobs() > 0) {
+		total = std::max(total, pending_jobs());
+		if (!preload_step(total - pending_jobs(), total)) {
 			return false;
 		}
-		load_texture(textures[i].fname, textures[i].mipmap, false);
-		n++;
+		finish_jobs(10);
 	}
-	for (size_t i = 0; i < lengthof(sounds); ++i) {
-		if (!preload_step(n)) {
-			return false;
-		}
-		load_sound(sounds[i]);
-		n++;
+	return true;
+}
+
+/* Only the menu is loaded before it is shown. The rest is loaded in the
+   background or when it is first used. */
+bool preload()
+{
+	declare_atlas("atlas.ktex");
+	for (size_t i = 0; i < lengthof(textures); ++i) {
+		declare_texture(textures[i].fname, textures[i].mipmap, false);
 	}
+	declare_texture("smoke.png", true, true);
 	for (size_t i = 0; i < lengthof(models); ++i) {
-		if (!preload_step(n)) {
-			return false;
-		}
-		load_model(models[i].fname, models[i].scale,
-			   models[i].first_frame, models[i].num_frames,
-			   models[i].noise);
-		n++;
+		declare_model(models[i].fname, models[i].scale,
+			      models[i].first_frame, models[i].num_frames,
+			      models[i].noise);
+	}
+
+	for (size_t i = 0; i < lengthof(menu_models); ++i) {
+		prefetch_model(menu_models[i]);
+	}
+	if (!preload_wait()) {
+		return false;
 	}
 
-	load_texture("smoke.png", true, true);
+	/* Finished between the frames of the menu */
+	for (size_t i = 0; i < lengthof(models); ++i) {
+		bool on_demand = false;
+		for (size_t j = 0; j < lengthof(on_demand_models); ++j) {
+			if (strcmp(models[i].fname, on_demand_models[j]) == 0) {
+				on_demand = true;
+			}
+		}
+		if (!on_demand) {
+			prefetch_model(models[i].fname);
+		}
+	}
+	for (size_t i = 0; i < lengthof(sounds); ++i) {
+		get_sound(sounds[i]);
+	}
 	return true;
 }
 
+/* The game needs the models which are still being prefetched */
+bool finish_loading()
+{
+	bool ok = preload_wait();
+	save_program_cache();
+	return ok;
+}
+
 bool menu()
 {
 	Music music;
@@ -448,7 +493,8 @@ bool menu()
 				} else if (state == SHOW_SETTINGS) {
 					switch (active_item) {
 					case QUALITY:
-						quality = (quality + 1) % 3;
+						quality = (quality + 1) %
+							(max_quality + 1);
 						break;
 
 					case ANTIALIASING:
@@ -661,11 +707,31 @@ try {
 	SDL_WM_SetCaption(buf, buf);
 
 	bool windowed = false;
-	if (argc > 1 && std::string(argv[1]) == "-window") {
+	bool bench = false;
+	bool pvs = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-window") {
 #ifndef _WIN32
-		feenableexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW);
+			feenableexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW);
 #endif
-		windowed = true;
+			windowed = true;
+
+		} else if (arg == "-trace" && i + 1 < argc) {
+			/* Record pack accesses for create-pack.py --order */
+			trace_pack(argv[++i]);
+
+		} else if (arg == "-bench-mesh") {
+			bench = true;
+
+		} else if (arg == "-build-pvs") {
+			/* Writes LEVEL.pvs files to be packed */
+			pvs = true;
+
+		} else if (arg == "-profile" && i + 1 < argc) {
+			/* Load times of each asset as JSON */
+			profile_loading(argv[++i]);
+		}
 	}
 	load_settings();
 	init_system(windowed);
@@ -684,7 +750,48 @@ try {
 			quality = 2;
 		}
 	}
+	if (!GLEW_VERSION_3_0 ||
+	    (!GLEW_VERSION_3_2 && !GLEW_ARB_depth_clamp)) {
+		max_quality = 2;
+	}
+	if (quality > max_quality) {
+		printf("Deferred shading needs OpenGL 3.0 and depth clamping\n");
+		quality = max_quality;
+	}
 	printf("Quality level: %d\n", quality);
+	if (compact_vertices && !GLEW_VERSION_3_3) {
+		printf("Compact vertices need OpenGL 3.3\n");
+		compact_vertices = false;
+	}
+	if (compress_textures && !GLEW_EXT_texture_compression_s3tc) {
+		printf("Texture compression needs S3TC\n");
+		compress_textures = false;
+	}
+	if (instancing && (!GLEW_ARB_draw_instanced ||
+			   !GLEW_ARB_instanced_arrays)) {
+		printf("Instancing needs instanced arrays\n");
+		instancing = false;
+	}
+	if (animation_textures && (!instancing || !GLEW_ARB_texture_float)) {
+		printf("Animation textures need instancing and float textures\n");
+		animation_textures = false;
+	}
+	GLint vertex_textures = 0;
+	glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &vertex_textures);
+	if (animation_textures && vertex_textures == 0) {
+		printf("Animation textures need textures in vertex shaders\n");
+		animation_textures = false;
+	}
+	if (occlusion_culling && !GLEW_ARB_occlusion_query) {
+		printf("Occlusion culling needs occlusion queries\n");
+		occlusion_culling = false;
+	}
+	if (clustered_lighting &&
+	    (!GLEW_ARB_texture_buffer_object || !GLEW_EXT_gpu_shader4 ||
+	     !GLEW_ARB_texture_float)) {
+		printf("Clustered lighting needs buffer textures\n");
+		clustered_lighting = false;
+	}
 
 	init_sound();
 
@@ -692,10 +799,24 @@ try {
 	check_gl_errors();
 
 	if (preload()) {
-		while (menu()) {
-			game();
+		if (bench) {
+			if (finish_loading()) {
+				bench_meshes();
+			}
+		} else if (pvs) {
+			if (finish_loading()) {
+				build_pvs();
+			}
+		} else {
+			while (menu()) {
+				if (finish_loading()) {
+					game();
+				}
+			}
 		}
 	}
+	save_program_cache();
+	write_load_profile();
 	SDL_Quit();
 	return 0;
 
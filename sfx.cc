@@ -36,6 +36,31 @@ const size_t MAX_DELAY = 50;
 std::list<Playing> playing;
 std::list<Music *> music;
 std::unordered_map<std::string, Sound *> sound_cache;
+std::unordered_map<size_t, Sound *> sound_payloads;
+
+class SoundJob : public Job {
+public:
+	SoundJob(Sound *sound, const char *fname) :
+		m_sound(sound),
+		m_fname(fname)
+	{
+	}
+
+	void run()
+	{
+		m_decoded.load(m_fname.c_str());
+	}
+
+	void finish()
+	{
+		m_sound->swap(&m_decoded);
+	}
+
+private:
+	Sound *m_sound;
+	std::string m_fname;
+	Sound m_decoded;
+};
 
 /* Note, this is called from a background thread with the audio lock held. */
 void fill_audio(void *userdata, Uint8 *bytebuf, int len)
@@ -236,6 +261,9 @@ void Music::mix(Sample *buf, size_t len)
 
 void play_sound(const Sound *sound, double volume, double pan)
 {
+	/* Still being decoded */
+	if (!sound->loaded()) return;
+
 	Playing p;
 	p.sound = sound;
 	p.pos = 0;
@@ -249,6 +277,7 @@ void play_sound(const Sound *sound, double volume, double pan)
 void Sound::load(const char *fname)
 {
 	printf("Loading %s\n", fname);
+	LoadTimer timer(fname, LOAD_DECODE);
 	PackFile f;
 	f.open(fname);
 	OggVorbis_File vf;
@@ -286,6 +315,13 @@ void Sound::load(const char *fname)
 	ov_clear(&vf);
 }
 
+void Sound::swap(Sound *other)
+{
+	SDL_LockAudio();
+	m_data.swap(other->m_data);
+	SDL_UnlockAudio();
+}
+
 size_t Sound::mix(size_t pos, Sample *buf, size_t len, double volume,
 		  double pan) const
 {
@@ -348,19 +384,43 @@ void init_sound()
 	SDL_PauseAudio(0);
 }
 
+/* Silent until the sound has been decoded in the background */
 const Sound *get_sound(const char *fname)
 {
 	auto iter = sound_cache.find(fname);
-	if (iter == sound_cache.end()) {
+	if (iter != sound_cache.end()) {
+		return iter->second;
+	}
+	if (!pack_contains(fname)) {
 		throw std::runtime_error(std::string("Sound not found: ") +
 					 fname);
 	}
-	return iter->second;
+	queue_sound(fname);
+	return sound_cache[fname];
 }
 
 void load_sound(const char *fname)
 {
+	auto iter = sound_payloads.find(pack_payload(fname));
+	if (iter != sound_payloads.end()) {
+		sound_cache[fname] = iter->second;
+		return;
+	}
 	Sound *sound = new Sound;
 	sound->load(fname);
 	sound_cache[fname] = sound;
+	sound_payloads[pack_payload(fname)] = sound;
+}
+
+void queue_sound(const char *fname)
+{
+	auto iter = sound_payloads.find(pack_payload(fname));
+	if (iter != sound_payloads.end()) {
+		sound_cache[fname] = iter->second;
+		return;
+	}
+	Sound *sound = new Sound;
+	sound_cache[fname] = sound;
+	sound_payloads[pack_payload(fname)] = sound;
+	start_job(new SoundJob(sound, fname));
 }
@@ -58,6 +58,8 @@ public:
 	double length() const { return (double) m_data.size() / SAMPLERATE; }
 
 	void load(const char *fname);
+	/* Exchanges the samples, the sounds may be playing */
+	void swap(Sound *other);
 
 	size_t mix(size_t pos, Sample *buf, size_t len, double volume,
 		   double pan) const;
@@ -72,5 +74,7 @@ void kill_sounds();
 void init_sound();
 const Sound *get_sound(const char *fname);
 void load_sound(const char *fname);
+/* Decodes the sound in a loader thread, see start_job() */
+void queue_sound(const char *fname);
 
 #endif
@@ -15,11 +15,38 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdexcept>
+#include <vector>
+#include <list>
 #include <map>
+#include <algorithm>
+#include <zlib.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 int scr_width, scr_height;
 int quality = -1;
+/* The deferred shading of quality 3 needs OpenGL 3.0 */
+int max_quality = 3;
 bool antialiasing;
+/* Quantized vertices take half the memory, needs OpenGL 3.3 */
+bool compact_vertices;
+/* The driver compresses mipmapped textures, needs S3TC */
+bool compress_textures;
+/* Repeated models are drawn with one call, needs instanced arrays */
+bool instancing = true;
+/* Animated models too, needs float textures */
+bool animation_textures = true;
+/* Skips the hidden parts of the level, needs occlusion queries */
+bool occlusion_culling = true;
+/* Per-pixel lighting with all the lights, needs buffer textures */
+bool clustered_lighting = true;
+/* Megabytes of streamed textures to keep when they are not drawn */
+int texture_budget = 256;
 bool invert_mouse;
 Font small_font;
 Font large_font;
@@ -28,17 +55,249 @@ Font todo_font;
 
 namespace {
 
+const uint32_t PACK_VERSION = 2;
+const uint32_t PACK_DEFLATE = 1;
+const int LOADER_THREADS = 4;
+
+/* On-disk format, see create-pack.py */
+struct PackHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
 struct PackEntry {
-	size_t offset;
-	size_t size;
+	char name[48];
+	uint32_t offset;
+	uint32_t size;
+	uint32_t packed_size;
+	uint32_t flags;
 };
 
-std::unordered_map<std::string, PackEntry> pack_directory;
+/* Sorted by name */
+std::vector<PackEntry> pack_directory;
 FILE *pack_file;
-size_t pack_base;
+SDL_mutex *pack_lock;
+const uint8_t *pack_map; /* NULL if we have to use stdio */
+size_t pack_map_size;
+
+struct JobState {
+	Job *job;
+	bool done;
+	bool urgent;
+	std::string error;
+};
+
+/* Started jobs in order, and the ones no loader thread has taken yet */
+std::list<JobState> jobs;
+std::list<JobState *> job_queue;
+SDL_mutex *job_lock;
+SDL_cond *job_ready;
+SDL_cond *job_done;
+
+/* Access log for create-pack.py, see trace_pack() */
+FILE *trace_file;
+
+struct LoadStats {
+	double time[NUM_LOAD_STAGES]; /* seconds */
+	size_t bytes_read;
+	size_t bytes_uploaded;
+};
+
+/* See profile_loading() */
+std::string load_profile;
+std::map<std::string, LoadStats> load_stats;
+SDL_mutex *load_stats_lock;
+/* The innermost timer of each thread */
+thread_local LoadTimer *current_timer;
+
 SDL_Surface *screen;
 bool show_fps;
 
+/* Binary search from the directory, NULL if there is no such entry */
+const PackEntry *find_entry(const char *fname)
+{
+	size_t first = 0, last = pack_directory.size();
+	while (first < last) {
+		size_t mid = (first + last) / 2;
+		if (strncmp(pack_directory[mid].name, fname,
+			    sizeof pack_directory[mid].name) < 0) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	if (first == pack_directory.size() ||
+	    strncmp(pack_directory[first].name, fname,
+		    sizeof pack_directory[first].name) != 0) {
+		return NULL;
+	}
+	return &pack_directory[first];
+}
+
+/* Monotonic time in microseconds */
+uint64_t precise_ticks()
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return count.QuadPart * 1000000 / freq.QuadPart;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void write_json_string(FILE *f, const std::string &s)
+{
+	fputc('"', f);
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			fputc('\\', f);
+		}
+		fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+void write_load_stats(FILE *f, const LoadStats &stats)
+{
+	double total = 0;
+	for (int i = 0; i < NUM_LOAD_STAGES; ++i) {
+		total += stats.time[i];
+	}
+	fprintf(f, "\"total_ms\": %.3f, \"io_ms\": %.3f, \"decode_ms\": %.3f, "
+		"\"upload_ms\": %.3f, \"bytes_read\": %lu, "
+		"\"bytes_uploaded\": %lu", total * 1000,
+		stats.time[LOAD_IO] * 1000, stats.time[LOAD_DECODE] * 1000,
+		stats.time[LOAD_UPLOAD] * 1000, (unsigned long) stats.bytes_read,
+		(unsigned long) stats.bytes_uploaded);
+}
+
+void trace_access(const char *event, const PackEntry *entry, size_t offset,
+		  size_t len)
+{
+	if (trace_file == NULL) return;
+
+	SDL_mutexP(pack_lock);
+	fprintf(trace_file, "%u %s %s %u %u\n", SDL_GetTicks(), event,
+		entry->name, (unsigned) offset, (unsigned) len);
+	SDL_mutexV(pack_lock);
+}
+
+void read_raw(size_t offset, void *buf, size_t len)
+{
+	if (pack_map != NULL) {
+		/* The pack is mapped, no need to serialize the readers */
+		assert(offset + len <= pack_map_size);
+		memcpy(buf, &pack_map[offset], len);
+		return;
+	}
+	SDL_mutexP(pack_lock);
+	fseek(pack_file, offset, SEEK_SET);
+	if (fread(buf, 1, len, pack_file) < len) {
+		SDL_mutexV(pack_lock);
+		throw std::runtime_error("Unable to read from pack file");
+	}
+	SDL_mutexV(pack_lock);
+}
+
+/* The asset of a LoadTimer started by the pack, unless an asset is already
+ * being timed */
+const char *timed_asset(const PackEntry *entry)
+{
+	return current_timer != NULL ? NULL : entry->name;
+}
+
+/* Reading the mapped pack happens in page faults. Touching the pages first
+ * makes them count as I/O rather than as the decoding which reads them. */
+void touch_map(size_t offset, size_t len)
+{
+	if (load_profile.empty() || len == 0) return;
+
+	volatile uint8_t sink = 0;
+	for (size_t i = 0; i < len; i += 4096) {
+		sink += pack_map[offset + i];
+	}
+	sink += pack_map[offset + len - 1];
+}
+
+void inflate_entry(const PackEntry *entry, std::vector<uint8_t> *out)
+{
+	std::vector<uint8_t> packed;
+	const uint8_t *src;
+	{
+		LoadTimer timer(timed_asset(entry), LOAD_IO);
+		timer.count(entry->packed_size);
+		if (pack_map != NULL) {
+			touch_map(entry->offset, entry->packed_size);
+			src = &pack_map[entry->offset];
+		} else {
+			packed.resize(entry->packed_size);
+			read_raw(entry->offset, &packed[0],
+				 entry->packed_size);
+			src = &packed[0];
+		}
+	}
+	LoadTimer timer(timed_asset(entry), LOAD_DECODE);
+	out->resize(entry->size);
+	uLongf len = entry->size;
+	if (uncompress(&(*out)[0], &len, src, entry->packed_size) != Z_OK ||
+	    len != entry->size) {
+		throw std::runtime_error(std::string("Corrupted pack entry: ") +
+					 entry->name);
+	}
+}
+
+/* Moves the job to the front of both lists. Must hold job_lock. */
+void hurry(JobState *state)
+{
+	if (state->urgent) return;
+	state->urgent = true;
+	for (auto iter = jobs.begin(); iter != jobs.end(); ++iter) {
+		if (&*iter == state) {
+			/* Splicing keeps the pointers in job_queue valid */
+			jobs.splice(jobs.begin(), jobs, iter);
+			break;
+		}
+	}
+	auto queued = std::find(job_queue.begin(), job_queue.end(), state);
+	if (queued != job_queue.end()) {
+		job_queue.erase(queued);
+		job_queue.push_front(state);
+	}
+}
+
+int loader_thread(void *ptr)
+{
+	(void) ptr;
+	SDL_mutexP(job_lock);
+	while (1) {
+		while (job_queue.empty()) {
+			SDL_CondWait(job_ready, job_lock);
+		}
+		JobState *state = job_queue.front();
+		job_queue.pop_front();
+		SDL_mutexV(job_lock);
+
+		/* Errors are reported in the main thread by finish_jobs() */
+		std::string error;
+		try {
+			state->job->run();
+		} catch (const std::exception &e) {
+			error = e.what();
+		}
+
+		SDL_mutexP(job_lock);
+		state->error = error;
+		state->done = true;
+		SDL_CondSignal(job_done);
+	}
+	return 0;
+}
+
 }
 
 double frand()
@@ -60,7 +319,7 @@ bool get_event(SDL_Event *e)
 				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 				break;
 			case SDLK_F6:
-				quality = (quality + 1) % 3;
+				quality = (quality + 1) % (max_quality + 1);
 				break;
 			case SDLK_F7:
 				show_fps = !show_fps;
@@ -124,42 +383,54 @@ bool match(char *&p, const char *token)
 }
 
 PackFile::PackFile()
-	: m_offset(0),
+	: m_index(0),
+	m_offset(0),
 	m_base(0),
-	m_size(0)
+	m_size(0),
+	m_data(NULL)
 {
 }
 
 void PackFile::open(const char *fname)
 {
-	auto iter = pack_directory.find(fname);
-	if (iter == pack_directory.end()) {
+	const PackEntry *entry = find_entry(fname);
+	if (entry == NULL) {
 		throw std::runtime_error(std::string("Can not find ") +
 					 fname);
 	}
-	PackEntry &entry = iter->second;
+	trace_access("open", entry, 0, entry->size);
+
+	m_index = entry - &pack_directory[0];
 	m_offset = 0;
-	m_base = pack_base + entry.offset;
-	m_size = entry.size;
+	m_base = entry->offset;
+	m_size = entry->size;
+	m_data = NULL;
+	m_buffer.clear();
+
+	if (entry->flags & PACK_DEFLATE) {
+		inflate_entry(entry, &m_buffer);
+	} else if (pack_map != NULL) {
+		assert(m_base + m_size <= pack_map_size);
+		LoadTimer timer(timed_asset(entry), LOAD_IO);
+		timer.count(m_size);
+		touch_map(m_base, m_size);
+		m_data = &pack_map[m_base];
+	}
 }
 
 size_t PackFile::read(void *buf, size_t len)
 {
-	static SDL_mutex *lock;
-	if (lock == NULL) {
-		/* Protection for reading the pack file from multiple threads */
-		lock = SDL_CreateMutex();
-	}
-
 	len = std::min(len, m_size - m_offset);
 	if (len > 0) {
-		SDL_mutexP(lock);
-		fseek(pack_file, m_base + m_offset, SEEK_SET);
-		if (fread(buf, 1, len, pack_file) < len) {
-			SDL_mutexV(lock);
-			throw std::runtime_error("Unable to read from pack file");
-		}
-		SDL_mutexV(lock);
+		trace_access("read", &pack_directory[m_index], m_offset, len);
+	}
+	if (data() != NULL) {
+		memcpy(buf, &data()[m_offset], len);
+	} else if (len > 0) {
+		LoadTimer timer(timed_asset(&pack_directory[m_index]),
+				LOAD_IO);
+		timer.count(len);
+		read_raw(m_base + m_offset, buf, len);
 	}
 	m_offset += len;
 	return len;
@@ -171,37 +442,313 @@ void PackFile::seek(size_t off)
 	m_offset = off;
 }
 
+const uint8_t *file_contents(PackFile *f, std::vector<uint8_t> *buf)
+{
+	const uint8_t *data = f->data();
+	if (data == NULL) {
+		buf->resize(f->size());
+		if (f->read(buf->data(), buf->size()) < buf->size()) {
+			throw std::runtime_error("Truncated file");
+		}
+		data = buf->data();
+	}
+	return data;
+}
+
 void open_pack(const char *fname)
 {
+	/* Protection for reading the pack file from multiple threads */
+	pack_lock = SDL_CreateMutex();
+
 	pack_file = fopen(fname, "rb");
 	if (pack_file == NULL) {
 		throw std::runtime_error(std::string("Can not open ") +
 					 fname);
 	}
 
-	char line[256];
-	fgets(line, sizeof line, pack_file);
-	char *p = line;
-	if (!match(p, "POKE 59458,62")) {
+	PackHeader header;
+	if (fread(&header, sizeof header, 1, pack_file) < 1 ||
+	    memcmp(header.magic, "KAALPACK", sizeof header.magic) != 0) {
 		throw std::runtime_error(std::string("Invalid pack file: ") +
 					 fname);
 	}
+	if (header.version != PACK_VERSION) {
+		throw std::runtime_error(std::string("Unsupported pack version: ") +
+					 fname);
+	}
 
-	size_t offset = 0;
-	while (fgets(line, sizeof line, pack_file)) {
-		char *p = line;
-		if (match(p, "JMP FFFF:0000")) break;
-		std::string name = token(p);
+	pack_directory.resize(header.count);
+	if (header.count > 0 &&
+	    fread(&pack_directory[0], sizeof(PackEntry), header.count,
+		  pack_file) < header.count) {
+		throw std::runtime_error(std::string("Truncated pack file: ") +
+					 fname);
+	}
+	for (PackEntry &entry : pack_directory) {
+		entry.name[sizeof entry.name - 1] = 0;
+	}
+
+#ifndef _WIN32
+	/* Map the whole pack to memory. The stdio path is still there in
+	 * case the mapping fails.
+	 */
+	struct stat st;
+	if (fstat(fileno(pack_file), &st) == 0 && st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			       fileno(pack_file), 0);
+		if (p != MAP_FAILED) {
+			pack_map = (const uint8_t *) p;
+			pack_map_size = st.st_size;
+		}
+	}
+#endif
+}
+
+/* The identical entries are stored once, so their contents start at the
+ * same offset */
+size_t pack_payload(const char *fname)
+{
+	const PackEntry *entry = find_entry(fname);
+	if (entry == NULL) {
+		throw std::runtime_error(std::string("Can not find ") + fname);
+	}
+	return entry->offset;
+}
 
-		PackEntry entry;
-		entry.offset = offset;
-		entry.size = strtoul(p, &p, 10);
-		assert(entry.size > 0);
-		pack_directory[name] = entry;
+bool pack_contains(const char *fname)
+{
+	return find_entry(fname) != NULL;
+}
 
-		offset += entry.size;
+std::vector<std::string> list_pack(const char *suffix)
+{
+	std::vector<std::string> names;
+	size_t len = strlen(suffix);
+	for (const PackEntry &entry : pack_directory) {
+		std::string name = entry.name;
+		if (name.size() >= len &&
+		    name.compare(name.size() - len, len, suffix) == 0) {
+			names.push_back(name);
+		}
 	}
-	pack_base = ftell(pack_file);
+	return names;
+}
+
+void start_job(Job *job, bool urgent)
+{
+	if (job_lock == NULL) {
+		job_lock = SDL_CreateMutex();
+		job_ready = SDL_CreateCond();
+		job_done = SDL_CreateCond();
+		for (int i = 0; i < LOADER_THREADS; ++i) {
+			if (SDL_CreateThread(loader_thread, NULL) == NULL) {
+				throw std::runtime_error(
+					std::string("Can not create thread: ") +
+					SDL_GetError());
+			}
+		}
+	}
+
+	SDL_mutexP(job_lock);
+	JobState state;
+	state.job = job;
+	state.done = false;
+	state.urgent = false;
+	jobs.push_back(state);
+	job_queue.push_back(&jobs.back());
+	if (urgent) {
+		hurry(&jobs.back());
+	}
+	SDL_CondSignal(job_ready);
+	SDL_mutexV(job_lock);
+}
+
+void hurry_job(const Job *job)
+{
+	if (job_lock == NULL) return;
+
+	SDL_mutexP(job_lock);
+	for (JobState &state : jobs) {
+		if (state.job == job) {
+			hurry(&state);
+			break;
+		}
+	}
+	SDL_mutexV(job_lock);
+}
+
+size_t finish_jobs(Uint32 timeout)
+{
+	if (job_lock == NULL) return 0;
+
+	Uint32 start = SDL_GetTicks();
+	size_t count = 0;
+	SDL_mutexP(job_lock);
+	while (!jobs.empty()) {
+		Uint32 elapsed = SDL_GetTicks() - start;
+		JobState *state = &jobs.front();
+		if (!state->done) {
+			if (elapsed >= timeout) break;
+			SDL_CondWaitTimeout(job_done, job_lock,
+					    timeout - elapsed);
+			continue;
+		}
+		/* A job which is done is finished even without time left, and
+		 * so are all the urgent ones which are done */
+		if (elapsed >= timeout && count > 0 && !state->urgent) break;
+		Job *job = state->job;
+		std::string error = state->error;
+		jobs.pop_front();
+		SDL_mutexV(job_lock);
+
+		if (!error.empty()) {
+			delete job;
+			throw std::runtime_error(error);
+		}
+		job->finish();
+		delete job;
+		count++;
+
+		SDL_mutexP(job_lock);
+	}
+	SDL_mutexV(job_lock);
+	return count;
+}
+
+size_t pending_jobs()
+{
+	if (job_lock == NULL) return 0;
+
+	SDL_mutexP(job_lock);
+	size_t count = jobs.size();
+	SDL_mutexV(job_lock);
+	return count;
+}
+
+LoadTimer::LoadTimer(const char *asset, LoadStage stage) :
+	m_stage(stage),
+	m_start(0),
+	m_outer(NULL)
+{
+	if (load_profile.empty()) return;
+
+	m_outer = current_timer;
+	if (asset != NULL) {
+		m_asset = asset;
+	} else if (m_outer != NULL) {
+		m_asset = m_outer->m_asset;
+	} else {
+		m_asset = "unknown";
+	}
+	if (m_outer != NULL) {
+		m_outer->stop();
+	}
+	current_timer = this;
+	m_start = precise_ticks();
+}
+
+LoadTimer::~LoadTimer()
+{
+	if (m_asset.empty()) return;
+
+	stop();
+	current_timer = m_outer;
+	if (m_outer != NULL) {
+		m_outer->m_start = precise_ticks();
+	}
+}
+
+void LoadTimer::stop()
+{
+	uint64_t now = precise_ticks();
+	SDL_mutexP(load_stats_lock);
+	load_stats[m_asset].time[m_stage] += (now - m_start) * 1e-6;
+	SDL_mutexV(load_stats_lock);
+	m_start = now;
+}
+
+void LoadTimer::count(size_t bytes)
+{
+	if (m_asset.empty()) return;
+
+	SDL_mutexP(load_stats_lock);
+	LoadStats &stats = load_stats[m_asset];
+	if (m_stage == LOAD_IO) {
+		stats.bytes_read += bytes;
+	} else if (m_stage == LOAD_UPLOAD) {
+		stats.bytes_uploaded += bytes;
+	}
+	SDL_mutexV(load_stats_lock);
+}
+
+/* Must be called before the loader threads are started */
+void profile_loading(const char *fname)
+{
+	load_profile = fname;
+	load_stats_lock = SDL_CreateMutex();
+}
+
+/* The assets are sorted by the total time, slowest first */
+void write_load_profile()
+{
+	if (load_profile.empty()) return;
+
+	FILE *f = fopen(load_profile.c_str(), "w");
+	if (f == NULL) {
+		throw std::runtime_error("Can not open " + load_profile);
+	}
+
+	SDL_mutexP(load_stats_lock);
+	std::vector<std::pair<double, const std::string *> > order;
+	LoadStats total;
+	memset(&total, 0, sizeof total);
+	for (const auto &iter : load_stats) {
+		const LoadStats &stats = iter.second;
+		double t = 0;
+		for (int i = 0; i < NUM_LOAD_STAGES; ++i) {
+			t += stats.time[i];
+			total.time[i] += stats.time[i];
+		}
+		total.bytes_read += stats.bytes_read;
+		total.bytes_uploaded += stats.bytes_uploaded;
+		order.push_back(std::make_pair(-t, &iter.first));
+	}
+	std::sort(order.begin(), order.end());
+
+	fprintf(f, "{\n\t\"total\": {");
+	write_load_stats(f, total);
+	fprintf(f, "},\n\t\"assets\": [\n");
+	for (size_t i = 0; i < order.size(); ++i) {
+		const std::string &name = *order[i].second;
+		fprintf(f, "\t\t{\"name\": ");
+		write_json_string(f, name);
+		fprintf(f, ", ");
+		write_load_stats(f, load_stats[name]);
+		fprintf(f, "}%s\n", i + 1 < order.size() ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+	fclose(f);
+
+	printf("Slowest assets to load:\n");
+	for (size_t i = 0; i < order.size() && i < 10; ++i) {
+		printf("%10.3f ms  %s\n", -order[i].first * 1000,
+		       order[i].second->c_str());
+	}
+	SDL_mutexV(load_stats_lock);
+}
+
+/* Log every access to the pack in to the given file. create-pack.py can
+ * use the log to lay out the entries in the order they are needed.
+ */
+void trace_pack(const char *fname)
+{
+	trace_file = fopen(fname, "w");
+	if (trace_file == NULL) {
+		throw std::runtime_error(std::string("Can not open ") +
+					 fname);
+	}
+	/* Make sure nothing is lost if the game crashes */
+	setvbuf(trace_file, NULL, _IOLBF, 0);
 }
 
 void finish_draw()
@@ -225,12 +772,24 @@ void finish_draw()
 		glLoadIdentity();
 		glTranslatef(0, scr_height, 0);
 		glColor3f(1, 1, 1);
-		char buf[129];
-		sprintf(buf, "%d faces %5d fps %5d MB memory", (int) faces_drawn, fps,
-			((int) gfx_memory >> 20) + 1);
+		char buf[193];
+		sprintf(buf, "%d faces %d draws %d state changes %d binds %d leaves culled %5d fps %5d MB memory (%d MB saved by indexing)",
+			(int) faces_drawn, (int) draw_calls,
+			(int) state_changes, (int) texture_binds,
+			(int) leaves_culled, fps,
+			((int) gfx_memory >> 20) + 1,
+			(int) (gfx_memory_saved >> 20));
 		small_font.draw_text(buf);
 	}
 	faces_drawn = 0;
+	draw_calls = 0;
+	state_changes = 0;
+	texture_binds = 0;
+	leaves_culled = 0;
+
+	/* Streamed textures and models arrive between the frames */
+	finish_jobs(0);
+	evict_textures();
 
 	SDL_GL_SwapBuffers();
 	check_gl_errors();
@@ -308,6 +867,27 @@ void load_settings()
 		} else if (match(p, "antialiasing")) {
 			antialiasing = strtol(p, &p, 10) > 0;
 
+		} else if (match(p, "compact_vertices")) {
+			compact_vertices = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "compress_textures")) {
+			compress_textures = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "instancing")) {
+			instancing = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "animation_textures")) {
+			animation_textures = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "occlusion_culling")) {
+			occlusion_culling = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "clustered_lighting")) {
+			clustered_lighting = strtol(p, &p, 10) > 0;
+
+		} else if (match(p, "texture_budget")) {
+			texture_budget = strtol(p, &p, 10);
+
 		} else if (match(p, "invert_mouse")) {
 			invert_mouse = strtol(p, &p, 10) > 0;
 		}
@@ -323,6 +903,13 @@ void write_settings()
 	}
 	fprintf(f, "quality %d\n", quality);
 	fprintf(f, "antialiasing %d\n", (int) antialiasing);
+	fprintf(f, "compact_vertices %d\n", (int) compact_vertices);
+	fprintf(f, "compress_textures %d\n", (int) compress_textures);
+	fprintf(f, "instancing %d\n", (int) instancing);
+	fprintf(f, "animation_textures %d\n", (int) animation_textures);
+	fprintf(f, "occlusion_culling %d\n", (int) occlusion_culling);
+	fprintf(f, "clustered_lighting %d\n", (int) clustered_lighting);
+	fprintf(f, "texture_budget %d\n", texture_budget);
 	fprintf(f, "invert_mouse %d\n", (int) invert_mouse);
 	fclose(f);
 }
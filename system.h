@@ -10,8 +10,11 @@
 #ifndef __system_h
 #define __system_h
 
+#include "utils.h"
 #include <SDL.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 class Font;
 
@@ -19,6 +22,13 @@ class PackFile {
 public:
 	size_t offset() const { return m_offset; }
 	size_t size() const { return m_size; }
+	/* Direct view to the contents, or NULL if the pack is not mapped */
+	const uint8_t *data() const
+	{
+		return m_buffer.empty() ? m_data : &m_buffer[0];
+	}
+	/* The contents are in the mapped pack and outlive the PackFile */
+	bool mapped() const { return m_buffer.empty() && m_data != NULL; }
 
 	PackFile();
 	void open(const char *fname);
@@ -26,14 +36,70 @@ public:
 	void seek(size_t off);
 
 private:
+	size_t m_index;
 	size_t m_offset;
 	size_t m_base;
 	size_t m_size;
+	const uint8_t *m_data;
+	std::vector<uint8_t> m_buffer; /* decompressed entry */
+};
+
+/* Whole contents of an opened file. Points directly to the pack if it is
+ * mapped, otherwise the file is read to the buffer.
+ */
+const uint8_t *file_contents(PackFile *f, std::vector<uint8_t> *buf);
+
+/* Work for the loader threads. run() is called in a loader thread and
+ * finish() later in the main thread, where OpenGL can be used.
+ */
+class Job {
+public:
+	virtual ~Job() {}
+	virtual void run() = 0;
+	virtual void finish() = 0;
+};
+
+enum LoadStage {
+	LOAD_IO,
+	LOAD_DECODE,
+	LOAD_UPLOAD,
+	NUM_LOAD_STAGES
+};
+
+/* Measures a stage of loading an asset while it is in scope, if enabled
+ * with profile_loading(). A timer pauses the one it is nested in, so each
+ * stage gets only its own time. Without an asset name, the time goes to the
+ * asset of the enclosing timer.
+ */
+class LoadTimer {
+public:
+	LoadTimer(const char *asset, LoadStage stage);
+	~LoadTimer();
+	/* Bytes read from the pack for LOAD_IO or uploaded for LOAD_UPLOAD */
+	void count(size_t bytes);
+
+private:
+	std::string m_asset; /* empty if not profiling */
+	LoadStage m_stage;
+	uint64_t m_start;
+	LoadTimer *m_outer;
+
+	void stop();
+
+	DISALLOW_COPY_AND_ASSIGN(LoadTimer);
 };
 
 extern int scr_width, scr_height;
 extern int quality;
+extern int max_quality;
 extern bool antialiasing;
+extern bool compact_vertices;
+extern bool compress_textures;
+extern bool instancing;
+extern bool animation_textures;
+extern bool occlusion_culling;
+extern bool clustered_lighting;
+extern int texture_budget;
 extern bool invert_mouse;
 extern Font small_font;
 extern Font large_font;
@@ -45,6 +111,27 @@ bool get_event(SDL_Event *e);
 std::string token(char *&p);
 bool match(char *&p, const char *token);
 void open_pack(const char *fname);
+/* Identical entries share their contents in the pack. Returns an identifier
+ * which is the same for all such entries. */
+size_t pack_payload(const char *fname);
+bool pack_contains(const char *fname);
+/* Names of the entries which end with the suffix */
+std::vector<std::string> list_pack(const char *suffix);
+void trace_pack(const char *fname);
+/* Takes the ownership of the job. An urgent job is run and finished before
+ * the jobs which have not been started yet. */
+void start_job(Job *job, bool urgent = false);
+/* Makes the job urgent if it has not been finished yet */
+void hurry_job(const Job *job);
+/* Finishes jobs in the order they were started, waiting for them at most
+ * the given time. The first job is finished if it is done, even if the time
+ * is up, and so are the urgent jobs at the front. Returns the number of
+ * finished jobs. */
+size_t finish_jobs(Uint32 timeout);
+size_t pending_jobs();
+/* Writes the load times to the file as JSON at write_load_profile() */
+void profile_loading(const char *fname);
+void write_load_profile();
 void finish_draw();
 void init_system(bool windowed);
 void load_settings();
@@ -9,12 +9,152 @@
  */
 #include "world.h"
 #include "gfx.h"
+#include "effects.h"
 #include "system.h"
+#include <string.h>
+#include <stdexcept>
 
 namespace {
 
 size_t visibility_test;
 
+/* Projected radius in pixels below which the next level of detail is used */
+const double LOD_SIZES[] = {100, 50, 25};
+/* How far past a limit the size must go, so that models do not flicker
+ * between the levels */
+const double LOD_HYSTERESIS = 0.2;
+/* Visible leaves are tested again after this many frames and some more */
+const size_t VISIBLE_TEST_INTERVAL = 4;
+/* Leaves closer than this to the camera are not tested (near plane is 1) */
+const double OCCLUSION_MARGIN = 2;
+
+/* Potentially visible sets, see World::build_pvs(). All integers are little
+ * endian:
+ *
+ *   header   "KPVS", u32 version, u32 number of leaves, u32 hash of the
+ *            leaf boxes (see World::tree_hash())
+ *   leaves   u32 size, followed by the compressed bits of the leaves which
+ *            are visible from the leaf
+ *
+ * The bits are compressed by replacing each run of zero bytes by a zero and
+ * the length of the run (1-255).
+ */
+struct PvsHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t leaves;
+	uint32_t hash;
+};
+const uint32_t PVS_VERSION = 1;
+const int BSP_DEPTH = 10;
+/* Rays between random points of two leaves, until one is not blocked */
+const int PVS_SAMPLES = 64;
+/* More rays between the leaves which the samples found hidden. Whatever
+ * they see is added to the sets, since a leaf wrongly marked hidden pops in
+ * when it is entered. */
+const int PVS_CHECK_SAMPLES = 128;
+
+std::vector<uint8_t> compress_pvs(const uint8_t *bits, size_t len)
+{
+	std::vector<uint8_t> out;
+	for (size_t i = 0; i < len; ++i) {
+		out.push_back(bits[i]);
+		if (bits[i] != 0) continue;
+		size_t run = 1;
+		while (i + run < len && bits[i + run] == 0 && run < 255) {
+			run++;
+		}
+		out.push_back(run);
+		i += run - 1;
+	}
+	return out;
+}
+
+void decompress_pvs(const uint8_t *data, size_t size, uint8_t *bits,
+		    size_t len)
+{
+	size_t j = 0;
+	for (size_t i = 0; i < size && j < len; ++i) {
+		if (data[i] != 0) {
+			bits[j++] = data[i];
+		} else if (i + 1 < size) {
+			size_t run = data[++i];
+			while (run-- > 0 && j < len) {
+				bits[j++] = 0;
+			}
+		}
+	}
+	if (j < len) {
+		throw std::runtime_error("Truncated visible sets");
+	}
+}
+
+bool leaf_visible(const uint8_t *visible, const World::Tree *tree)
+{
+	return visible == NULL ||
+		(visible[tree->leaf >> 3] & (1 << (tree->leaf & 7)));
+}
+
+/* Separate from rand(), which the game uses. The same on every run, so that
+ * the sets can be rebuilt identically. */
+double next_random(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return ((*seed >> 8) & 0xffff) / 65536.0;
+}
+
+vec3 random_point(const World::Tree *tree, uint32_t *seed)
+{
+	vec3 size = tree->box_max - tree->box_min;
+	return tree->box_min + vec3(size.x * next_random(seed),
+				    size.y * next_random(seed),
+				    size.z * next_random(seed));
+}
+
+bool boxes_touch(const World::Tree *a, const World::Tree *b)
+{
+	const double e = 1e-3;
+	return a->box_min.x <= b->box_max.x + e &&
+		a->box_min.y <= b->box_max.y + e &&
+		a->box_min.z <= b->box_max.z + e &&
+		b->box_min.x <= a->box_max.x + e &&
+		b->box_min.y <= a->box_max.y + e &&
+		b->box_min.z <= a->box_max.z + e;
+}
+
+/* Whether an opaque face of the leaves crossed by the segment blocks it */
+bool blocked(const vec3 &a, const vec3 &b, const World::Tree *tree,
+	     const std::vector<std::vector<CollFace>> &occluders)
+{
+	vec3 seg_min = min(a, b);
+	vec3 seg_max = max(a, b);
+	if (seg_max.x < tree->box_min.x || seg_max.y < tree->box_min.y ||
+	    seg_max.z < tree->box_min.z || seg_min.x > tree->box_max.x ||
+	    seg_min.y > tree->box_max.y || seg_min.z > tree->box_max.z) {
+		return false;
+	}
+	if (!tree->model.loaded()) {
+		for (int i = 0; i < 2; ++i) {
+			if (tree->children[i] != NULL &&
+			    blocked(a, b, tree->children[i], occluders)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	vec3 d = b - a;
+	for (const CollFace &f : occluders[tree->leaf]) {
+		double div = dot(f.norm, d);
+		if (fabs(div) < 1e-8) continue;
+		double t = dot(f.vert[0] - a, f.norm) / div;
+		if (t > 1e-4 && t < 1 - 1e-4 && inside(f, a + d * t)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 }
 
 Light::Light() :
@@ -85,6 +225,8 @@ Object::Object() :
 	m_vel(0, 0, 0),
 	m_matrix(vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)),
 	m_model(NULL),
+	m_lowres(NULL),
+	m_lod(0),
 	m_visited(0),
 	m_anim(0),
 	m_lights_on(true),
@@ -199,26 +341,52 @@ void Object::render(const Camera &camera, int flags, size_t counter,
 		flags |= RENDER_LIGHTS_ON;
 	}
 
-	vec3 delta = m_pos + m_offset - camera.pos;
+	/* Shadow volumes follow the level of the model */
+	if (!(flags & RENDER_SHADOW_VOL)) {
+		update_lod(camera);
+	}
+
+	const Model *model = m_model;
+	size_t lod = m_lod;
+	if (lod > 0 && m_lowres != NULL) {
+		/* The object is far away - Draw lowpoly version */
+		model = m_lowres;
+		lod--;
+	}
 
 	vec3 pos = m_pos + m_offset;
 	glLoadIdentity();
 	glTranslatef(pos.x, pos.y, pos.z);
 	mult_matrix(m_matrix);
-	if (delta > 100 && m_lowres != NULL) {
-		/* The object is very far away - Draw lowpoly version */
-		if (!m_replace_name.empty()) {
-			*m_lowres->get_material(m_replace_name.c_str()) =
-				*m_replace_mat;
-		}
-		m_lowres->render(flags, m_anim, ambient);
-	} else {
-		if (!m_replace_name.empty()) {
-			*m_model->get_material(m_replace_name.c_str()) =
-				*m_replace_mat;
-		}
-		m_model->render(flags, m_anim, ambient);
+	if (!m_replace_name.empty()) {
+		*model->get_material(m_replace_name.c_str()) = *m_replace_mat;
+	}
+	model->render(flags, m_anim, ambient, lod);
+}
+
+/* The level of detail is chosen by the size of the model on the screen. The
+ * hand made lowpoly version comes after the full model.
+ */
+void Object::update_lod(const Camera &camera)
+{
+	size_t levels = m_model->num_lods();
+	if (m_lowres != NULL) {
+		levels = m_lowres->num_lods() + 1;
+	}
+	levels = std::min(levels, lengthof(LOD_SIZES) + 1);
+
+	double dist = std::max(length(m_world_pos - camera.pos), 1.0);
+	double size = m_model->rad() * scr_height / (2 * camera.fov_y * dist);
+	while (m_lod + 1 < levels &&
+	       size < LOD_SIZES[m_lod] * (1 - LOD_HYSTERESIS)) {
+		m_lod++;
 	}
+	while (m_lod > 0 &&
+	       size > LOD_SIZES[m_lod - 1] * (1 + LOD_HYSTERESIS)) {
+		m_lod--;
+	}
+	/* The model may have changed */
+	m_lod = std::min(m_lod, levels - 1);
 }
 
 bool Object::raytrace(const vec3 &pos, const vec3 &ray, double *dist) const
@@ -379,7 +547,10 @@ void Object::set_lights_on(bool on)
 }
 
 World::World()
-	: m_ambient(0.1, 0.1, 0.1)
+	: m_ambient(0.1, 0.1, 0.1),
+	m_frame(0),
+	m_test_seed(1),
+	m_visible(NULL)
 {
 }
 
@@ -390,9 +561,40 @@ void World::set_ambient(const Color &c)
 
 void World::render(const Camera &camera, int flags)
 {
+	/* The leaves are drawn front to back, so sort only the opaque ones
+	 * by state. Shadow volumes depend on the order of the stencil
+	 * operations, so they are drawn as they come.
+	 */
+	bool queued = !(flags & RENDER_SHADOW_VOL);
+	if (queued) {
+		begin_queue(!(flags & RENDER_GLASS));
+	}
+	bool opaque = !(flags & (RENDER_BLOOM | RENDER_GLASS |
+				 RENDER_SHADOW_VOL));
+	if (opaque) {
+		m_frame++;
+	}
+	/* Shadow volumes of the hidden leaves may fall on the visible ones */
+	m_visible = flags & RENDER_SHADOW_VOL ? NULL :
+		potentially_visible(camera.pos);
 	if (flags & (RENDER_BLOOM | RENDER_SHADOW_VOL)) {
 		/* Drawing bloom - Don't bother with lights */
 		begin_rendering(0, flags, camera.pos);
+	} else if (quality >= 3 && !(flags & RENDER_GLASS)) {
+		/* The lights are added to the pixels afterwards, so their
+		 * cost follows the area they cover */
+		begin_gbuffer();
+		flags |= RENDER_DEFERRED;
+	} else if (clustered_lighting && quality >= 2) {
+		/* Every pixel gets all the lights which reach it, instead
+		 * of the nearest ones of its leaf */
+		begin_clusters();
+		for (const Light *light : m_lights) {
+			add_cluster_light(light->pos(), light->color(),
+					  light->brightness());
+		}
+		upload_clusters();
+		flags |= RENDER_CLUSTERED;
 	}
 
 	render(NULL, camera, flags);
@@ -400,6 +602,126 @@ void World::render(const Camera &camera, int flags)
 	if (flags & (RENDER_BLOOM | RENDER_SHADOW_VOL)) {
 		end_rendering();
 	}
+	if (queued) {
+		flush_queue();
+	}
+	if (opaque) {
+		test_occlusion();
+	}
+	if (flags & RENDER_DEFERRED) {
+		/* The back faces of the light volumes are drawn. The world
+		 * is drawn with GL_CULL_FACE, and without clamping the far
+		 * plane would cut the volumes which reach past it. */
+		GLState gl;
+		gl.enable(GL_DEPTH_CLAMP);
+		begin_lighting();
+		for (const Light *light : m_lights) {
+			draw_light_volume(light->pos(), light->color(),
+					  light->brightness());
+		}
+		end_lighting();
+	}
+}
+
+/* Coherent hierarchical culling, simplified: the leaves which were hidden in
+ * the previous test are skipped. Hidden leaves are tested every frame and
+ * visible ones every few frames, at random so that the tests are spread out.
+ * The glass and bloom passes skip the leaves of the last opaque pass. Shadow
+ * volumes of hidden leaves can still be seen, so they are always drawn.
+ */
+bool World::occluded(Tree *tree, const Camera &camera)
+{
+	if (!occlusion_culling) return false;
+
+	if (tree->query_pending) {
+		GLuint available = 0;
+		glGetQueryObjectuivARB(tree->query,
+				       GL_QUERY_RESULT_AVAILABLE_ARB,
+				       &available);
+		if (available) {
+			GLuint samples = 0;
+			glGetQueryObjectuivARB(tree->query,
+					       GL_QUERY_RESULT_ARB, &samples);
+			tree->occluded = samples == 0;
+			tree->query_pending = false;
+		}
+	}
+
+	/* The box would be clipped by the near plane */
+	vec3 margin(OCCLUSION_MARGIN, OCCLUSION_MARGIN, OCCLUSION_MARGIN);
+	vec3 box_min = tree->box_min - margin;
+	vec3 box_max = tree->box_max + margin;
+	if (camera.pos.x > box_min.x && camera.pos.x < box_max.x &&
+	    camera.pos.y > box_min.y && camera.pos.y < box_max.y &&
+	    camera.pos.z > box_min.z && camera.pos.z < box_max.z) {
+		tree->occluded = false;
+		tree->next_test = m_frame + VISIBLE_TEST_INTERVAL;
+		return false;
+	}
+
+	if (!tree->query_pending &&
+	    (tree->occluded || m_frame >= tree->next_test)) {
+		m_occlusion_tests.push_back(tree);
+	}
+	return tree->occluded;
+}
+
+/* Draws the boxes of the leaves to test after the opaque geometry */
+void World::test_occlusion()
+{
+	if (m_occlusion_tests.empty()) return;
+
+	GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+	glDisable(GL_CULL_FACE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glPushMatrix();
+	glLoadIdentity();
+
+	for (Tree *tree : m_occlusion_tests) {
+		if (tree->query == 0) {
+			glGenQueriesARB(1, &tree->query);
+		}
+		const vec3 &a = tree->box_min;
+		const vec3 &b = tree->box_max;
+		glBeginQueryARB(GL_SAMPLES_PASSED_ARB, tree->query);
+		glBegin(GL_QUAD_STRIP);
+		glVertex3f(a.x, a.y, a.z);
+		glVertex3f(a.x, b.y, a.z);
+		glVertex3f(b.x, a.y, a.z);
+		glVertex3f(b.x, b.y, a.z);
+		glVertex3f(b.x, a.y, b.z);
+		glVertex3f(b.x, b.y, b.z);
+		glVertex3f(a.x, a.y, b.z);
+		glVertex3f(a.x, b.y, b.z);
+		glVertex3f(a.x, a.y, a.z);
+		glVertex3f(a.x, b.y, a.z);
+		glEnd();
+		glBegin(GL_QUADS);
+		glVertex3f(a.x, a.y, a.z);
+		glVertex3f(b.x, a.y, a.z);
+		glVertex3f(b.x, a.y, b.z);
+		glVertex3f(a.x, a.y, b.z);
+		glVertex3f(a.x, b.y, a.z);
+		glVertex3f(a.x, b.y, b.z);
+		glVertex3f(b.x, b.y, b.z);
+		glVertex3f(b.x, b.y, a.z);
+		glEnd();
+		glEndQueryARB(GL_SAMPLES_PASSED_ARB);
+
+		tree->query_pending = true;
+		tree->next_test = m_frame + VISIBLE_TEST_INTERVAL +
+			(size_t) (next_random(&m_test_seed) *
+				  VISIBLE_TEST_INTERVAL);
+	}
+	m_occlusion_tests.clear();
+
+	glPopMatrix();
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	if (cull_face) {
+		glEnable(GL_CULL_FACE);
+	}
 }
 
 void World::load(const char *fname)
@@ -413,7 +735,197 @@ void World::load(const char *fname)
 			iter.second->color.a = 0;
 		}
 	}
-	build_tree(&mesh, 10);
+	LoadTimer timer(fname, LOAD_DECODE);
+	build_tree(&mesh, BSP_DEPTH);
+	load_pvs((std::string(fname, strlen(fname) - 4) + ".pvs").c_str());
+}
+
+/* Identifies the tree which the visible sets were built for */
+uint32_t World::tree_hash() const
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	for (const Tree *tree : m_leaves) {
+		const uint8_t *p = (const uint8_t *) &tree->box_min;
+		for (size_t i = 0; i < sizeof(vec3); ++i) {
+			hash = (hash ^ p[i]) * 16777619u;
+		}
+		p = (const uint8_t *) &tree->box_max;
+		for (size_t i = 0; i < sizeof(vec3); ++i) {
+			hash = (hash ^ p[i]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+void World::load_pvs(const char *fname)
+{
+	m_pvs.clear();
+	if (!pack_contains(fname)) {
+		printf("No visible sets: %s\n", fname);
+		return;
+	}
+	PackFile f;
+	f.open(fname);
+	std::vector<uint8_t> buf;
+	const uint8_t *data = file_contents(&f, &buf);
+	size_t left = f.size();
+	if (left < sizeof(PvsHeader)) {
+		throw std::runtime_error(std::string("Truncated visible sets: ") +
+					 fname);
+	}
+
+	PvsHeader header;
+	memcpy(&header, data, sizeof header);
+	data += sizeof header;
+	left -= sizeof header;
+	if (memcmp(header.magic, "KPVS", 4) != 0 ||
+	    header.version != PVS_VERSION ||
+	    header.leaves != m_leaves.size() || header.hash != tree_hash()) {
+		/* Run "kaal -build-pvs" again */
+		printf("%s does not match the level\n", fname);
+		return;
+	}
+
+	size_t row = (m_leaves.size() + 7) / 8;
+	m_pvs.resize(row * m_leaves.size());
+	for (size_t i = 0; i < m_leaves.size(); ++i) {
+		uint32_t size;
+		if (left < sizeof size) {
+			throw std::runtime_error("Truncated visible sets");
+		}
+		memcpy(&size, data, sizeof size);
+		data += sizeof size;
+		left -= sizeof size;
+		if (left < size) {
+			throw std::runtime_error("Truncated visible sets");
+		}
+		decompress_pvs(data, size, &m_pvs[i * row], row);
+		data += size;
+		left -= size;
+	}
+}
+
+/* Samples rays between the leaves of the level. The world must be loaded
+ * from the same file, with the translucent materials set up. */
+void World::build_pvs(const char *fname, const char *out) const
+{
+	Mesh mesh;
+	load_mesh(&mesh, fname);
+
+	/* Translucent faces do not hide anything */
+	std::unordered_set<const Material *> translucent;
+	for (auto iter : mesh.materials) {
+		auto mat = m_materials.find(iter.first);
+		if (mat != m_materials.end() && mat->second->color.a < 1) {
+			translucent.insert(iter.second);
+		}
+	}
+	std::vector<std::vector<CollFace>> occluders(m_leaves.size());
+	for (const Face &f : mesh.faces) {
+		if (translucent.count(f.mat)) continue;
+		CollFace coll;
+		coll.norm = normalize(cross(f.vert[1].vert - f.vert[0].vert,
+					    f.vert[2].vert - f.vert[0].vert));
+		if (coll.norm < 1e-4) continue;
+		vec3 face_min = f.vert[0].vert;
+		vec3 face_max = f.vert[0].vert;
+		for (int i = 0; i < 3; ++i) {
+			coll.vert[i] = f.vert[i].vert;
+			vec3 d = f.vert[(i + 1) % 3].vert - f.vert[i].vert;
+			coll.edges[i] = normalize(cross(coll.norm, d));
+			face_min = min(face_min, f.vert[i].vert);
+			face_max = max(face_max, f.vert[i].vert);
+		}
+		for (const Tree *tree : m_leaves) {
+			if (face_max.x >= tree->box_min.x &&
+			    face_max.y >= tree->box_min.y &&
+			    face_max.z >= tree->box_min.z &&
+			    face_min.x <= tree->box_max.x &&
+			    face_min.y <= tree->box_max.y &&
+			    face_min.z <= tree->box_max.z) {
+				occluders[tree->leaf].push_back(coll);
+			}
+		}
+	}
+
+	size_t row = (m_leaves.size() + 7) / 8;
+	std::vector<uint8_t> pvs(row * m_leaves.size());
+	uint32_t seed = 1, check_seed = 2;
+	size_t visible_pairs = 0, missed = 0;
+	Uint32 start = SDL_GetTicks();
+	for (size_t i = 0; i < m_leaves.size(); ++i) {
+		printf("Visible sets of %s: %d/%d\n", fname, (int) i,
+		       (int) m_leaves.size());
+		for (size_t j = i; j < m_leaves.size(); ++j) {
+			const Tree *a = m_leaves[i];
+			const Tree *b = m_leaves[j];
+			bool visible = boxes_touch(a, b);
+			for (int k = 0; k < PVS_SAMPLES && !visible; ++k) {
+				vec3 from = random_point(a, &seed);
+				vec3 to = random_point(b, &seed);
+				visible = !blocked(from, to, &m_root,
+						   occluders);
+			}
+			for (int k = 0; k < PVS_CHECK_SAMPLES && !visible;
+			     ++k) {
+				vec3 from = random_point(a, &check_seed);
+				vec3 to = random_point(b, &check_seed);
+				if (!blocked(from, to, &m_root, occluders)) {
+					visible = true;
+					missed++;
+				}
+			}
+			if (visible) {
+				pvs[i * row + (j >> 3)] |= 1 << (j & 7);
+				pvs[j * row + (i >> 3)] |= 1 << (i & 7);
+				visible_pairs++;
+			}
+		}
+	}
+	/* Many misses mean that PVS_SAMPLES is too small for the level */
+	printf("%s: %d of %d visible pairs found only by the check, %.1f s\n",
+	       fname, (int) missed, (int) visible_pairs,
+	       (SDL_GetTicks() - start) * 0.001);
+
+	FILE *f = fopen(out, "wb");
+	if (f == NULL) {
+		throw std::runtime_error(std::string("Can not write ") + out);
+	}
+	PvsHeader header;
+	memcpy(header.magic, "KPVS", 4);
+	header.version = PVS_VERSION;
+	header.leaves = m_leaves.size();
+	header.hash = tree_hash();
+	fwrite(&header, sizeof header, 1, f);
+	for (size_t i = 0; i < m_leaves.size(); ++i) {
+		std::vector<uint8_t> data = compress_pvs(&pvs[i * row], row);
+		uint32_t size = data.size();
+		fwrite(&size, sizeof size, 1, f);
+		fwrite(data.data(), data.size(), 1, f);
+	}
+	fclose(f);
+	printf("Wrote %s\n", out);
+}
+
+/* The set of the leaf where the position is, or NULL if everything may be
+ * visible */
+const uint8_t *World::potentially_visible(const vec3 &pos) const
+{
+	if (m_pvs.empty() ||
+	    pos.x < m_root.box_min.x || pos.y < m_root.box_min.y ||
+	    pos.z < m_root.box_min.z || pos.x > m_root.box_max.x ||
+	    pos.y > m_root.box_max.y || pos.z > m_root.box_max.z) {
+		return NULL;
+	}
+	const Tree *tree = &m_root;
+	while (!tree->model.loaded()) {
+		const Tree *child =
+			tree->children[dot(pos, tree->plane.norm) > tree->plane.pos];
+		if (child == NULL) return NULL;
+		tree = child;
+	}
+	return &m_pvs[tree->leaf * ((m_leaves.size() + 7) / 8)];
 }
 
 void World::register_lights()
@@ -456,7 +968,19 @@ Material *World::get_material(const char *name)
 void World::build_leaf(Tree *tree, const Mesh *mesh,
 			const std::list<Face> &faces)
 {
-	tree->model.load(mesh, faces, true);
+	std::vector<Face> leaf(faces.begin(), faces.end());
+	tree->leaf = m_leaves.size();
+	m_leaves.push_back(tree);
+	tree->query = 0;
+	tree->query_pending = false;
+	tree->occluded = false;
+	tree->next_test = 0;
+	tree->model.load(mesh, leaf, true);
+	/* Counted for the level, see World::load() */
+	LoadTimer timer(NULL, LOAD_UPLOAD);
+	size_t memory = gfx_memory;
+	tree->model.upload();
+	timer.count(gfx_memory - memory);
 }
 
 void World::split_faces(const std::list<Face> &faces, const Tree *tree,
@@ -519,8 +1043,9 @@ void World::build_tree(const Mesh *mesh, int max_depth)
 	}
 
 	printf("BSP depth %d\n", max_depth);
+	m_leaves.clear();
 	Step step;
-	step.faces = mesh->faces;
+	step.faces.assign(mesh->faces.begin(), mesh->faces.end());
 	step.depth = 0;
 	step.tree = &m_root;
 	queue.push_back(step);
@@ -652,6 +1177,9 @@ void World::render(Tree *tree, const Camera &camera, int flags)
 		tree = &m_root;
 		visibility_test++;
 	}
+	if (tree->model.loaded() && !leaf_visible(m_visible, tree)) {
+		return;
+	}
 
 	for (int i = 0; i < 5; ++i) {
 		vec3 p(camera.frustum[i].norm.x > 0 ? tree->box_max.x : tree->box_min.x,
@@ -686,8 +1214,17 @@ void World::render(Tree *tree, const Camera &camera, int flags)
 		return;
 	}
 
+	if (flags & (RENDER_BLOOM | RENDER_GLASS)) {
+		if (occlusion_culling && tree->occluded) return;
+	} else if (!(flags & RENDER_SHADOW_VOL) && occluded(tree, camera)) {
+		leaves_culled++;
+		return;
+	}
+
 	GLState gl;
-	if (!(flags & (RENDER_BLOOM | RENDER_SHADOW_VOL))) {
+	if (flags & (RENDER_CLUSTERED | RENDER_DEFERRED)) {
+		begin_rendering(0, flags);
+	} else if (!(flags & (RENDER_BLOOM | RENDER_SHADOW_VOL))) {
 		/* We need to restart rendering for each leaf since the number
 		 * of lights can change.
 		 */
@@ -702,9 +1239,17 @@ void World::render(Tree *tree, const Camera &camera, int flags)
 		if (quality == 0) {
 			numlights = std::min<size_t>(numlights, 8);
 		}
+		/* The sum of the lights does not depend on their order. Given
+		 * in a fixed order, the leaves lit by the same lights share a
+		 * light set, and so can the instances in them. */
+		const Light *lights[MAX_LIGHTS];
+		std::copy(tree->remote_lights.begin(),
+			  tree->remote_lights.begin() + numlights, lights);
+		std::sort(lights, lights + numlights,
+			  std::less<const Light *>());
 		begin_rendering(numlights, flags);
 		for (size_t i = 0; i < numlights; ++i) {
-			tree->remote_lights[i]->program(i);
+			lights[i]->program(i);
 		}
 	}
 
@@ -721,6 +1266,7 @@ void World::render(Tree *tree, const Camera &camera, int flags)
 void World::sweep(const Camera &camera, std::unordered_set<Object *> *objs) const
 {
 	visibility_test++;
+	const uint8_t *visible = potentially_visible(camera.pos);
 
 	std::list<const Tree *> queue;
 	queue.push_back(&m_root);
@@ -728,6 +1274,9 @@ void World::sweep(const Camera &camera, std::unordered_set<Object *> *objs) cons
 		const Tree *tree = queue.front();
 		queue.pop_front();
 
+		if (tree->model.loaded() && !leaf_visible(visible, tree)) {
+			continue;
+		}
 		bool in_frustum = true;
 		for (int i = 0; i < 5; ++i) {
 			vec3 p(camera.frustum[i].norm.x > 0 ? tree->box_max.x : tree->box_min.x,
@@ -767,6 +1316,11 @@ void World::register_light(Light *light, bool add)
 {
 	double rad = light->brightness() * LIGHT_MAX_DIST;
 	assert(rad > 0);
+	if (add) {
+		m_lights.insert(light);
+	} else {
+		m_lights.erase(light);
+	}
 
 	std::list<Tree *> queue;
 	queue.push_back(&m_root);
@@ -917,4 +1471,5 @@ void prepare_camera(Camera *camera, double fov_x, double fov_y, double dist)
 		camera->frustum[i].pos = dot(camera->pos, camera->frustum[i].norm);
 	}
 	camera->frustum[4].pos -= dist;
+	camera->fov_y = fov_y;
 }
@@ -17,6 +17,7 @@ struct Camera {
 	Matrix matrix;
 	Plane frustum[5];
 	vec3 pos;
+	double fov_y; /* half of the view height at distance 1 */
 };
 
 class World;
@@ -28,6 +29,7 @@ class Light {
 public:
 	vec3 pos() const { return m_pos; }
 	double brightness() const { return m_brightness; }
+	Color color() const { return m_color; }
 
 	Light();
 
@@ -82,6 +84,7 @@ private:
 	vec3 m_offset;
 	const Model *m_model;
 	const Model *m_lowres;
+	size_t m_lod;
 	size_t m_visited;
 	bool m_grounded;
 	std::list<Light> m_lights;
@@ -91,6 +94,8 @@ private:
 	bool m_lights_on;
 	World *m_world;
 	vec3 m_world_pos;
+
+	void update_lod(const Camera &camera);
 };
 
 class World {
@@ -104,6 +109,13 @@ public:
 		Plane plane;
 		Tree *children[2];
 		bool sorted;
+		/* Occlusion query of the bounding box, the result is used
+		 * in the next frame. See World::test_occlusion(). */
+		GLuint query;
+		bool query_pending;
+		bool occluded;
+		size_t next_test; /* frame, while the leaf is visible */
+		size_t leaf; /* index in the potentially visible sets */
 	};
 
 	World();
@@ -111,6 +123,7 @@ public:
 	void render(const Camera &camera, int flags);
 	void sweep(const Camera &camera, std::unordered_set<Object *> *objs) const;
 	void load(const char *fname);
+	void build_pvs(const char *fname, const char *out) const;
 	void register_lights();
 	bool raytrace(const vec3 &pos, const vec3 &ray,
 		      double *dist, const CollFace **face = NULL,
@@ -130,10 +143,25 @@ private:
 	void split_faces(const std::list<Face> &faces, const Tree *tree,
 			 int side, std::list<Face> *out);
 	void build_tree(const Mesh *mesh, int max_depth);
+	uint32_t tree_hash() const;
+	void load_pvs(const char *fname);
+	const uint8_t *potentially_visible(const vec3 &pos) const;
 	void render(Tree *tree, const Camera &camera, int flags);
+	bool occluded(Tree *tree, const Camera &camera);
+	void test_occlusion();
 
 	Color m_ambient;
 	Tree m_root;
+	size_t m_frame;
+	uint32_t m_test_seed;
+	std::vector<Tree *> m_occlusion_tests;
+	/* The leaves in the order they were built, and a bit for each leaf
+	 * in the set of each leaf, or empty. See build_pvs(). */
+	std::vector<Tree *> m_leaves;
+	std::vector<uint8_t> m_pvs;
+	const uint8_t *m_visible; /* from the camera, while rendering */
+	/* All registered lights, for the clustered lighting */
+	std::unordered_set<Light *> m_lights;
 	std::unordered_map<std::string, Material *> m_materials;
 };
 